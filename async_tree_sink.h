@@ -0,0 +1,208 @@
+#ifndef __async_tree_sink_h
+#define __async_tree_sink_h
+
+#include <cassert>
+#include <deque>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+
+#include "tree_sink.h"
+
+// asynchronous output: the trees are collected into batches on the compute threads and the batches
+// are written to the target sink by writer threads, so the compute threads do not wait for the
+// file system (file creation and writes on network file systems can take milliseconds per tree).
+//
+// At most max_queued batches wait for the writers; the compute threads block when the queue is
+// full (backpressure, the memory of the queued trees is bounded). The batches are handed to the
+// writers in the order in which they were filled. With a single writer they are also written in
+// this order, which is what the tree archive needs. More writers write batches concurrently, which
+// is only allowed for targets like the file_tree_sink that accept concurrent writes of different
+// keys.
+//
+// Errors of the writers are reported by a later write, flush or close.
+class async_tree_sink : public tree_sink {
+public:
+    // target is not owned and must outlive this sink
+    async_tree_sink( tree_sink &target, size_t num_writers, size_t batch_size = 1024 * 1024, size_t max_queued = 64 )
+      : target_(target),
+        batch_size_(batch_size),
+        max_queued_(max_queued),
+        current_(new buffered_tree_sink()),
+        writing_(0),
+        stop_(false),
+        closed_(false)
+    {
+        assert( num_writers >= 1 && max_queued >= 1 );
+
+        for( size_t i = 0; i < num_writers; ++i ) {
+            writers_.create_thread( boost::bind( &async_tree_sink::writer_main, this ) );
+        }
+    }
+
+    // writes the remaining trees, but errors are lost. Call close to get them.
+    ~async_tree_sink() {
+        try {
+            close();
+        } catch( std::exception &x ) {
+            std::cerr << "async_tree_sink: " << x.what() << "\n";
+        }
+    }
+
+    virtual void write( const tree_key &key, const char *data, size_t size ) {
+        boost::lock_guard<boost::mutex> lock( current_mtx_ );
+
+        current_->write( key, data, size );
+
+        if( current_->bytes() >= batch_size_ ) {
+            submit();
+        }
+    }
+
+    // waits until all trees written so far are in the target, then flushes the target
+    virtual void flush() {
+        {
+            boost::lock_guard<boost::mutex> lock( current_mtx_ );
+            submit();
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock( mtx_ );
+            while( (!queue_.empty() || writing_ != 0) && error_.empty() ) {
+                idle_.wait( lock );
+            }
+            check_error();
+        }
+
+        target_.flush();
+    }
+
+    // writes the remaining trees and stops the writers
+    void close() {
+        if( closed_ ) {
+            return;
+        }
+
+        try {
+            flush();
+        } catch( ... ) {
+            stop_writers();
+            throw;
+        }
+        stop_writers();
+    }
+
+private:
+    typedef boost::shared_ptr<buffered_tree_sink> batch_ptr;
+
+    // hands the current batch to the writers (current_mtx_ must be held, so that the batches are
+    // queued in the order in which they were filled)
+    void submit() {
+        if( current_->empty() ) {
+            return;
+        }
+
+        boost::unique_lock<boost::mutex> lock( mtx_ );
+        while( queue_.size() >= max_queued_ && error_.empty() ) {
+            not_full_.wait( lock );
+        }
+        check_error();
+
+        queue_.push_back( current_ );
+        not_empty_.notify_one();
+
+        // recycle a written batch (it keeps the capacity of its buffers)
+        if( !free_.empty() ) {
+            current_ = free_.back();
+            free_.pop_back();
+        } else {
+            current_.reset( new buffered_tree_sink() );
+        }
+    }
+
+    void writer_main() {
+        while( true ) {
+            batch_ptr batch;
+            {
+                boost::unique_lock<boost::mutex> lock( mtx_ );
+                while( queue_.empty() && !stop_ ) {
+                    not_empty_.wait( lock );
+                }
+                if( queue_.empty() ) {
+                    return; // stopped
+                }
+
+                batch = queue_.front();
+                queue_.pop_front();
+                ++writing_;
+                not_full_.notify_all();
+            }
+
+            std::string error;
+            try {
+                batch->flush_to( target_ );
+            } catch( std::exception &x ) {
+                error = x.what();
+                batch->clear();
+            }
+
+            {
+                boost::lock_guard<boost::mutex> lock( mtx_ );
+                --writing_;
+                free_.push_back( batch );
+
+                if( !error.empty() && error_.empty() ) {
+                    error_ = error;
+                    not_full_.notify_all();
+                }
+                idle_.notify_all();
+            }
+        }
+    }
+
+    void stop_writers() {
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            stop_ = true;
+        }
+        not_empty_.notify_all();
+        writers_.join_all();
+        closed_ = true;
+    }
+
+    // mtx_ must be held
+    void check_error() const {
+        if( !error_.empty() ) {
+            throw std::runtime_error( "error while writing the trees: " + error_ );
+        }
+    }
+
+    tree_sink &target_;
+    const size_t batch_size_;
+    const size_t max_queued_;
+
+    boost::mutex current_mtx_;
+    batch_ptr current_;
+
+    boost::mutex mtx_;
+    boost::condition_variable not_empty_;
+    boost::condition_variable not_full_;
+    boost::condition_variable idle_;
+    std::deque<batch_ptr> queue_;
+    std::vector<batch_ptr> free_;
+    size_t writing_;
+    bool stop_;
+    std::string error_;
+
+    boost::thread_group writers_;
+    bool closed_;
+};
+
+#endif
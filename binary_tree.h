@@ -0,0 +1,342 @@
+#ifndef __binary_tree_h
+#define __binary_tree_h
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+
+// compact binary alternative to the newick output (spr_vis_test --binary). The taxon names are
+// written once per trace (the 'taxa' tree, see tree_key::taxon_table), the trees only refer to the
+// taxa by index:
+//
+// taxon table:  8 byte magic "SPRTAXA1" | varint num_taxa | num_taxa x (varint length | name bytes)
+//
+// tree:         4 byte magic "SPB1" | u8 flags | u64 LE fingerprint of the taxon table | varint num_nodes
+//               | num_nodes x node | branch lengths
+//
+// The nodes are in DFS pre-order (i.e., in newick order), node 0 is the root. Each node is a varint
+// ((i - parent(i)) << 1 | is_tip) (only is_tip for the root), followed by a varint taxon index for tips.
+// If the flags contain a length mode, the branch lengths follow as packed LE float or double array: the
+// length of the edge to the parent for nodes 1..n-1, preceded by the length of the root edge if the
+// tree is a rooted subtree (flag_subtree, like print_newick with root = false).
+//
+// All integers are unsigned LEB128 varints unless noted otherwise.
+namespace binary_tree {
+    const char table_magic[8] = { 'S', 'P', 'R', 'T', 'A', 'X', 'A', '1' };
+    const char tree_magic[4] = { 'S', 'P', 'B', '1' };
+
+    enum length_mode {
+        no_lengths = 0,
+        float_lengths = 1,
+        double_lengths = 2
+    };
+
+    // flags: bits 0-1 length mode, bit 2 subtree
+    const unsigned char flag_length_mask = 0x3;
+    const unsigned char flag_subtree = 0x4;
+
+    const boost::uint32_t no_parent = boost::uint32_t(-1);
+
+    inline void put_varint( std::string &out, boost::uint64_t v ) {
+        while( v >= 0x80 ) {
+            out += char( (v & 0x7f) | 0x80 );
+            v >>= 7;
+        }
+        out += char(v);
+    }
+
+    inline void put_u64( std::string &out, boost::uint64_t v ) {
+        for( size_t i = 0; i < 8; ++i ) {
+            out += char( (v >> (8 * i)) & 0xff );
+        }
+    }
+
+    inline void put_length( std::string &out, double len, length_mode mode ) {
+        if( mode == float_lengths ) {
+            const float f = float(len);
+            boost::uint32_t bits;
+            std::memcpy( &bits, &f, sizeof(bits) );
+
+            for( size_t i = 0; i < 4; ++i ) {
+                out += char( (bits >> (8 * i)) & 0xff );
+            }
+        } else if( mode == double_lengths ) {
+            boost::uint64_t bits;
+            std::memcpy( &bits, &len, sizeof(bits) );
+            put_u64( out, bits );
+        }
+    }
+
+    // FNV-1a over the names (including the lengths, so that the name boundaries count)
+    class fingerprint {
+    public:
+        fingerprint() : h_(0xcbf29ce484222325ULL) {}
+
+        void add( const char *first, const char *last ) {
+            add_byte( (unsigned char)(last - first) );
+            add_byte( (unsigned char)((last - first) >> 8) );
+
+            for( ; first != last; ++first ) {
+                add_byte( (unsigned char)*first );
+            }
+        }
+
+        boost::uint64_t value() const {
+            return h_;
+        }
+
+    private:
+        void add_byte( unsigned char c ) {
+            h_ ^= c;
+            h_ *= 0x100000001b3ULL;
+        }
+
+        boost::uint64_t h_;
+    };
+
+    // sequential reader over an encoded table or tree. Throws on truncated data.
+    class decoder {
+    public:
+        decoder( const std::string &data ) : p_(data.data()), end_(data.data() + data.size()) {}
+
+        boost::uint64_t varint() {
+            boost::uint64_t v = 0;
+
+            for( size_t shift = 0; shift < 64; shift += 7 ) {
+                const unsigned char c = byte();
+                v |= boost::uint64_t(c & 0x7f) << shift;
+
+                if( (c & 0x80) == 0 ) {
+                    return v;
+                }
+            }
+            throw std::runtime_error( "bad varint in binary tree" );
+        }
+
+        boost::uint64_t u64() {
+            boost::uint64_t v = 0;
+            for( size_t i = 0; i < 8; ++i ) {
+                v |= boost::uint64_t( byte() ) << (8 * i);
+            }
+            return v;
+        }
+
+        double length( length_mode mode ) {
+            if( mode == float_lengths ) {
+                boost::uint32_t bits = 0;
+                for( size_t i = 0; i < 4; ++i ) {
+                    bits |= boost::uint32_t( byte() ) << (8 * i);
+                }
+
+                float f;
+                std::memcpy( &f, &bits, sizeof(f) );
+                return f;
+            } else {
+                assert( mode == double_lengths );
+                const boost::uint64_t bits = u64();
+
+                double d;
+                std::memcpy( &d, &bits, sizeof(d) );
+                return d;
+            }
+        }
+
+        unsigned char byte() {
+            need( 1 );
+            return (unsigned char)*(p_++);
+        }
+
+        // the next n bytes
+        const char *bytes( size_t n ) {
+            need( n );
+            const char *b = p_;
+            p_ += n;
+            return b;
+        }
+
+        bool at_end() const {
+            return p_ == end_;
+        }
+
+    private:
+        void need( size_t n ) const {
+            if( size_t(end_ - p_) < n ) {
+                throw std::runtime_error( "truncated binary tree data" );
+            }
+        }
+
+        const char *p_;
+        const char *end_;
+    };
+
+    inline bool has_magic( const std::string &data, const char *magic, size_t size ) {
+        return data.size() >= size && std::equal( magic, magic + size, data.data() );
+    }
+
+    // the decoded taxon table (the encoder side writes it directly from the taxon_dict)
+    class taxon_table {
+    public:
+        taxon_table() : fingerprint_(0) {}
+
+        explicit taxon_table( const std::string &data ) {
+            if( !has_magic( data, table_magic, sizeof(table_magic) ) ) {
+                throw std::runtime_error( "not a binary taxon table" );
+            }
+
+            decoder d( data );
+            d.bytes( sizeof(table_magic) );
+
+            const size_t num_taxa = size_t( d.varint() );
+            fingerprint fp;
+
+            for( size_t i = 0; i < num_taxa; ++i ) {
+                const size_t len = size_t( d.varint() );
+                const char *name = d.bytes( len );
+
+                names_.push_back( std::string( name, name + len ) );
+                fp.add( name, name + len );
+            }
+            fingerprint_ = fp.value();
+        }
+
+        size_t size() const {
+            return names_.size();
+        }
+
+        const std::string &name( size_t i ) const {
+            if( i >= names_.size() ) {
+                throw std::runtime_error( "taxon index out of range in binary tree" );
+            }
+            return names_[i];
+        }
+
+        boost::uint64_t get_fingerprint() const {
+            return fingerprint_;
+        }
+
+    private:
+        std::vector<std::string> names_;
+        boost::uint64_t fingerprint_;
+    };
+
+    // converts an encoded tree back to newick, in the same layout as print_newick. Branch lengths
+    // stored as float are only as exact as the float.
+    inline std::string to_newick( const std::string &data, const taxon_table &taxa ) {
+        if( !has_magic( data, tree_magic, sizeof(tree_magic) ) ) {
+            throw std::runtime_error( "not a binary tree" );
+        }
+
+        decoder d( data );
+        d.bytes( sizeof(tree_magic) );
+
+        const unsigned char flags = d.byte();
+        const length_mode mode = length_mode( flags & flag_length_mask );
+        const bool subtree = (flags & flag_subtree) != 0;
+
+        if( d.u64() != taxa.get_fingerprint() ) {
+            throw std::runtime_error( "binary tree does not belong to this taxon table" );
+        }
+
+        const size_t num_nodes = size_t( d.varint() );
+        if( num_nodes == 0 ) {
+            throw std::runtime_error( "empty binary tree" );
+        }
+
+        std::vector<boost::uint32_t> taxon( num_nodes, no_parent );
+        std::vector<boost::uint32_t> parent( num_nodes, no_parent );
+
+        // children in newick order (first child, next sibling)
+        std::vector<boost::uint32_t> first_child( num_nodes, no_parent );
+        std::vector<boost::uint32_t> last_child( num_nodes, no_parent );
+        std::vector<boost::uint32_t> next_sibling( num_nodes, no_parent );
+
+        for( size_t i = 0; i < num_nodes; ++i ) {
+            const boost::uint64_t v = d.varint();
+            const bool tip = (v & 1) != 0;
+
+            if( i > 0 ) {
+                const boost::uint64_t delta = v >> 1;
+                if( delta == 0 || delta > i ) {
+                    throw std::runtime_error( "bad parent in binary tree" );
+                }
+
+                const boost::uint32_t p = boost::uint32_t(i - delta);
+                parent[i] = p;
+
+                if( first_child[p] == no_parent ) {
+                    first_child[p] = boost::uint32_t(i);
+                } else {
+                    next_sibling[last_child[p]] = boost::uint32_t(i);
+                }
+                last_child[p] = boost::uint32_t(i);
+            }
+
+            if( tip ) {
+                taxon[i] = boost::uint32_t( d.varint() );
+            }
+        }
+
+        std::vector<double> lengths( num_nodes, 0.0 );
+        if( mode != no_lengths ) {
+            for( size_t i = subtree ? 0 : 1; i < num_nodes; ++i ) {
+                lengths[i] = d.length( mode );
+            }
+        }
+
+        if( !d.at_end() ) {
+            throw std::runtime_error( "trailing data in binary tree" );
+        }
+
+        // iterative DFS (the second member is true after the children of the node)
+        std::ostringstream os;
+        std::vector<std::pair<boost::uint32_t, bool> > stack;
+        stack.push_back( std::make_pair( 0, false ) );
+
+        while( !stack.empty() ) {
+            const boost::uint32_t n = stack.back().first;
+            const bool up = stack.back().second;
+            stack.pop_back();
+
+            if( !up ) {
+                if( n != 0 && first_child[parent[n]] != n ) {
+                    os << ",";
+                }
+
+                if( taxon[n] != no_parent ) {
+                    os << taxa.name( taxon[n] );
+                } else {
+                    os << "(";
+                    stack.push_back( std::make_pair( n, true ) );
+
+                    // children in reverse order, so that the first child is processed first
+                    std::vector<boost::uint32_t> children;
+                    for( boost::uint32_t c = first_child[n]; c != no_parent; c = next_sibling[c] ) {
+                        children.push_back( c );
+                    }
+                    for( std::vector<boost::uint32_t>::reverse_iterator it = children.rbegin(); it != children.rend(); ++it ) {
+                        stack.push_back( std::make_pair( *it, false ) );
+                    }
+                    continue;
+                }
+            } else {
+                os << ")";
+            }
+
+            // the node is complete
+            if( n == 0 && !subtree ) {
+                os << ";\n";
+            } else if( mode != no_lengths ) {
+                os << ":" << lengths[n];
+            }
+        }
+
+        return os.str();
+    }
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef __binary_tree_encoder_h
+#define __binary_tree_encoder_h
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "taxon_dict.h"
+#include "binary_tree.h"
+
+// writes trees in the binary format of binary_tree.h (the encoding side lives here, because it needs
+// the ivy_mike tree, the decoding side does not).
+//
+// REMARK: the taxon indices are the ones of the taxon_dict of the tree. Like the rest of the trace
+// walk, this relies on the taxon set not changing within the trace, the fingerprint in every tree
+// lets the decoder detect it if it does.
+class binary_tree_encoder {
+public:
+    binary_tree_encoder( binary_tree::length_mode mode ) : mode_(mode), fingerprint_(0) {}
+
+    static void write_taxon_table( const taxon_dict &taxa, std::string &out ) {
+        out.append( binary_tree::table_magic, sizeof(binary_tree::table_magic) );
+        binary_tree::put_varint( out, taxa.size() );
+
+        for( size_t i = 0; i < taxa.size(); ++i ) {
+            const std::string name = taxa.name(i);
+            binary_tree::put_varint( out, name.size() );
+            out += name;
+        }
+    }
+
+    // set up for a new (unmodified) tree: maps the tips to their taxon index
+    void reset( ivy_mike::tree_parser_ms::lnode *tree, const taxon_dict &taxa ) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        binary_tree::fingerprint fp;
+        for( size_t i = 0; i < taxa.size(); ++i ) {
+            const std::string name = taxa.name(i);
+            fp.add( name.data(), name.data() + name.size() );
+        }
+        fingerprint_ = fp.value();
+
+        taxon_of_tip_.clear();
+
+        while( !tree->m_data->isTip ) {
+            tree = tree->next->back;
+        }
+
+        add_tip( tree, taxa );
+
+        std::vector<lnode *> stack( 1, tree->back );
+        while( !stack.empty() ) {
+            lnode *n = stack.back();
+            stack.pop_back();
+
+            if( n->m_data->isTip ) {
+                add_tip( n, taxa );
+            } else {
+                stack.push_back( n->next->back );
+                stack.push_back( n->next->next->back );
+            }
+        }
+    }
+
+    // the binary equivalent of print_newick( node, os, root ), appended to out
+    void encode( ivy_mike::tree_parser_ms::lnode *node, bool root, std::string &out ) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        nodes_.clear();
+        lengths_.clear();
+        stack_.clear();
+
+        boost::uint32_t num_nodes = 0;
+
+        if( root ) {
+            // the trifurcation at the root has no branch length
+            assert( !node->m_data->isTip );
+            binary_tree::put_varint( nodes_, 0 );
+            ++num_nodes;
+
+            stack_.push_back( std::make_pair( node->next->next->back, 0 ) );
+            stack_.push_back( std::make_pair( node->next->back, 0 ) );
+            stack_.push_back( std::make_pair( node->back, 0 ) );
+        } else {
+            stack_.push_back( std::make_pair( node, binary_tree::no_parent ) );
+        }
+
+        while( !stack_.empty() ) {
+            lnode *n = stack_.back().first;
+            const boost::uint32_t parent = stack_.back().second;
+            stack_.pop_back();
+
+            const boost::uint32_t i = num_nodes++;
+            const bool tip = n->m_data->isTip;
+            const boost::uint64_t delta = parent == binary_tree::no_parent ? 0 : i - parent;
+
+            binary_tree::put_varint( nodes_, (delta << 1) | (tip ? 1 : 0) );
+            lengths_.push_back( n->backLen );
+
+            if( tip ) {
+                tip_map::const_iterator it = taxon_of_tip_.find( n );
+                assert( it != taxon_of_tip_.end() );
+                binary_tree::put_varint( nodes_, it->second );
+            } else {
+                stack_.push_back( std::make_pair( n->next->next->back, i ) );
+                stack_.push_back( std::make_pair( n->next->back, i ) );
+            }
+        }
+
+        out.append( binary_tree::tree_magic, sizeof(binary_tree::tree_magic) );
+        out += char( mode_ | (root ? 0 : binary_tree::flag_subtree) );
+        binary_tree::put_u64( out, fingerprint_ );
+        binary_tree::put_varint( out, num_nodes );
+        out += nodes_;
+
+        for( std::vector<double>::const_iterator it = lengths_.begin(); it != lengths_.end(); ++it ) {
+            binary_tree::put_length( out, *it, mode_ );
+        }
+    }
+
+private:
+    void add_tip( ivy_mike::tree_parser_ms::lnode *n, const taxon_dict &taxa ) {
+        const size_t taxon = taxa.lookup( n->m_data->tipName );
+
+        if( taxon == taxon_dict::npos ) {
+            throw std::runtime_error( "tip not in taxon dictionary: " + n->m_data->tipName );
+        }
+        taxon_of_tip_[n] = boost::uint32_t(taxon);
+    }
+
+    typedef std::tr1::unordered_map<const ivy_mike::tree_parser_ms::lnode *, boost::uint32_t> tip_map;
+
+    const binary_tree::length_mode mode_;
+    boost::uint64_t fingerprint_;
+    tip_map taxon_of_tip_;
+
+    std::string nodes_;
+    std::vector<double> lengths_;
+    std::vector<std::pair<ivy_mike::tree_parser_ms::lnode *, boost::uint32_t> > stack_;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef __edge_walk_h
+#define __edge_walk_h
+
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/optional.hpp>
+#include <boost/utility/in_place_factory.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+
+// the rooted layout of a tree for the edge walk: the nodes (lnode rings) are numbered in DFS pre-order
+// from the root ring (next_non_tip of the tree), every node except the root owns the edge above it,
+// so the edge numbers are a DFS order of the edges. The prune of a subtree only merges the two edges
+// at the pruned node, so the layout stays valid for every pruned tree and is computed once per tree.
+class spr_edge_order {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    // number the nodes and edges of a new tree. Must be called on the unmodified tree (before any
+    // prune/splice).
+    void reset( lnode *tree ) {
+        tree = ivy_mike::tree_parser_ms::next_non_tip( tree );
+
+        edge_.clear();
+        up_.clear();
+        down_.clear();
+        parent_.clear();
+        depth_.clear();
+
+        up_.push_back( 0 );
+        down_.push_back( 0 );
+        parent_.push_back( 0 );
+        depth_.push_back( 0 );
+
+        // the stack holds the lnodes pointing to the children that are not numbered yet
+        std::vector<lnode *> stack;
+        stack.push_back( tree->next->next );
+        stack.push_back( tree->next );
+        stack.push_back( tree );
+
+        std::vector<size_t> parents( 3, 0 );
+
+        while( !stack.empty() ) {
+            lnode *down = stack.back();
+            const size_t parent = parents.back();
+            stack.pop_back();
+            parents.pop_back();
+
+            const size_t node = up_.size();
+            lnode *up = down->back;
+
+            up_.push_back( up );
+            down_.push_back( down );
+            parent_.push_back( parent );
+            depth_.push_back( depth_[parent] + 1 );
+            edge_[up] = node;
+            edge_[down] = node;
+
+            if( !up->m_data->isTip ) {
+                stack.push_back( up->next->next );
+                stack.push_back( up->next );
+                parents.push_back( node );
+                parents.push_back( node );
+            }
+        }
+    }
+
+    // the edge of lnode n (either end)
+    size_t edge( const lnode *n ) const {
+        edge_map::const_iterator it = edge_.find( n );
+        if( it == edge_.end() ) {
+            throw std::runtime_error( "spr_edge_order: node is not in the tree" );
+        }
+        return it->second;
+    }
+
+    // the lnode at the lower end of edge (pointing up)
+    lnode *up( size_t edge ) const {
+        return up_[edge];
+    }
+
+    // the lnode at the upper end of edge (pointing down)
+    lnode *down( size_t edge ) const {
+        return down_[edge];
+    }
+
+    // the upper end of edge
+    size_t parent( size_t edge ) const {
+        return parent_[edge];
+    }
+
+    size_t depth( size_t edge ) const {
+        return depth_[edge];
+    }
+
+private:
+    typedef std::tr1::unordered_map<const lnode *, size_t> edge_map;
+
+    edge_map edge_;
+    std::vector<lnode *> up_;
+    std::vector<lnode *> down_;
+    std::vector<size_t> parent_;
+    std::vector<size_t> depth_;
+};
+
+// the insertion positions of one pruned subtree, enumerated as a walk over the tree (--edge-walk).
+//
+// The positions are sorted into the DFS order of their edges. The walk then moves the subtree along
+// the tree paths between consecutive positions, one edge at a time: every step is a regraft from an
+// edge to an adjacent one (the splice into the previous edge is rolled back and the subtree is spliced
+// into the next edge, a few pointer updates). In DFS order the whole walk passes every edge of the
+// tree spanned by the positions at most twice. The edges in between the positions are steps without
+// an insertion; the visitors follow them (see spr_visitor::on_move), so the split delta of --rf and
+// --dedup only updates the few splits that change between two adjacent edges.
+//
+// The splices are the same splice_with_rollback as in the per-insertion loop, so the reconstructed
+// trees are identical. The walk lives inside the scope of the prune_with_rollback of the subtree: the
+// destructor detaches the subtree from the last edge, then the prune rollback restores the tree as
+// usual.
+class spr_edge_walk {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    static const size_t npos = size_t(-1);
+
+    spr_edge_walk( const spr_edge_order &order, lnode *prune_node ) : order_(order), prune_node_(prune_node), current_(0) {
+        merged_[0] = order_.edge( prune_node->next );
+        merged_[1] = order_.edge( prune_node->next->next );
+    }
+
+    // add an insertion position. id identifies it in the walk (e.g., an index of the caller).
+    void add( lnode *edge, size_t id ) {
+        positions_.push_back( position( canonical( order_.edge( edge ) ), edge, id ) );
+    }
+
+    // sort the positions into DFS order (positions on the same edge keep the order of add) and lay
+    // out the steps of the walk
+    void plan() {
+        std::stable_sort( positions_.begin(), positions_.end() );
+
+        steps_.clear();
+        for( size_t i = 0; i < positions_.size(); ++i ) {
+            if( i > 0 ) {
+                add_path( positions_[i - 1].number, positions_[i].number );
+            }
+            steps_.push_back( step( positions_[i].edge, i ) );
+        }
+    }
+
+    size_t num_steps() const {
+        return steps_.size();
+    }
+
+    // the edge of the i-th step
+    lnode *edge( size_t i ) const {
+        return steps_[i].edge;
+    }
+
+    // the id of the insertion position of the i-th step (npos: the subtree only passes the edge)
+    size_t id( size_t i ) const {
+        return steps_[i].position != npos ? positions_[steps_[i].position].id : npos;
+    }
+
+    // roll back the splice of the current step (the subtree is pruned afterwards)
+    void detach() {
+        splice_ = boost::none;
+        current_ = 0;
+    }
+
+    // move the subtree to the edge of the i-th step (adjacent to the current one, or the same edge)
+    void regraft( size_t i ) {
+        lnode *edge = steps_[i].edge;
+
+        if( current_ == edge ) {
+            return;
+        }
+
+        detach();
+        splice_ = boost::in_place( edge, prune_node_ );
+        current_ = edge;
+    }
+
+private:
+    struct position {
+        size_t number;
+        lnode *edge;
+        size_t id;
+
+        position( size_t number_, lnode *edge_, size_t id_ ) : number(number_), edge(edge_), id(id_) {}
+
+        bool operator<( const position &other ) const {
+            return number < other.number;
+        }
+    };
+
+    struct step {
+        lnode *edge;
+        size_t position;
+
+        step( lnode *edge_, size_t position_ ) : edge(edge_), position(position_) {}
+    };
+
+    // the two edges at the pruned node are one edge of the pruned tree
+    size_t canonical( size_t edge ) const {
+        return edge == merged_[1] ? merged_[0] : edge;
+    }
+
+    // an lnode of an edge of the pruned tree (for the merged edge the end that is not in the ring of
+    // the pruned node)
+    lnode *live_edge( size_t edge ) const {
+        lnode *n = order_.up( edge );
+
+        if( edge == merged_[0] && (n == prune_node_->next || n == prune_node_->next->next) ) {
+            n = order_.down( edge );
+        }
+        return n;
+    }
+
+    // steps for the inner edges of the path from edge a to edge b (both excluded, each edge of the
+    // path is adjacent to the previous one)
+    void add_path( size_t a, size_t b ) {
+        if( a == b ) {
+            return;
+        }
+
+        // climb from both edges to their lowest common node: the lower ends of consecutive edges of a
+        // climb are a node and its parent, i.e., the edges are adjacent
+        up_a_.assign( 1, a );
+        up_b_.assign( 1, b );
+
+        while( order_.depth( up_a_.back() ) > order_.depth( up_b_.back() ) ) {
+            up_a_.push_back( order_.parent( up_a_.back() ) );
+        }
+        while( order_.depth( up_b_.back() ) > order_.depth( up_a_.back() ) ) {
+            up_b_.push_back( order_.parent( up_b_.back() ) );
+        }
+
+        if( up_a_.back() == up_b_.back() ) {
+            // one edge is above the other
+            up_b_.pop_back();
+        } else {
+            // climb to two edges below the same node (adjacent)
+            while( order_.parent( up_a_.back() ) != order_.parent( up_b_.back() ) ) {
+                up_a_.push_back( order_.parent( up_a_.back() ) );
+                up_b_.push_back( order_.parent( up_b_.back() ) );
+            }
+        }
+
+        up_a_.insert( up_a_.end(), up_b_.rbegin(), up_b_.rend() );
+
+        // the path through the pruned node passes both of its remaining edges, which are merged
+        size_t last = a;
+        for( size_t i = 1; i + 1 < up_a_.size(); ++i ) {
+            const size_t edge = canonical( up_a_[i] );
+
+            if( edge != last && edge != canonical( b ) ) {
+                steps_.push_back( step( live_edge( edge ), npos ) );
+            }
+            last = edge;
+        }
+    }
+
+    const spr_edge_order &order_;
+    lnode *prune_node_;
+    size_t merged_[2];
+
+    std::vector<position> positions_;
+    std::vector<step> steps_;
+    std::vector<size_t> up_a_;
+    std::vector<size_t> up_b_;
+
+    lnode *current_;
+    boost::optional<ivy_mike::tree_parser_ms::splice_with_rollback> splice_;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef __fixed_split_h
+#define __fixed_split_h
+
+#include <cassert>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+#include <boost/dynamic_bitset.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define FIXED_SPLIT_ALIGN __declspec(align(16))
+#else
+#define FIXED_SPLIT_ALIGN __attribute__((aligned(16)))
+#endif
+
+// split with a compile time number of 64bit words, stored inline. In contrast to
+// boost::dynamic_bitset, constructing, hashing and comparing a fixed_split never touches the heap.
+// The words are 16 byte aligned, so that equality can be done with aligned SSE2 loads, and hashing
+// uses the SSE4.2 crc32 instruction if available.
+template<size_t W>
+class fixed_split {
+public:
+    static const size_t num_words = W;
+    static const size_t max_bits = W * 64;
+
+    fixed_split() {
+        clear();
+    }
+
+    void clear() {
+        for( size_t i = 0; i < W; ++i ) {
+            words_[i] = 0;
+        }
+    }
+
+    void set( size_t idx ) {
+        assert( idx < max_bits );
+        words_[idx / 64] |= boost::uint64_t(1) << (idx % 64);
+    }
+
+    bool test( size_t idx ) const {
+        assert( idx < max_bits );
+        return (words_[idx / 64] >> (idx % 64)) & 1;
+    }
+
+    size_t count() const {
+        size_t c = 0;
+        for( size_t i = 0; i < W; ++i ) {
+#ifdef __GNUC__
+            c += __builtin_popcountll( words_[i] );
+#else
+            boost::uint64_t w = words_[i];
+            for( ; w != 0; w &= w - 1 ) {
+                ++c;
+            }
+#endif
+        }
+        return c;
+    }
+
+    // complement with respect to the first num_bits bits (i.e., the taxon count)
+    void flip( size_t num_bits ) {
+        assert( num_bits <= max_bits );
+
+        for( size_t i = 0; i < W; ++i ) {
+            words_[i] = ~words_[i];
+        }
+        // clear the padding bits again
+        if( num_bits % 64 != 0 ) {
+            words_[num_bits / 64] &= (boost::uint64_t(1) << (num_bits % 64)) - 1;
+        }
+        for( size_t i = (num_bits + 63) / 64; i < W; ++i ) {
+            words_[i] = 0;
+        }
+    }
+
+    bool operator==( const fixed_split &other ) const {
+#ifdef __SSE2__
+        size_t i = 0;
+        __m128i acc = _mm_setzero_si128();
+        for( ; i + 2 <= W; i += 2 ) {
+            const __m128i a = _mm_load_si128( reinterpret_cast<const __m128i *>(words_ + i) );
+            const __m128i b = _mm_load_si128( reinterpret_cast<const __m128i *>(other.words_ + i) );
+            acc = _mm_or_si128( acc, _mm_xor_si128( a, b ) );
+        }
+
+        boost::uint64_t tail = 0;
+        for( ; i < W; ++i ) {
+            tail |= words_[i] ^ other.words_[i];
+        }
+
+        return tail == 0 && _mm_movemask_epi8( _mm_cmpeq_epi8( acc, _mm_setzero_si128() ) ) == 0xffff;
+#else
+        for( size_t i = 0; i < W; ++i ) {
+            if( words_[i] != other.words_[i] ) {
+                return false;
+            }
+        }
+        return true;
+#endif
+    }
+
+    bool operator!=( const fixed_split &other ) const {
+        return !(*this == other);
+    }
+
+    size_t hash() const {
+#if defined(__SSE4_2__) && defined(__x86_64__)
+        boost::uint64_t h = 0;
+        for( size_t i = 0; i < W; ++i ) {
+            h = _mm_crc32_u64( h, words_[i] );
+        }
+        // crc32 only fills the lower 32 bits
+        return size_t( h * 0x9E3779B97F4A7C15ULL ) ^ size_t(h);
+#else
+        boost::uint64_t h = 0x9E3779B97F4A7C15ULL;
+        for( size_t i = 0; i < W; ++i ) {
+            h ^= words_[i] * 0xff51afd7ed558ccdULL;
+            h = (h << 31) | (h >> 33);
+            h *= 0xc4ceb9fe1a85ec53ULL;
+        }
+        return size_t(h ^ (h >> 29));
+#endif
+    }
+
+    const boost::uint64_t *words() const {
+        return words_;
+    }
+
+    void from_bitset( const boost::dynamic_bitset<> &bs ) {
+        assert( bs.size() <= max_bits );
+
+        clear();
+        for( size_t i = bs.find_first(); i != boost::dynamic_bitset<>::npos; i = bs.find_next(i) ) {
+            set( i );
+        }
+    }
+
+private:
+    FIXED_SPLIT_ALIGN boost::uint64_t words_[W];
+};
+
+template<size_t W>
+struct fixed_split_hash {
+    size_t operator()( const fixed_split<W> &s ) const {
+        return s.hash();
+    }
+};
+
+#endif
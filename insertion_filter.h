@@ -0,0 +1,132 @@
+#ifndef __insertion_filter_h
+#define __insertion_filter_h
+
+#include <cassert>
+#include <vector>
+#include <algorithm>
+
+// which insertions of a subtree are reconstructed. All enabled criteria must hold.
+struct insertion_filter_options {
+    // keep only the best top_k insertions (0: no limit)
+    size_t top_k;
+
+    // keep only insertions within delta of the best score of the subtree
+    bool use_delta;
+    double delta;
+
+    // keep only insertions with a score at least as good as threshold
+    bool use_threshold;
+    double threshold;
+
+    // by default higher scores are better (log likelihoods)
+    bool lower_is_better;
+
+    insertion_filter_options() : top_k(0), use_delta(false), delta(0), use_threshold(false), threshold(0), lower_is_better(false) {}
+
+    bool active() const {
+        return top_k != 0 || use_delta || use_threshold;
+    }
+};
+
+// collects the scores of the @insertion records of one subtree, so that only the selected ones have
+// to be looked up, spliced and written. The records themselves stay in the trace_record_batch of the
+// tree, the filter only keeps their indices.
+class insertion_filter {
+public:
+    insertion_filter( const insertion_filter_options &options ) : options_(options) {}
+
+    bool active() const {
+        return options_.active();
+    }
+
+    void clear() {
+        records_.clear();
+    }
+
+    // insertion is the 1-based number of the insertion within the subtree, record the index of the
+    // record in the trace_record_batch
+    void add( size_t insertion, double score, size_t record ) {
+        saved_record r;
+        r.insertion = insertion;
+        r.score = score;
+        r.record = record;
+
+        records_.push_back( r );
+    }
+
+    size_t size() const {
+        return records_.size();
+    }
+
+    // indices of the selected records (in trace order)
+    void select( std::vector<size_t> &selected ) const {
+        selected.clear();
+
+        if( records_.empty() ) {
+            return;
+        }
+
+        std::vector<size_t> order;
+        for( size_t i = 0; i < records_.size(); ++i ) {
+            order.push_back( i );
+        }
+
+        // best first, ties in trace order
+        std::stable_sort( order.begin(), order.end(), better_than( *this ) );
+
+        const double best = records_[order.front()].score;
+        const size_t limit = options_.top_k != 0 ? std::min( options_.top_k, order.size() ) : order.size();
+
+        for( size_t i = 0; i < limit; ++i ) {
+            const double score = records_[order[i]].score;
+
+            if( options_.use_delta && distance( best, score ) > options_.delta ) {
+                break;
+            }
+
+            if( options_.use_threshold && distance( options_.threshold, score ) > 0 ) {
+                break;
+            }
+
+            selected.push_back( order[i] );
+        }
+
+        std::sort( selected.begin(), selected.end() );
+    }
+
+    size_t insertion( size_t i ) const {
+        return records_[i].insertion;
+    }
+
+    size_t record( size_t i ) const {
+        return records_[i].record;
+    }
+
+private:
+    struct saved_record {
+        size_t insertion;
+        double score;
+        size_t record;
+    };
+
+    // how much worse score is than ref (<= 0 if score is at least as good)
+    double distance( double ref, double score ) const {
+        return options_.lower_is_better ? score - ref : ref - score;
+    }
+
+    struct better_than {
+        const insertion_filter &f;
+
+        better_than( const insertion_filter &f_ ) : f(f_) {}
+
+        bool operator()( size_t a, size_t b ) const {
+            return f.distance( f.records_[b].score, f.records_[a].score ) < 0;
+        }
+    };
+
+    const insertion_filter_options options_;
+
+    std::vector<saved_record> records_;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef __interval_split_index_h
+#define __interval_split_index_h
+
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "taxon_dict.h"
+
+// trees with more taxa than this use interval_split_index instead of split_node_index
+const size_t interval_index_min_taxa = 4096;
+
+inline bool tip_name_less( const ivy_mike::tree_parser_ms::lnode *a, const ivy_mike::tree_parser_ms::lnode *b ) {
+    return a->m_data->tipName < b->m_data->tipName;
+}
+
+// any tip of the tree containing n
+inline ivy_mike::tree_parser_ms::lnode *find_any_tip( ivy_mike::tree_parser_ms::lnode *n ) {
+    while( !n->m_data->isTip ) {
+        n = n->next->back;
+    }
+    return n;
+}
+
+// number of tips in the tree containing n (iterative, no recursion depth issues on huge trees)
+inline size_t count_tips( ivy_mike::tree_parser_ms::lnode *n ) {
+    using ivy_mike::tree_parser_ms::lnode;
+
+    n = find_any_tip( n );
+    size_t num_tips = 1;
+
+    std::vector<lnode *> stack( 1, n->back );
+    while( !stack.empty() ) {
+        lnode *cur = stack.back();
+        stack.pop_back();
+
+        if( cur->m_data->isTip ) {
+            ++num_tips;
+        } else {
+            stack.push_back( cur->next->back );
+            stack.push_back( cur->next->next->back );
+        }
+    }
+    return num_tips;
+}
+
+class interval_split_index;
+
+// accumulates a tip list (as DFS positions) while the trace record is scanned. Only min, max and
+// count are kept, the membership test for the complement case uses the stamps in the index.
+class interval_split {
+public:
+    void set( size_t taxon );
+
+    size_t count() const {
+        return count_;
+    }
+
+private:
+    friend class interval_split_index;
+
+    const interval_split_index *index_;
+    boost::uint32_t gen_;
+    boost::uint32_t min_;
+    boost::uint32_t max_;
+    boost::uint32_t count_;
+};
+
+// O(n) memory alternative to split_node_index for very large trees. The tips are numbered in DFS
+// order starting from an arbitrary root tip (position 0), so that the tips below every node form a
+// contiguous interval of positions. The index is a hash from (first, last) position to the node.
+// A queried tip list is either such an interval, or (if it contains the root tip) the complement of
+// one, in which case the back of the interval's node is returned. This matches the orientation
+// semantics of split_node_index::find.
+//
+// REMARK: lookups use mutable scratch space, so an index must not be shared between threads.
+class interval_split_index {
+public:
+    typedef interval_split split_type;
+
+    interval_split_index( ivy_mike::tree_parser_ms::lnode *tree ) : gen_(0) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        lnode *root_tip = find_any_tip( tree );
+        tips_.push_back( root_tip );
+
+        // iterative DFS (caterpillar trees with 100k tips would blow the stack). The second member of
+        // the stack elements is true on the way back up, which is when the interval of the node is complete.
+        std::vector<std::pair<lnode *, bool> > stack;
+        std::vector<boost::uint32_t> first_pos;
+        stack.push_back( std::make_pair( root_tip->back, false ) );
+
+        while( !stack.empty() ) {
+            lnode *n = stack.back().first;
+            const bool up = stack.back().second;
+            stack.pop_back();
+
+            if( up ) {
+                const boost::uint32_t lo = first_pos.back();
+                first_pos.pop_back();
+                insert( lo, boost::uint32_t(tips_.size() - 1), n );
+            } else if( n->m_data->isTip ) {
+                const boost::uint32_t pos = boost::uint32_t(tips_.size());
+                tips_.push_back( n );
+                insert( pos, pos, n );
+            } else {
+                first_pos.push_back( boost::uint32_t(tips_.size()) );
+                stack.push_back( std::make_pair( n, true ) );
+                stack.push_back( std::make_pair( n->next->next->back, false ) );
+                stack.push_back( std::make_pair( n->next->back, false ) );
+            }
+        }
+
+        stamps_.assign( tips_.size(), 0 );
+    }
+
+    // tips in DFS order
+    const std::vector<ivy_mike::tree_parser_ms::lnode *> &tips() const {
+        return tips_;
+    }
+
+    // set up the taxon index -> DFS position mapping. Returns false if the taxon set of the tree
+    // does not match the dictionary.
+    bool bind( const taxon_dict &taxa ) {
+        if( taxa.size() != tips_.size() ) {
+            return false;
+        }
+
+        const boost::uint32_t unset = boost::uint32_t(-1);
+        pos_of_taxon_.assign( taxa.size(), unset );
+
+        for( size_t i = 0; i < tips_.size(); ++i ) {
+            const size_t taxon = taxa.lookup( tips_[i]->m_data->tipName );
+
+            if( taxon == taxon_dict::npos || pos_of_taxon_[taxon] != unset ) {
+                return false;
+            }
+            pos_of_taxon_[taxon] = boost::uint32_t(i);
+        }
+        return true;
+    }
+
+    interval_split make_split() const {
+        if( ++gen_ == 0 ) {
+            // stamp generation wrapped around
+            stamps_.assign( stamps_.size(), 0 );
+            gen_ = 1;
+        }
+
+        interval_split s;
+        s.index_ = this;
+        s.gen_ = gen_;
+        s.min_ = boost::uint32_t(-1);
+        s.max_ = 0;
+        s.count_ = 0;
+        return s;
+    }
+
+    ivy_mike::tree_parser_ms::lnode *find( const interval_split &s ) const {
+        assert( s.index_ == this && s.gen_ == gen_ );
+
+        const boost::uint32_t n = boost::uint32_t(tips_.size());
+
+        if( s.count_ == 0 || s.count_ == n ) {
+            return 0;
+        }
+
+        if( s.min_ > 0 ) {
+            // does not contain the root tip: must be an interval
+            if( s.max_ - s.min_ + 1 != s.count_ ) {
+                return 0;
+            }
+            return lookup( s.min_, s.max_ );
+        }
+
+        // contains the root tip: must be [0,lo) + (hi,n), i.e., the complement of [lo,hi]
+        boost::uint32_t lo = 0;
+        while( stamps_[lo] == s.gen_ ) {
+            ++lo;
+        }
+        const boost::uint32_t hi = n - 1 - (s.count_ - lo);
+
+        if( hi < lo ) {
+            return 0;
+        }
+
+        for( boost::uint32_t p = hi + 1; p < n; ++p ) {
+            if( stamps_[p] != s.gen_ ) {
+                return 0;
+            }
+        }
+
+        ivy_mike::tree_parser_ms::lnode *node = lookup( lo, hi );
+        return node != 0 ? node->back : 0;
+    }
+
+    size_t size() const {
+        return map_.size();
+    }
+
+    size_t num_taxa() const {
+        return tips_.size();
+    }
+
+private:
+    friend class interval_split;
+
+    static boost::uint64_t key( boost::uint32_t lo, boost::uint32_t hi ) {
+        return (boost::uint64_t(lo) << 32) | hi;
+    }
+
+    void insert( boost::uint32_t lo, boost::uint32_t hi, ivy_mike::tree_parser_ms::lnode *n ) {
+        map_.insert( std::make_pair( key( lo, hi ), n ) );
+    }
+
+    ivy_mike::tree_parser_ms::lnode *lookup( boost::uint32_t lo, boost::uint32_t hi ) const {
+        map_type::const_iterator it = map_.find( key( lo, hi ) );
+        return it != map_.end() ? it->second : 0;
+    }
+
+    void add( interval_split &s, size_t taxon ) const {
+        assert( taxon < pos_of_taxon_.size() );
+        const boost::uint32_t pos = pos_of_taxon_[taxon];
+
+        if( stamps_[pos] == s.gen_ ) {
+            return; // duplicate tip in the list
+        }
+        stamps_[pos] = s.gen_;
+
+        s.min_ = std::min( s.min_, pos );
+        s.max_ = std::max( s.max_, pos );
+        ++s.count_;
+    }
+
+    struct key_hash {
+        size_t operator()( boost::uint64_t k ) const {
+            return size_t( k * 0x9E3779B97F4A7C15ULL ) ^ size_t( k >> 29 );
+        }
+    };
+
+    typedef std::tr1::unordered_map<boost::uint64_t, ivy_mike::tree_parser_ms::lnode *, key_hash> map_type;
+
+    std::vector<ivy_mike::tree_parser_ms::lnode *> tips_;
+    std::vector<boost::uint32_t> pos_of_taxon_;
+    map_type map_;
+
+    mutable std::vector<boost::uint32_t> stamps_;
+    mutable boost::uint32_t gen_;
+};
+
+inline void interval_split::set( size_t taxon ) {
+    index_->add( *this, taxon );
+}
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef __newick_emitter_h
+#define __newick_emitter_h
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <boost/cstdint.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+
+// incremental replacement for print_newick during the prune/splice loop. A prune or splice only
+// modifies a handful of nodes (the 'touched' nodes), so the text of every directed subtree that does
+// not contain a touched node is identical to the one in the unmodified base tree. Those texts are
+// cached (they are produced by print_newick itself), and only the nodes on the paths from the root to
+// the touched nodes are re-emitted.
+//
+// To decide in O(1) whether a directed subtree contains a touched node, the nodes of the base tree
+// are numbered in DFS pre-order from a fixed root tip: the subtree below a node pointing towards that
+// root is a pre-order interval, the subtree below a node pointing away from it is the complement of
+// its child's interval.
+//
+// The framing of the re-emitted nodes mirrors print_newick. reset() checks this on the base tree of
+// every @tree and disables the emitter if the output would not be byte-identical (write() then simply
+// falls back to print_newick).
+class newick_emitter {
+public:
+    newick_emitter( size_t max_cache_bytes = size_t(256) * 1024 * 1024 ) : max_cache_bytes_(max_cache_bytes), cache_bytes_(0), num_pruned_(0), enabled_(false), force_(false) {}
+
+    // set up for a new (unmodified) base tree. Returns false (and disables the emitter for this
+    // tree) if the re-emitted text does not match print_newick.
+    bool reset( ivy_mike::tree_parser_ms::lnode *tree ) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        info_.clear();
+        cache_.clear();
+        cache_bytes_ = 0;
+        touched_.clear();
+        num_pruned_ = 0;
+
+        number_nodes( tree );
+
+        // check: re-emit the whole tree without using the cache and compare with print_newick
+        lnode *root = ivy_mike::tree_parser_ms::next_non_tip( tree );
+
+        std::ostringstream os;
+        ivy_mike::tree_parser_ms::print_newick( root, os );
+
+        std::string check;
+        enabled_ = true;
+        force_ = true;
+        write( root, check );
+        force_ = false;
+
+        enabled_ = (check == os.str());
+        return enabled_;
+    }
+
+    bool enabled() const {
+        return enabled_;
+    }
+
+    // the prune of prune_node modifies its node and both neighbours. Call before the prune.
+    void set_pruned( ivy_mike::tree_parser_ms::lnode *prune_node ) {
+        if( !enabled_ ) {
+            return;
+        }
+
+        touched_.clear();
+        touch( prune_node );
+        touch( prune_node->next->back );
+        touch( prune_node->next->next->back );
+        num_pruned_ = touched_.size();
+    }
+
+    // splicing the pruned node into edge additionally modifies both ends of the edge. Call before
+    // the splice, replaces the previous splice.
+    void set_spliced( ivy_mike::tree_parser_ms::lnode *edge ) {
+        if( !enabled_ ) {
+            return;
+        }
+
+        touched_.resize( num_pruned_ );
+        touch( edge );
+        touch( edge->back );
+    }
+
+    // same output as print_newick( node, os, root ), appended to out
+    void write( ivy_mike::tree_parser_ms::lnode *node, std::string &out, bool root = true ) {
+        assert( enabled_ );
+
+        if( !root ) {
+            emit( node, out );
+            return;
+        }
+
+        out += '(';
+        emit( node->back, out );
+        out += ',';
+        emit( node->next->back, out );
+        out += ',';
+        emit( node->next->next->back, out );
+        out += ");\n";
+    }
+
+private:
+    // the whole node (lnode ring) of n counts as modified
+    void touch( ivy_mike::tree_parser_ms::lnode *n ) {
+        touched_.push_back( get_info( n ).pre );
+    }
+
+    struct node_info {
+        // pre-order number of the node (i.e., of the lnode ring)
+        boost::uint32_t pre;
+
+        // the directed subtree below the lnode is the pre-order interval [lo,hi] (inside) or its complement
+        boost::uint32_t lo;
+        boost::uint32_t hi;
+        bool inside;
+    };
+
+    void number_nodes( ivy_mike::tree_parser_ms::lnode *tree ) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        lnode *root_tip = tree;
+        while( !root_tip->m_data->isTip ) {
+            root_tip = root_tip->next->back;
+        }
+
+        boost::uint32_t counter = 0;
+
+        // iterative DFS. On the way down, the lnode through which a node is entered gets its pre number.
+        // On the way up the interval of the subtree is known.
+        std::vector<std::pair<lnode *, bool> > stack;
+
+        node_info &ri = info_[root_tip];
+        ri.pre = counter++;
+
+        stack.push_back( std::make_pair( root_tip->back, false ) );
+        while( !stack.empty() ) {
+            lnode *n = stack.back().first;
+            const bool up = stack.back().second;
+            stack.pop_back();
+
+            if( !up ) {
+                node_info &ni = info_[n];
+                ni.pre = counter++;
+                ni.lo = ni.pre;
+                ni.inside = true;
+
+                if( n->m_data->isTip ) {
+                    ni.hi = ni.pre;
+                    finish_child( n );
+                } else {
+                    stack.push_back( std::make_pair( n, true ) );
+                    stack.push_back( std::make_pair( n->next->next->back, false ) );
+                    stack.push_back( std::make_pair( n->next->back, false ) );
+                }
+            } else {
+                node_info &ni = info_[n];
+                ni.hi = counter - 1;
+
+                // the other two lnodes of the ring point away from the root
+                for( lnode *c = n->next; c != n; c = c->next ) {
+                    node_info &ci = info_[c];
+                    ci.pre = ni.pre;
+                }
+                finish_child( n );
+            }
+        }
+    }
+
+    // n (pointing towards the root) is complete: its back points away from the root, and the subtree
+    // below the back is everything except n's interval
+    void finish_child( ivy_mike::tree_parser_ms::lnode *n ) {
+        const node_info &ni = info_[n];
+        node_info &bi = info_[n->back];
+
+        bi.lo = ni.lo;
+        bi.hi = ni.hi;
+        bi.inside = false;
+    }
+
+    const node_info &get_info( ivy_mike::tree_parser_ms::lnode *n ) const {
+        info_map::const_iterator it = info_.find( n );
+        assert( it != info_.end() );
+        return it->second;
+    }
+
+    bool contains_touched( const node_info &ni ) const {
+        for( std::vector<boost::uint32_t>::const_iterator it = touched_.begin(); it != touched_.end(); ++it ) {
+            const bool in_interval = ni.lo <= *it && *it <= ni.hi;
+
+            if( in_interval == ni.inside ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void emit( ivy_mike::tree_parser_ms::lnode *n, std::string &out ) {
+        if( n->m_data->isTip ) {
+            // tips are cheap, always let print_newick do them
+            print_newick_into( n, out );
+            return;
+        }
+
+        if( !force_ && !contains_touched( get_info( n ) ) ) {
+            cache_map::iterator it = cache_.find( n );
+
+            if( it == cache_.end() ) {
+                if( cache_bytes_ > max_cache_bytes_ ) {
+                    cache_.clear();
+                    cache_bytes_ = 0;
+                }
+
+                it = cache_.insert( std::make_pair( n, std::string() ) ).first;
+                print_newick_into( n, it->second );
+                cache_bytes_ += it->second.size();
+            }
+
+            out += it->second;
+            return;
+        }
+
+        out += '(';
+        emit( n->next->back, out );
+        out += ',';
+        emit( n->next->next->back, out );
+        out += "):";
+
+        scratch_.str( std::string() );
+        scratch_ << n->backLen;
+        out += scratch_.str();
+    }
+
+    void print_newick_into( ivy_mike::tree_parser_ms::lnode *n, std::string &out ) {
+        scratch_.str( std::string() );
+        ivy_mike::tree_parser_ms::print_newick( n, scratch_, false );
+        out += scratch_.str();
+    }
+
+    typedef std::tr1::unordered_map<const ivy_mike::tree_parser_ms::lnode *, node_info> info_map;
+    typedef std::tr1::unordered_map<const ivy_mike::tree_parser_ms::lnode *, std::string> cache_map;
+
+    info_map info_;
+    cache_map cache_;
+
+    const size_t max_cache_bytes_;
+    size_t cache_bytes_;
+
+    std::vector<boost::uint32_t> touched_;
+    size_t num_pruned_;
+
+    std::ostringstream scratch_;
+    bool enabled_;
+    bool force_;
+};
+
+#endif
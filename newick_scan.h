@@ -0,0 +1,180 @@
+#ifndef __newick_scan_h
+#define __newick_scan_h
+
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// scanning primitives of the newick parser of the @tree records (see scan_tree_parser): the end of a
+// token (tip name, label, branch length) and the conversion of the branch lengths. Both work on
+// [first,last) ranges of the trace line, i.e., they neither need a 0-terminated copy nor allocate.
+namespace newick_scan {
+    // the characters that end a token: the structural characters of newick and white space (the
+    // white space of isspace in the C locale)
+    inline bool is_delimiter( char c ) {
+        return c == '(' || c == ')' || c == ',' || c == ':' || c == ';' || c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    // the first delimiter in [first,last), or last. With SSE2 16 characters are compared at once
+    // (unaligned loads, never beyond last).
+    inline const char *find_delimiter( const char *first, const char *last ) {
+#ifdef __SSE2__
+        const __m128i open = _mm_set1_epi8( '(' );
+        const __m128i close = _mm_set1_epi8( ')' );
+        const __m128i comma = _mm_set1_epi8( ',' );
+        const __m128i colon = _mm_set1_epi8( ':' );
+        const __m128i semicolon = _mm_set1_epi8( ';' );
+        const __m128i space = _mm_set1_epi8( ' ' );
+        // \t .. \r as a signed range check (bytes >= 0x80 are negative and never match)
+        const __m128i ws_lo = _mm_set1_epi8( '\t' - 1 );
+        const __m128i ws_hi = _mm_set1_epi8( '\r' + 1 );
+
+        while( last - first >= 16 ) {
+            const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i *>(first) );
+
+            __m128i m = _mm_or_si128( _mm_cmpeq_epi8( c, open ), _mm_cmpeq_epi8( c, close ) );
+            m = _mm_or_si128( m, _mm_or_si128( _mm_cmpeq_epi8( c, comma ), _mm_cmpeq_epi8( c, colon ) ) );
+            m = _mm_or_si128( m, _mm_or_si128( _mm_cmpeq_epi8( c, semicolon ), _mm_cmpeq_epi8( c, space ) ) );
+            m = _mm_or_si128( m, _mm_and_si128( _mm_cmpgt_epi8( c, ws_lo ), _mm_cmplt_epi8( c, ws_hi ) ) );
+
+            const int mask = _mm_movemask_epi8( m );
+            if( mask != 0 ) {
+#ifdef __GNUC__
+                return first + __builtin_ctz( mask );
+#else
+                int i = 0;
+                while( ((mask >> i) & 1) == 0 ) {
+                    ++i;
+                }
+                return first + i;
+#endif
+            }
+            first += 16;
+        }
+#endif
+        while( first != last && !is_delimiter( *first ) ) {
+            ++first;
+        }
+        return first;
+    }
+
+    // exact powers of ten of a double (up to 1e22 the powers are exactly representable)
+    inline double exact_pow10( int e ) {
+        static const double p[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        return p[e];
+    }
+
+    // the plain decimal numbers of the branch lengths ([+-]digits[.digits][(e|E)[+-]digits]) with at
+    // most 15 significant digits and a decimal exponent within +-22: the digits are exact in a double
+    // and so is the power of ten, so a single multiplication or division gives the correctly rounded
+    // result (i.e., the same double as strtod). Returns false for everything else.
+    //
+    // REMARK: relies on double arithmetic without excess precision (FLT_EVAL_METHOD == 0, e.g., SSE2
+    // math). With x87 math the fast path is disabled.
+    inline bool parse_decimal_fast( const char *first, const char *last, double &value ) {
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0
+        return false;
+#else
+        const char *p = first;
+
+        bool negative = false;
+        if( p != last && (*p == '+' || *p == '-') ) {
+            negative = *p == '-';
+            ++p;
+        }
+
+        boost::uint64_t mantissa = 0;
+        int significant = 0;
+        int exponent = 0;
+        bool any_digits = false;
+
+        for( ; p != last && *p >= '0' && *p <= '9'; ++p ) {
+            any_digits = true;
+            if( mantissa != 0 || *p != '0' ) {
+                mantissa = mantissa * 10 + (*p - '0');
+                ++significant;
+            }
+        }
+
+        if( p != last && *p == '.' ) {
+            ++p;
+            for( ; p != last && *p >= '0' && *p <= '9'; ++p ) {
+                any_digits = true;
+                if( mantissa != 0 || *p != '0' ) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    ++significant;
+                }
+                --exponent;
+            }
+        }
+
+        if( !any_digits || significant > 15 ) {
+            return false;
+        }
+
+        if( p != last && (*p == 'e' || *p == 'E') ) {
+            ++p;
+
+            bool negative_exp = false;
+            if( p != last && (*p == '+' || *p == '-') ) {
+                negative_exp = *p == '-';
+                ++p;
+            }
+
+            if( p == last || *p < '0' || *p > '9' ) {
+                return false;
+            }
+
+            int e = 0;
+            for( ; p != last && *p >= '0' && *p <= '9'; ++p ) {
+                if( e > 1000 ) {
+                    return false;
+                }
+                e = e * 10 + (*p - '0');
+            }
+            exponent += negative_exp ? -e : e;
+        }
+
+        if( p != last || exponent < -22 || exponent > 22 ) {
+            return false;
+        }
+
+        double v = double(mantissa);
+        if( exponent < 0 ) {
+            v /= exact_pow10( -exponent );
+        } else {
+            v *= exact_pow10( exponent );
+        }
+
+        value = negative ? -v : v;
+        return true;
+#endif
+    }
+
+    // the number in [first,last), which must be consumed completely. Falls back to strtod (on a
+    // copy in a small buffer, the line is not 0-terminated) for the numbers outside of the fast path.
+    inline bool parse_double( const char *first, const char *last, double &value ) {
+        if( parse_decimal_fast( first, last, value ) ) {
+            return true;
+        }
+
+        char buf[64];
+        const size_t len = last - first;
+        if( len == 0 || len >= sizeof(buf) ) {
+            return false;
+        }
+        std::memcpy( buf, first, len );
+        buf[len] = 0;
+
+        char *end;
+        value = std::strtod( buf, &end );
+        return end == buf + len;
+    }
+}
+
+#endif
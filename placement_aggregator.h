@@ -0,0 +1,205 @@
+#ifndef __placement_aggregator_h
+#define __placement_aggregator_h
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+
+// placement weights of the pruned subtrees over the edges of the (unpruned) tree, computed from the
+// @insertion scores without reconstructing any tree. Per subtree the scores are turned into
+// likelihood weight ratios (lwr_e = exp(s_e - s_max) / sum_f exp(s_f - s_max)), which give the best
+// edge and the entropy of the placement. Per tree the lwrs of all subtrees are summed up per edge
+// (the expected number of subtrees placed on the edge).
+//
+// The edges are numbered in post-order of the print_newick traversal (like the edge numbers of
+// jplace). The table of a tree has one 's' row per subtree and one 'e' row per edge with a weight:
+//
+//   s <subtree> <insertions> <best edge> <best lwr> <entropy (nats)>
+//   e <subtree> <edge> <lwr>
+class placement_aggregator {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    // lower_is_better: the scores are costs (e.g., parsimony), the weights are exp(s_min - s_e)
+    placement_aggregator( bool lower_is_better ) : lower_is_better_(lower_is_better) {}
+
+    // number the edges of a new tree and clear the sums
+    void reset( lnode *tree ) {
+        tree = ivy_mike::tree_parser_ms::next_non_tip( tree );
+        tree_ = tree;
+        edge_ids_.clear();
+        edges_.clear();
+
+        table_.str( std::string() );
+        table_ << "# s subtree insertions best_edge best_lwr entropy\n# e subtree edge lwr\n";
+
+        // iterative post-order: (node pointing up, children done)
+        std::vector<std::pair<lnode *, bool> > stack;
+        stack.push_back( std::make_pair( tree->next->next->back, false ) );
+        stack.push_back( std::make_pair( tree->next->back, false ) );
+        stack.push_back( std::make_pair( tree->back, false ) );
+
+        while( !stack.empty() ) {
+            lnode *n = stack.back().first;
+            const bool done = stack.back().second;
+            stack.pop_back();
+
+            if( done || n->m_data->isTip ) {
+                const size_t id = edges_.size();
+                edges_.push_back( n );
+                edge_ids_[n] = id;
+                edge_ids_[n->back] = id;
+            } else {
+                stack.push_back( std::make_pair( n, true ) );
+                stack.push_back( std::make_pair( n->next->next->back, false ) );
+                stack.push_back( std::make_pair( n->next->back, false ) );
+            }
+        }
+
+        tree_lwr_.assign( edges_.size(), 0.0 );
+    }
+
+    void begin_subtree( size_t subtree ) {
+        subtree_ = subtree;
+        placements_.clear();
+    }
+
+    // one insertion of the current subtree. edge is the lnode returned by the split index lookup.
+    void add( lnode *edge, double score ) {
+        edge_map::const_iterator it = edge_ids_.find( edge );
+
+        if( it == edge_ids_.end() ) {
+            throw std::runtime_error( "placement_aggregator: insertion edge is not in the tree" );
+        }
+
+        placements_.push_back( std::make_pair( it->second, lower_is_better_ ? -score : score ) );
+    }
+
+    void end_subtree() {
+        if( placements_.empty() ) {
+            table_ << "s\t" << subtree_ << "\t0\t-\t-\t-\n";
+            return;
+        }
+
+        double max_score = placements_.front().second;
+        for( std::vector<placement>::const_iterator it = placements_.begin(); it != placements_.end(); ++it ) {
+            max_score = std::max( max_score, it->second );
+        }
+
+        // several insertions on the same edge are merged
+        std::sort( placements_.begin(), placements_.end() );
+
+        weights_.clear();
+        double sum = 0;
+        for( std::vector<placement>::const_iterator it = placements_.begin(); it != placements_.end(); ++it ) {
+            const double w = std::exp( it->second - max_score );
+            sum += w;
+
+            if( !weights_.empty() && weights_.back().first == it->first ) {
+                weights_.back().second += w;
+            } else {
+                weights_.push_back( std::make_pair( it->first, w ) );
+            }
+        }
+
+        size_t best = 0;
+        double entropy = 0;
+        for( size_t i = 0; i < weights_.size(); ++i ) {
+            weights_[i].second /= sum;
+
+            const double lwr = weights_[i].second;
+            if( lwr > weights_[best].second ) {
+                best = i;
+            }
+            if( lwr > 0 ) {
+                entropy -= lwr * std::log( lwr );
+            }
+            tree_lwr_[weights_[i].first] += lwr;
+        }
+
+        table_ << "s\t" << subtree_ << "\t" << placements_.size() << "\t" << weights_[best].first << "\t" << weights_[best].second << "\t" << entropy << "\n";
+
+        for( size_t i = 0; i < weights_.size(); ++i ) {
+            table_ << "e\t" << subtree_ << "\t" << weights_[i].first << "\t" << weights_[i].second << "\n";
+        }
+    }
+
+    // the table of the current tree
+    std::string table() const {
+        return table_.str();
+    }
+
+    // the tree in print_newick layout, with the edge numbers and the summed lwrs as comments after
+    // the branch lengths, e.g. t1:0.1[&edge=0,lwr=0.25]
+    std::string annotated_tree() const {
+        std::ostringstream os;
+
+        // 0: open, 1: between the children, 2: close
+        std::vector<std::pair<lnode *, int> > stack;
+
+        os << "(";
+        lnode * const root_children[3] = { tree_->back, tree_->next->back, tree_->next->next->back };
+
+        for( int i = 0; i < 3; ++i ) {
+            if( i > 0 ) {
+                os << ",";
+            }
+
+            stack.push_back( std::make_pair( root_children[i], 0 ) );
+            while( !stack.empty() ) {
+                lnode *n = stack.back().first;
+                const int state = stack.back().second;
+                stack.pop_back();
+
+                if( n->m_data->isTip ) {
+                    os << n->m_data->tipName;
+                    write_edge( os, n );
+                } else if( state == 0 ) {
+                    os << "(";
+                    stack.push_back( std::make_pair( n, 1 ) );
+                    stack.push_back( std::make_pair( n->next->back, 0 ) );
+                } else if( state == 1 ) {
+                    os << ",";
+                    stack.push_back( std::make_pair( n, 2 ) );
+                    stack.push_back( std::make_pair( n->next->next->back, 0 ) );
+                } else {
+                    os << ")";
+                    write_edge( os, n );
+                }
+            }
+        }
+        os << ");\n";
+        return os.str();
+    }
+
+private:
+    typedef std::tr1::unordered_map<const lnode *, size_t> edge_map;
+    typedef std::pair<size_t, double> placement; // edge, score (higher is better)
+
+    void write_edge( std::ostream &os, lnode *n ) const {
+        const size_t id = edge_ids_.find( n )->second;
+        os << ":" << n->backLen << "[&edge=" << id << ",lwr=" << tree_lwr_[id] << "]";
+    }
+
+    const bool lower_is_better_;
+
+    lnode *tree_;
+    edge_map edge_ids_;
+    std::vector<lnode *> edges_;
+    std::vector<double> tree_lwr_;
+
+    size_t subtree_;
+    std::vector<placement> placements_;
+    std::vector<std::pair<size_t, double> > weights_;
+
+    std::ostringstream table_;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef __rf_distance_h
+#define __rf_distance_h
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include "spr_split_delta.h"
+
+// Robinson-Foulds distance (and weighted RF, i.e., the L1 branch score) between a tree and its SPR
+// neighbours, without comparing the full split sets. A split occurs at most once per tree and all
+// splits outside the SPR path are shared, so the distance follows from matching the affected splits
+// of the base tree (see spr_split_delta) against the ones of the SPR tree.
+class spr_rf_calculator {
+public:
+    // weighted: also compute the weighted RF distance (the table gets an extra column)
+    spr_rf_calculator( bool weighted ) : weighted_(weighted), delta_(0) {}
+
+    // start the table of a new tree. delta must have been reset to the tree.
+    void reset( const spr_split_delta &delta ) {
+        delta_ = &delta;
+
+        table_.str( std::string() );
+        table_ << (weighted_ ? "# subtree insertion rf wrf\n" : "# subtree insertion rf\n");
+    }
+
+    // the distance between the base tree and the SPR tree of the last delta update
+    void distance( size_t &rf, double &wrf ) {
+        order_.clear();
+        for( size_t i = 0; i < delta_->num_entries(); ++i ) {
+            order_.push_back( i );
+        }
+        std::sort( order_.begin(), order_.end(), entry_less( *delta_ ) );
+
+        rf = 0;
+        wrf = 0;
+
+        // the splits that occur only in one of the trees count for rf, the length differences for wrf
+        for( size_t i = 0; i < order_.size(); ) {
+            double len[2] = { 0, 0 };
+            bool seen[2] = { false, false };
+
+            size_t j = i;
+            for( ; j < order_.size() && !entry_less( *delta_ )( order_[i], order_[j] ); ++j ) {
+                const bool spr = delta_->entry_spr( order_[j] );
+                seen[spr] = true;
+                len[spr] += delta_->entry_len( order_[j] );
+            }
+
+            if( seen[0] != seen[1] ) {
+                ++rf;
+            }
+            wrf += std::fabs( len[0] - len[1] );
+            i = j;
+        }
+    }
+
+    // compute the distance for one insertion and add it to the table of the current tree
+    void add( size_t subtree, size_t insertion ) {
+        size_t rf = 0;
+        double wrf = 0;
+        distance( rf, wrf );
+
+        table_ << subtree << "\t" << insertion << "\t" << rf;
+        if( weighted_ ) {
+            table_ << "\t" << wrf;
+        }
+        table_ << "\n";
+    }
+
+    std::string table() const {
+        return table_.str();
+    }
+
+private:
+    struct entry_less {
+        const spr_split_delta &d;
+
+        entry_less( const spr_split_delta &d_ ) : d(d_) {}
+
+        bool operator()( size_t a, size_t b ) const {
+            const boost::uint64_t *sa = d.entry_split( a );
+            const boost::uint64_t *sb = d.entry_split( b );
+            return std::lexicographical_compare( sa, sa + d.num_words(), sb, sb + d.num_words() );
+        }
+    };
+
+    const bool weighted_;
+    const spr_split_delta *delta_;
+
+    std::vector<size_t> order_;
+    std::ostringstream table_;
+};
+
+#endif
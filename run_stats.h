@@ -0,0 +1,229 @@
+#ifndef __run_stats_h
+#define __run_stats_h
+
+#include <cassert>
+#include <ctime>
+#include <ostream>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <time.h>
+#else
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#endif
+
+// per-phase timers and counters of a trace walk. Every thread fills its own run_stats (no locking
+// in the hot paths), they are merged in a stats_collector.
+class run_stats {
+public:
+    enum phase {
+        trace_io,       // reading and classifying trace lines
+        parse,          // newick parsing of the @tree records
+        pool_gc,        // ln_pool mark/sweep
+        split_build,    // split index construction (including get_all_splits_by_node)
+        split_lookup,   // resolving the tip lists of the records and the index lookups
+        prune_splice,   // prune_with_rollback and splice_with_rollback (without the rollbacks)
+        output,         // serialising and writing the trees
+        split_delta,    // affected splits, RF distances and topology hashes of the SPR trees (--rf, --dedup)
+        num_phases
+    };
+
+    enum counter {
+        lines,
+        trees,
+        subtrees,
+        insertions,
+        lookups,
+        trees_written,
+        bytes_written,
+        duplicates,
+        num_counters
+    };
+
+    run_stats() {
+        clear();
+    }
+
+    void clear() {
+        clear_totals();
+        pool_nodes_ = 0;
+    }
+
+    // clear times and counters, but keep tracking the pool (used after merging into the totals)
+    void clear_totals() {
+        std::fill( ns_, ns_ + num_phases, 0 );
+        std::fill( count_, count_ + num_counters, 0 );
+        pool_high_water_ = 0;
+    }
+
+    void add_time( phase p, boost::uint64_t ns ) {
+        ns_[p] += ns;
+    }
+
+    void inc( counter c, boost::uint64_t n = 1 ) {
+        count_[c] += n;
+    }
+
+    boost::uint64_t get( counter c ) const {
+        return count_[c];
+    }
+
+    // a new tree with num_nodes lnodes was parsed into a pool that still holds the previous one
+    // (i.e., before the sweep). ln_pool does not report its size, so the high-water mark is
+    // derived from the tree sizes.
+    void pool_tree( boost::uint64_t num_nodes ) {
+        pool_high_water_ = std::max( pool_high_water_, pool_nodes_ + num_nodes );
+        pool_nodes_ = num_nodes;
+    }
+
+    // a new tree with num_nodes lnodes was parsed into a tree_arena (the previous one is released)
+    void arena_tree( boost::uint64_t num_nodes ) {
+        pool_nodes_ = 0;
+        pool_tree( num_nodes );
+    }
+
+    // merge the stats of another thread (the pool high-water mark is per pool, so the max is kept)
+    void add( const run_stats &other ) {
+        for( size_t i = 0; i < num_phases; ++i ) {
+            ns_[i] += other.ns_[i];
+        }
+        for( size_t i = 0; i < num_counters; ++i ) {
+            count_[i] += other.count_[i];
+        }
+        pool_high_water_ = std::max( pool_high_water_, other.pool_high_water_ );
+    }
+
+    static const char *phase_name( size_t p ) {
+        static const char *names[num_phases] = { "trace_io", "parse", "pool_gc", "split_build", "split_lookup", "prune_splice", "output", "split_delta" };
+        return names[p];
+    }
+
+    static const char *counter_name( size_t c ) {
+        static const char *names[num_counters] = { "lines", "trees", "subtrees", "insertions", "lookups", "trees_written", "bytes_written", "duplicates" };
+        return names[c];
+    }
+
+    // peak resident set size of the process in KiB (0 if unknown, e.g., on Windows)
+    static long peak_rss_kb() {
+#ifdef WIN32
+        return 0;
+#else
+        struct rusage ru;
+        if( getrusage( RUSAGE_SELF, &ru ) != 0 ) {
+            return 0;
+        }
+        return ru.ru_maxrss;
+#endif
+    }
+
+    void write_progress( std::ostream &os, double wall_seconds ) const {
+        os << "progress: " << wall_seconds << "s"
+           << " trees " << count_[trees]
+           << " subtrees " << count_[subtrees]
+           << " insertions " << count_[insertions]
+           << " written " << count_[trees_written] << " (" << count_[bytes_written] / (1024 * 1024) << " MiB)"
+           << " rss " << peak_rss_kb() / 1024 << " MiB\n";
+    }
+
+    void write_json( std::ostream &os, double wall_seconds ) const {
+        os << "{\n  \"wall_seconds\": " << wall_seconds << ",\n  \"phase_seconds\": {";
+        for( size_t i = 0; i < num_phases; ++i ) {
+            os << (i == 0 ? " " : ", ") << "\"" << phase_name(i) << "\": " << ns_[i] * 1e-9;
+        }
+        os << " },\n  \"counters\": {";
+        for( size_t i = 0; i < num_counters; ++i ) {
+            os << (i == 0 ? " " : ", ") << "\"" << counter_name(i) << "\": " << count_[i];
+        }
+        os << " },\n  \"pool_high_water_lnodes\": " << pool_high_water_
+           << ",\n  \"peak_rss_kb\": " << peak_rss_kb() << "\n}\n";
+    }
+
+    // monotonic clock in ns (on Windows the microsecond wall clock of boost::posix_time)
+    static boost::uint64_t now_ns() {
+#ifdef WIN32
+        static const boost::posix_time::ptime epoch( boost::gregorian::date( 1970, 1, 1 ) );
+        return boost::uint64_t( (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds() ) * 1000ULL;
+#else
+        timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return boost::uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+private:
+    boost::uint64_t ns_[num_phases];
+    boost::uint64_t count_[num_counters];
+
+    boost::uint64_t pool_high_water_;
+    boost::uint64_t pool_nodes_;
+};
+
+// adds the time until the end of the scope (or until stop) to a phase. Does nothing if stats is 0.
+class phase_timer {
+public:
+    phase_timer( run_stats *stats, run_stats::phase p ) : stats_(stats), phase_(p), start_(stats != 0 ? run_stats::now_ns() : 0) {}
+
+    ~phase_timer() {
+        stop();
+    }
+
+    // for objects that have to outlive the timed phase (e.g., the prune_with_rollback)
+    void stop() {
+        if( stats_ != 0 ) {
+            stats_->add_time( phase_, run_stats::now_ns() - start_ );
+            stats_ = 0;
+        }
+    }
+
+private:
+    run_stats *stats_;
+    const run_stats::phase phase_;
+    const boost::uint64_t start_;
+};
+
+// the totals of all threads. The threads add their stats after every tree, which is also when
+// the periodic progress line is written.
+class stats_collector {
+public:
+    // progress lines go to progress_os every interval seconds (0: no progress lines)
+    stats_collector( std::ostream &progress_os, double interval )
+      : progress_os_(progress_os),
+        interval_ns_( boost::uint64_t(interval * 1e9) ),
+        start_( run_stats::now_ns() ),
+        last_progress_( start_ )
+    {}
+
+    // merges the times and counters of stats and clears them
+    void add( run_stats &stats ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+        total_.add( stats );
+        stats.clear_totals();
+
+        const boost::uint64_t now = run_stats::now_ns();
+        if( interval_ns_ != 0 && now - last_progress_ >= interval_ns_ ) {
+            total_.write_progress( progress_os_, (now - start_) * 1e-9 );
+            progress_os_.flush();
+            last_progress_ = now;
+        }
+    }
+
+    void write_json( std::ostream &os ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+        total_.write_json( os, (run_stats::now_ns() - start_) * 1e-9 );
+    }
+
+private:
+    std::ostream &progress_os_;
+    const boost::uint64_t interval_ns_;
+    const boost::uint64_t start_;
+    boost::uint64_t last_progress_;
+
+    boost::mutex mtx_;
+    run_stats total_;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef __split_index_h
+#define __split_index_h
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <boost/dynamic_bitset.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "ivymike/tree_split_utils.h"
+#include "fixed_split.h"
+
+// the things split_node_index needs to know about a split type
+template<typename split_type>
+struct split_traits;
+
+template<size_t W>
+struct split_traits<fixed_split<W> > {
+    typedef fixed_split_hash<W> hash_type;
+
+    static void reset( fixed_split<W> &s, size_t ) {
+        s.clear();
+    }
+
+    static void flip( fixed_split<W> &s, size_t num_taxa ) {
+        s.flip( num_taxa );
+    }
+
+    static void assign( fixed_split<W> &s, const boost::dynamic_bitset<> &bs ) {
+        s.from_bitset( bs );
+    }
+};
+
+template<>
+struct split_traits<boost::dynamic_bitset<> > {
+    typedef ivy_mike::bitset_hash hash_type;
+
+    static void reset( boost::dynamic_bitset<> &s, size_t num_taxa ) {
+        s.resize( num_taxa );
+        s.reset();
+    }
+
+    static void flip( boost::dynamic_bitset<> &s, size_t ) {
+        s.flip();
+    }
+
+    static void assign( boost::dynamic_bitset<> &s, const boost::dynamic_bitset<> &bs ) {
+        s = bs;
+    }
+};
+
+// number of 64bit words of the smallest fixed_split that can hold num_taxa, or 0 if the taxon count
+// is too large for any of the instantiated widths (-> use boost::dynamic_bitset)
+inline size_t fixed_split_words_for( size_t num_taxa ) {
+    const size_t words = (num_taxa + 63) / 64;
+
+    for( size_t w = 1; w <= 16; w *= 2 ) {
+        if( words <= w ) {
+            return w;
+        }
+    }
+    return 0;
+}
+
+// the split of a (sorted) tip name list. This is the straightforward version (the baseline of
+// spr_bench), the trace walk resolves the tip lists with the taxon dictionary in
+// trace_record_batch::get_split instead.
+inline boost::dynamic_bitset<> tip_list_to_split( const std::vector<std::string> &split, const std::vector<std::string> &sorted_names ) {
+    boost::dynamic_bitset<> bitset(sorted_names.size());
+
+    for( std::vector< std::string >::const_iterator it = split.begin(); it != split.end(); ++it ) {
+        std::vector< std::string >::const_iterator sit = std::lower_bound(sorted_names.begin(), sorted_names.end(), *it );
+
+        assert( sit != sorted_names.end() );
+
+//         std::cout << *sit << " " << *it << "\n";
+        assert( *sit == *it );
+
+        size_t idx = std::distance( sorted_names.begin(), sit );
+        assert( idx < sorted_names.size() );
+
+        bitset[idx] = true;
+    }
+    return bitset;
+}
+
+// maps splits to the node that get_all_splits_by_node reported for them. The keys are normalised
+// against their complement (the stored representative never contains taxon 0), so that a lookup
+// succeeds for either side of an edge. The orientation is tracked separately: find returns the node
+// whose split is exactly the queried one, which for a complement lookup is the node's back.
+template<typename split_type_>
+class split_node_index {
+public:
+    typedef split_type_ split_type;
+
+    split_node_index( size_t num_taxa, const std::vector<ivy_mike::tree_parser_ms::lnode *> &nodes, const std::vector<boost::dynamic_bitset<> > &splits )
+      : num_taxa_(num_taxa)
+    {
+        assert( nodes.size() == splits.size() );
+
+        map_.rehash( splits.size() );
+
+        for( size_t i = 0; i < splits.size(); ++i ) {
+            split_type key;
+            split_traits<split_type>::assign( key, splits[i] );
+
+            entry e;
+            e.node = nodes[i];
+            e.flipped = normalise( key );
+
+            map_.insert( std::make_pair( key, e ) );
+        }
+    }
+
+    ivy_mike::tree_parser_ms::lnode *find( const split_type &split ) const {
+        split_type key( split );
+        const bool flipped = normalise( key );
+
+        typename map_type::const_iterator it = map_.find( key );
+
+        if( it == map_.end() ) {
+            return 0;
+        }
+
+        return it->second.flipped == flipped ? it->second.node : it->second.node->back;
+    }
+
+    size_t size() const {
+        return map_.size();
+    }
+
+    size_t num_taxa() const {
+        return num_taxa_;
+    }
+
+    // an empty split of the right size for this index (for the trace_reader::get_*_split methods)
+    split_type make_split() const {
+        split_type s;
+        split_traits<split_type>::reset( s, num_taxa_ );
+        return s;
+    }
+
+private:
+    struct entry {
+        ivy_mike::tree_parser_ms::lnode *node;
+        bool flipped;
+    };
+
+    typedef std::tr1::unordered_map<split_type, entry, typename split_traits<split_type>::hash_type> map_type;
+
+    bool normalise( split_type &s ) const {
+        if( num_taxa_ > 0 && s.test(0) ) {
+            split_traits<split_type>::flip( s, num_taxa_ );
+            return true;
+        }
+        return false;
+    }
+
+    size_t num_taxa_;
+    map_type map_;
+};
+
+#endif
@@ -0,0 +1,619 @@
+#include <cassert>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <boost/dynamic_bitset.hpp>
+#include <boost/program_options.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "ivymike/tree_parser.h"
+#include "ivymike/tree_split_utils.h"
+#include "taxon_dict.h"
+#include "trace_reader.h"
+#include "fixed_split.h"
+#include "split_index.h"
+#include "interval_split_index.h"
+#include "newick_emitter.h"
+#include "trace_generator.h"
+
+// microbenchmarks of the hot paths of spr_vis_test on a synthetic trace. Every benchmark writes one
+// JSON object per line to stdout:
+//
+//   {"benchmark":"reader_next","taxa":100,"trees":10,"subtrees":10,"insertions":10,"ops":1210,"seconds":0.000141,"ns_per_op":116.5}
+//
+// seconds is the best of --repeat runs.
+
+using ivy_mike::tree_parser_ms::lnode;
+using ivy_mike::tree_parser_ms::ln_pool;
+using ivy_mike::tree_parser_ms::prune_with_rollback;
+using ivy_mike::tree_parser_ms::splice_with_rollback;
+
+class bench_timer {
+public:
+    bench_timer() : start_( boost::posix_time::microsec_clock::universal_time() ) {}
+
+    double seconds() const {
+        return (boost::posix_time::microsec_clock::universal_time() - start_).total_microseconds() * 1e-6;
+    }
+
+private:
+    boost::posix_time::ptime start_;
+};
+
+class bench_report {
+public:
+    bench_report( std::ostream &os, const trace_generator_params &params ) : os_(os), params_(params) {}
+
+    void add( const char *name, size_t ops, double seconds ) {
+        os_ << "{\"benchmark\":\"" << name << "\""
+            << ",\"taxa\":" << params_.taxa
+            << ",\"trees\":" << params_.trees
+            << ",\"subtrees\":" << params_.subtrees
+            << ",\"insertions\":" << params_.insertions
+            << ",\"ops\":" << ops
+            << ",\"seconds\":" << seconds
+            << ",\"ns_per_op\":" << (ops > 0 ? seconds * 1e9 / ops : 0.0)
+            << "}\n";
+    }
+
+private:
+    std::ostream &os_;
+    const trace_generator_params params_;
+};
+
+// the records of the generated trace, grouped by tree
+struct bench_tree {
+    std::string tree;
+    std::vector<std::string> subtrees;
+    std::vector<std::vector<std::string> > insertions; // per subtree
+
+    // filled in before the benchmarks run: the parsed tree, the prune nodes and insertion edges
+    lnode *root;
+    std::vector<lnode *> prune_nodes;
+    std::vector<std::vector<lnode *> > insertion_edges;
+};
+
+// the benchmark body is a functor with operator()() returning the number of ops
+template<typename body_type>
+void run_bench( bench_report &report, const char *name, size_t repeat, body_type body ) {
+    double best = 0;
+    size_t ops = 0;
+
+    for( size_t r = 0; r < repeat; ++r ) {
+        bench_timer timer;
+        ops = body();
+        const double t = timer.seconds();
+
+        if( r == 0 || t < best ) {
+            best = t;
+        }
+    }
+    report.add( name, ops, best );
+}
+
+// stable line source over the generated trace (like the mapped trace file, the lines stay valid)
+class memory_line_source : public line_source {
+public:
+    memory_line_source( const std::string &trace ) : cur_(trace.data()), end_(trace.data() + trace.size()) {}
+
+    virtual bool next_line( char_range &line ) {
+        if( cur_ == end_ ) {
+            return false;
+        }
+
+        const char *nl = std::find( cur_, end_, '\n' );
+        line = char_range( cur_, nl );
+        cur_ = nl == end_ ? end_ : nl + 1;
+        return true;
+    }
+
+    virtual bool stable() const {
+        return true;
+    }
+
+private:
+    const char *cur_;
+    const char * const end_;
+};
+
+struct reader_next_body {
+    const std::string &trace;
+
+    reader_next_body( const std::string &trace_ ) : trace(trace_) {}
+
+    size_t operator()() const {
+        std::istringstream is( trace );
+        ln_pool pool;
+        trace_reader tr( new stream_line_source( is ), &pool );
+
+        size_t n = 0;
+        while( tr.next() != trace_element::none ) {
+            ++n;
+        }
+        return n;
+    }
+};
+
+// parse (and release) the trees: with the ivy_mike parser or scan_tree_parser and the ln_pool
+// mark-and-sweep, or with scan_tree_parser and the tree_arena
+enum tree_parse_mode {
+    parse_ivy_mike,
+    parse_scan,
+    parse_arena
+};
+
+struct reader_get_tree_body {
+    const std::string &trace;
+    const tree_parse_mode mode;
+
+    reader_get_tree_body( const std::string &trace_, tree_parse_mode mode_ ) : trace(trace_), mode(mode_) {}
+
+    size_t operator()() const {
+        std::istringstream is( trace );
+        ln_pool pool;
+        tree_arena arena;
+        tree_parser_check check;
+        trace_reader tr( new stream_line_source( is ), &pool );
+
+        if( mode == parse_arena ) {
+            tr.set_arena( &arena, &check );
+        } else if( mode == parse_scan ) {
+            tr.set_parser_check( &check );
+        }
+
+        size_t n = 0;
+        trace_element::trace_type type;
+        while( (type = tr.next()) != trace_element::none ) {
+            if( type == trace_element::tree ) {
+                trace_tree t = tr.get_tree();
+
+                if( !tr.uses_arena() ) {
+                    pool.clear();
+                    pool.mark( t.get_tree() );
+                    pool.sweep();
+                }
+                ++n;
+            }
+        }
+        return n;
+    }
+};
+
+// get_subtree_split / get_insertion_split with the taxon dictionary: the streaming decode, one record
+// at a time (the trace walk uses read_records)
+template<typename split_type>
+struct reader_get_split_body {
+    const std::string &trace;
+    const taxon_dict &taxa;
+
+    reader_get_split_body( const std::string &trace_, const taxon_dict &taxa_ ) : trace(trace_), taxa(taxa_) {}
+
+    size_t operator()() const {
+        std::istringstream is( trace );
+        ln_pool pool;
+        trace_reader tr( new stream_line_source( is ), &pool );
+
+        size_t n = 0;
+        size_t bits = 0;
+        trace_element::trace_type type;
+        while( (type = tr.next()) != trace_element::none ) {
+            split_type split;
+            split_traits<split_type>::reset( split, taxa.size() );
+
+            if( type == trace_element::subtree ) {
+                tr.get_subtree_split( taxa, split );
+            } else if( type == trace_element::insertion ) {
+                tr.get_insertion_split( taxa, split );
+            } else {
+                continue;
+            }
+            bits += split.count();
+            ++n;
+        }
+        assert( bits > 0 );
+        return n;
+    }
+};
+
+// the straightforward path: a vector of tip names per record and tip_list_to_split
+struct tip_list_to_split_body {
+    const std::string &trace;
+    const std::vector<std::string> &sorted_names;
+
+    tip_list_to_split_body( const std::string &trace_, const std::vector<std::string> &sorted_names_ ) : trace(trace_), sorted_names(sorted_names_) {}
+
+    size_t operator()() const {
+        std::istringstream is( trace );
+        stream_line_source source( is );
+
+        size_t n = 0;
+        size_t bits = 0;
+        char_range line;
+        while( source.next_line( line ) ) {
+            const trace_element::trace_type type = classify_record( line );
+            if( type != trace_element::subtree && type != trace_element::insertion ) {
+                continue;
+            }
+
+            const char *first = std::find( line.first, line.last, '(' ) + 1;
+            const char *last = std::find( first, line.last, ')' );
+
+            std::vector<std::string> names;
+            ws_tokenizer tok( first, last );
+            char_range name;
+            while( tok.next( name ) ) {
+                names.push_back( name.str() );
+            }
+
+            bits += tip_list_to_split( names, sorted_names ).count();
+            ++n;
+        }
+        assert( bits > 0 );
+        return n;
+    }
+};
+
+// read_records (the trace walk decodes the records of a tree into a trace_record_batch) and the splits
+// of the records. With a stable source (as for a mapped trace) the batch keeps views of the tip lists,
+// otherwise it copies them.
+template<typename split_type>
+struct reader_read_records_body {
+    const std::string &trace;
+    const taxon_dict &taxa;
+    const bool stable;
+
+    reader_read_records_body( const std::string &trace_, const taxon_dict &taxa_, bool stable_ ) : trace(trace_), taxa(taxa_), stable(stable_) {}
+
+    size_t operator()() const {
+        std::istringstream is( trace );
+        ln_pool pool;
+        trace_reader tr( stable ? static_cast<line_source *>( new memory_line_source( trace ) ) : new stream_line_source( is ), &pool );
+        trace_record_batch records;
+
+        size_t n = 0;
+        size_t bits = 0;
+        trace_element::trace_type type = tr.next();
+        while( type == trace_element::tree ) {
+            type = tr.read_records( taxa, records );
+
+            for( size_t i = 0; i < records.size(); ++i ) {
+                split_type split;
+                split_traits<split_type>::reset( split, taxa.size() );
+                records.get_split( i, split );
+                bits += split.count();
+            }
+            n += records.size();
+        }
+        assert( bits > 0 );
+        return n;
+    }
+};
+
+// split index construction (including get_all_splits_by_node)
+template<typename split_type>
+struct split_index_build_body {
+    std::vector<bench_tree> &trees;
+    const taxon_dict &taxa;
+
+    split_index_build_body( std::vector<bench_tree> &trees_, const taxon_dict &taxa_ ) : trees(trees_), taxa(taxa_) {}
+
+    size_t operator()() const {
+        size_t n = 0;
+
+        for( std::vector<bench_tree>::iterator it = trees.begin(); it != trees.end(); ++it ) {
+            std::vector<lnode *> sorted_tips;
+            std::vector<lnode *> nodes;
+            std::vector<boost::dynamic_bitset<> > splits;
+
+            ivy_mike::get_all_splits_by_node( it->root, nodes, splits, sorted_tips );
+            split_node_index<split_type> index( taxa.size(), nodes, splits );
+            n += index.size();
+        }
+        assert( n > 0 );
+        return trees.size();
+    }
+};
+
+// resolves the tip lists of subtree/insertion records to nodes via the index
+template<typename index_type>
+size_t find_records( const index_type &index, const taxon_dict &taxa, const std::vector<std::string> &records, std::vector<lnode *> *found ) {
+    ln_pool pool;
+
+    for( std::vector<std::string>::const_iterator it = records.begin(); it != records.end(); ++it ) {
+        std::istringstream is( *it );
+        trace_reader tr( new stream_line_source( is ), &pool );
+        const trace_element::trace_type type = tr.next();
+
+        typename index_type::split_type split = index.make_split();
+        if( type == trace_element::subtree ) {
+            tr.get_subtree_split( taxa, split );
+        } else {
+            tr.get_insertion_split( taxa, split );
+        }
+
+        lnode *node = index.find( split );
+        assert( node != 0 );
+
+        if( found != 0 ) {
+            found->push_back( node );
+        }
+    }
+    return records.size();
+}
+
+// lookups only (the splits are resolved beforehand)
+template<typename index_type>
+struct index_find_body {
+    const index_type &index;
+    const std::vector<typename index_type::split_type> &splits;
+
+    index_find_body( const index_type &index_, const std::vector<typename index_type::split_type> &splits_ ) : index(index_), splits(splits_) {}
+
+    size_t operator()() const {
+        size_t found = 0;
+        for( typename std::vector<typename index_type::split_type>::const_iterator it = splits.begin(); it != splits.end(); ++it ) {
+            if( index.find( *it ) != 0 ) {
+                ++found;
+            }
+        }
+        assert( found == splits.size() );
+        return splits.size();
+    }
+};
+
+struct interval_index_build_body {
+    std::vector<bench_tree> &trees;
+    const taxon_dict &taxa;
+
+    interval_index_build_body( std::vector<bench_tree> &trees_, const taxon_dict &taxa_ ) : trees(trees_), taxa(taxa_) {}
+
+    size_t operator()() const {
+        for( std::vector<bench_tree>::iterator it = trees.begin(); it != trees.end(); ++it ) {
+            interval_split_index index( it->root );
+            const bool bound = index.bind( taxa );
+            assert( bound );
+        }
+        return trees.size();
+    }
+};
+
+// prune every subtree and splice it into all of its insertion edges (with rollback)
+struct prune_splice_body {
+    std::vector<bench_tree> &trees;
+
+    prune_splice_body( std::vector<bench_tree> &trees_ ) : trees(trees_) {}
+
+    size_t operator()() const {
+        size_t n = 0;
+
+        for( std::vector<bench_tree>::iterator it = trees.begin(); it != trees.end(); ++it ) {
+            for( size_t s = 0; s < it->prune_nodes.size(); ++s ) {
+                lnode *prune_node = it->prune_nodes[s];
+                prune_with_rollback prune( prune_node );
+
+                const std::vector<lnode *> &edges = it->insertion_edges[s];
+                for( std::vector<lnode *>::const_iterator eit = edges.begin(); eit != edges.end(); ++eit ) {
+                    splice_with_rollback splice( *eit, prune_node );
+                    ++n;
+                }
+            }
+        }
+        return n;
+    }
+};
+
+// newick output of every reconstructed tree (print_newick or the incremental emitter)
+struct newick_body {
+    std::vector<bench_tree> &trees;
+    const bool incremental;
+
+    newick_body( std::vector<bench_tree> &trees_, bool incremental_ ) : trees(trees_), incremental(incremental_) {}
+
+    size_t operator()() const {
+        size_t n = 0;
+        size_t bytes = 0;
+        newick_emitter emitter;
+
+        for( std::vector<bench_tree>::iterator it = trees.begin(); it != trees.end(); ++it ) {
+            if( incremental ) {
+                emitter.reset( it->root );
+            }
+
+            for( size_t s = 0; s < it->prune_nodes.size(); ++s ) {
+                lnode *prune_node = it->prune_nodes[s];
+
+                if( incremental ) {
+                    emitter.set_pruned( prune_node );
+                }
+                prune_with_rollback prune( prune_node );
+
+                const std::vector<lnode *> &edges = it->insertion_edges[s];
+                for( std::vector<lnode *>::const_iterator eit = edges.begin(); eit != edges.end(); ++eit ) {
+                    if( incremental ) {
+                        emitter.set_spliced( *eit );
+                    }
+                    splice_with_rollback splice( *eit, prune_node );
+
+                    lnode *root = ivy_mike::tree_parser_ms::next_non_tip( *eit );
+
+                    if( incremental && emitter.enabled() ) {
+                        std::string out;
+                        emitter.write( root, out );
+                        bytes += out.size();
+                    } else {
+                        std::ostringstream os;
+                        ivy_mike::tree_parser_ms::print_newick( root, os );
+                        bytes += os.str().size();
+                    }
+                    ++n;
+                }
+            }
+        }
+        assert( bytes > 0 );
+        return n;
+    }
+};
+
+template<typename split_type>
+void run_split_benchmarks( bench_report &report, size_t repeat, const std::string &trace, std::vector<bench_tree> &trees, const taxon_dict &taxa ) {
+    run_bench( report, "reader_get_split", repeat, reader_get_split_body<split_type>( trace, taxa ) );
+    run_bench( report, "reader_read_records", repeat, reader_read_records_body<split_type>( trace, taxa, false ) );
+    run_bench( report, "reader_read_records_stable", repeat, reader_read_records_body<split_type>( trace, taxa, true ) );
+    run_bench( report, "split_index_build", repeat, split_index_build_body<split_type>( trees, taxa ) );
+
+    // lookups of all splits of the first tree
+    std::vector<lnode *> sorted_tips;
+    std::vector<lnode *> nodes;
+    std::vector<boost::dynamic_bitset<> > splits;
+    ivy_mike::get_all_splits_by_node( trees.front().root, nodes, splits, sorted_tips );
+    split_node_index<split_type> index( taxa.size(), nodes, splits );
+
+    std::vector<split_type> queries;
+    for( size_t i = 0; i < nodes.size(); ++i ) {
+        split_type s;
+        split_traits<split_type>::assign( s, splits[i] );
+        queries.push_back( s );
+    }
+    run_bench( report, "split_index_find", repeat, index_find_body<split_node_index<split_type> >( index, queries ) );
+}
+
+int main( int argc, char *argv[] ) {
+    namespace po = boost::program_options;
+
+    trace_generator_params params;
+    size_t repeat = 3;
+    std::string generate_name;
+
+    po::options_description desc( "options" );
+    desc.add_options()
+        ( "help,h", "show help" )
+        ( "taxa", po::value<size_t>( &params.taxa )->default_value( params.taxa ), "number of taxa" )
+        ( "trees", po::value<size_t>( &params.trees )->default_value( params.trees ), "number of trees in the trace" )
+        ( "subtrees", po::value<size_t>( &params.subtrees )->default_value( params.subtrees ), "subtrees per tree" )
+        ( "insertions", po::value<size_t>( &params.insertions )->default_value( params.insertions ), "insertions per subtree" )
+        ( "seed", po::value<boost::uint64_t>( &params.seed )->default_value( params.seed ), "random seed of the trace generator" )
+        ( "repeat", po::value<size_t>( &repeat )->default_value( repeat ), "runs per benchmark (the best one is reported)" )
+        ( "generate", po::value<std::string>( &generate_name ), "only write the synthetic trace to this file" );
+
+    po::variables_map vm;
+    po::store( po::parse_command_line( argc, argv, desc ), vm );
+    po::notify( vm );
+
+    if( vm.count( "help" ) ) {
+        std::cerr << "usage: " << argv[0] << " [options]\n" << desc << "\n";
+        return 0;
+    }
+
+    if( params.trees == 0 || params.subtrees == 0 || params.insertions == 0 || repeat == 0 ) {
+        std::cerr << "--trees, --subtrees, --insertions and --repeat must be > 0\n";
+        return 1;
+    }
+
+    std::string trace;
+    {
+        std::ostringstream os;
+        trace_generator gen( params );
+        gen.write( os );
+        trace = os.str();
+    }
+
+    if( !generate_name.empty() ) {
+        std::ofstream os( generate_name.c_str(), std::ios::binary );
+        os << trace;
+        return os.good() ? 0 : 1;
+    }
+
+    // group the records by tree and parse the trees once for the tree benchmarks
+    ln_pool pool;
+    std::vector<bench_tree> trees;
+    {
+        std::istringstream is( trace );
+        std::string line;
+        while( std::getline( is, line ) ) {
+            const trace_element::trace_type type = classify_record( char_range( line.data(), line.data() + line.size() ) );
+
+            if( type == trace_element::tree ) {
+                trees.push_back( bench_tree() );
+                trees.back().tree = line;
+            } else if( type == trace_element::subtree ) {
+                trees.back().subtrees.push_back( line );
+                trees.back().insertions.push_back( std::vector<std::string>() );
+            } else if( type == trace_element::insertion ) {
+                trees.back().insertions.back().push_back( line );
+            }
+        }
+    }
+
+    taxon_dict taxa;
+    std::vector<std::string> sorted_names;
+
+    for( std::vector<bench_tree>::iterator it = trees.begin(); it != trees.end(); ++it ) {
+        std::istringstream is( it->tree );
+        trace_reader tr( new stream_line_source( is ), &pool );
+        tr.next();
+        it->root = tr.get_tree().get_tree();
+
+        std::vector<lnode *> sorted_tips;
+        std::vector<lnode *> nodes;
+        std::vector<boost::dynamic_bitset<> > splits;
+        ivy_mike::get_all_splits_by_node( it->root, nodes, splits, sorted_tips );
+
+        if( taxa.size() == 0 ) {
+            taxa.init( sorted_tips );
+            for( std::vector<lnode *>::iterator tit = sorted_tips.begin(); tit != sorted_tips.end(); ++tit ) {
+                sorted_names.push_back( (*tit)->m_data->tipName );
+            }
+        }
+
+        split_node_index<boost::dynamic_bitset<> > index( taxa.size(), nodes, splits );
+
+        // resolve the prune nodes and insertion edges like the trace walk does
+        std::vector<lnode *> split_nodes;
+        find_records( index, taxa, it->subtrees, &split_nodes );
+
+        for( size_t s = 0; s < split_nodes.size(); ++s ) {
+            it->prune_nodes.push_back( split_nodes[s]->back );
+            it->insertion_edges.push_back( std::vector<lnode *>() );
+            find_records( index, taxa, it->insertions[s], &it->insertion_edges.back() );
+        }
+    }
+
+    bench_report report( std::cout, params );
+
+    run_bench( report, "reader_next", repeat, reader_next_body( trace ) );
+    run_bench( report, "reader_get_tree", repeat, reader_get_tree_body( trace, parse_ivy_mike ) );
+    run_bench( report, "reader_get_tree_scan", repeat, reader_get_tree_body( trace, parse_scan ) );
+    run_bench( report, "reader_get_tree_arena", repeat, reader_get_tree_body( trace, parse_arena ) );
+    run_bench( report, "tip_list_to_split", repeat, tip_list_to_split_body( trace, sorted_names ) );
+
+    switch( fixed_split_words_for( taxa.size() ) ) {
+    case 1:
+        run_split_benchmarks<fixed_split<1> >( report, repeat, trace, trees, taxa );
+        break;
+    case 2:
+        run_split_benchmarks<fixed_split<2> >( report, repeat, trace, trees, taxa );
+        break;
+    case 4:
+        run_split_benchmarks<fixed_split<4> >( report, repeat, trace, trees, taxa );
+        break;
+    case 8:
+        run_split_benchmarks<fixed_split<8> >( report, repeat, trace, trees, taxa );
+        break;
+    case 16:
+        run_split_benchmarks<fixed_split<16> >( report, repeat, trace, trees, taxa );
+        break;
+    default:
+        run_split_benchmarks<boost::dynamic_bitset<> >( report, repeat, trace, trees, taxa );
+        break;
+    }
+
+    run_bench( report, "interval_index_build", repeat, interval_index_build_body( trees, taxa ) );
+    run_bench( report, "prune_splice", repeat, prune_splice_body( trees ) );
+    run_bench( report, "print_newick", repeat, newick_body( trees, false ) );
+    run_bench( report, "incremental_newick", repeat, newick_body( trees, true ) );
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+#ifndef __spr_delta_h
+#define __spr_delta_h
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "binary_tree.h"
+#include "tree_sink.h"
+
+// delta encoded output (spr_vis_test --delta): instead of the full pruned trees, pruned subtrees and
+// SPR trees, every @tree gets one file (trees/m.<tree>) with the tree itself and one move record per
+// subtree and insertion. The trees are reconstructed by spr_delta_decoder with the same prune and
+// splice as in spr_vis_test, so they are identical to the full output.
+//
+// delta file:   4 byte magic "SPD1" | varint tree number | varint length | newick of the @tree record
+//               | varint num_lnodes | records | 'E'
+// records:      'S' varint subtree | varint prune lnode           (starts a subtree, x.<tree>.<subtree>
+//                                                                   and y.<tree>.<subtree>)
+//               'I' varint insertion | varint regraft lnode | u64 LE score (double bits)
+//                                                                  (<tree>.<subtree>.<insertion>)
+//
+// The lnodes are numbered in newick order (see number_lnodes). The newick text is the one of the
+// trace, so the decoder parses exactly the tree of the encoder (with all digits of the branch lengths)
+// and gets the same numbers. All integers are unsigned LEB128 varints (see binary_tree.h).
+namespace spr_delta {
+    const char magic[4] = { 'S', 'P', 'D', '1' };
+
+    const char subtree_record = 'S';
+    const char insertion_record = 'I';
+    const char end_record = 'E';
+
+    // all lnodes of a tree in the order in which print_newick visits them from next_non_tip(tree): the
+    // lnodes of the root, then for every node the lnode pointing to the parent and the two lnodes
+    // pointing to the children. The order only depends on the newick text of the tree.
+    inline void number_lnodes( ivy_mike::tree_parser_ms::lnode *tree, std::vector<ivy_mike::tree_parser_ms::lnode *> &order ) {
+        using ivy_mike::tree_parser_ms::lnode;
+
+        order.clear();
+
+        lnode *root = ivy_mike::tree_parser_ms::next_non_tip( tree );
+        order.push_back( root );
+        order.push_back( root->next );
+        order.push_back( root->next->next );
+
+        std::vector<lnode *> stack;
+        stack.push_back( root->next->next->back );
+        stack.push_back( root->next->back );
+        stack.push_back( root->back );
+
+        while( !stack.empty() ) {
+            lnode *n = stack.back();
+            stack.pop_back();
+
+            order.push_back( n );
+
+            if( !n->m_data->isTip ) {
+                order.push_back( n->next );
+                order.push_back( n->next->next );
+
+                stack.push_back( n->next->next->back );
+                stack.push_back( n->next->back );
+            }
+        }
+    }
+}
+
+// writes the delta file of one tree during the trace walk
+class spr_delta_encoder {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    // start the delta file of a new tree. first/last is the newick text the tree was parsed from, tree
+    // the unmodified tree.
+    void reset( lnode *tree, const char *first, const char *last, size_t tree_number ) {
+        spr_delta::number_lnodes( tree, order_ );
+
+        ids_.clear();
+        for( size_t i = 0; i < order_.size(); ++i ) {
+            ids_[order_[i]] = i;
+        }
+
+        data_.clear();
+        data_.append( spr_delta::magic, sizeof(spr_delta::magic) );
+        binary_tree::put_varint( data_, tree_number );
+        binary_tree::put_varint( data_, last - first );
+        data_.append( first, last );
+        binary_tree::put_varint( data_, order_.size() );
+    }
+
+    // the subtree pruned at prune_node. Starts the moves of the subtree.
+    void add_subtree( size_t subtree, lnode *prune_node ) {
+        data_ += spr_delta::subtree_record;
+        binary_tree::put_varint( data_, subtree );
+        binary_tree::put_varint( data_, id( prune_node ) );
+    }
+
+    // the current subtree spliced into insertion_edge
+    void add_insertion( size_t insertion, lnode *insertion_edge, double score ) {
+        boost::uint64_t bits;
+        std::memcpy( &bits, &score, sizeof(bits) );
+
+        data_ += spr_delta::insertion_record;
+        binary_tree::put_varint( data_, insertion );
+        binary_tree::put_varint( data_, id( insertion_edge ) );
+        binary_tree::put_u64( data_, bits );
+    }
+
+    // the complete delta file (after the last subtree of the tree)
+    const std::string &finish() {
+        data_ += spr_delta::end_record;
+        return data_;
+    }
+
+private:
+    size_t id( lnode *n ) const {
+        id_map::const_iterator it = ids_.find( n );
+        assert( it != ids_.end() );
+        return it->second;
+    }
+
+    typedef std::tr1::unordered_map<const lnode *, size_t> id_map;
+
+    std::vector<lnode *> order_;
+    id_map ids_;
+    std::string data_;
+};
+
+// reconstructs the trees of a delta file. The base tree is parsed into pool (the caller owns it and
+// can mark-and-sweep it between delta files, like the trace walk does between trees).
+class spr_delta_decoder {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    struct move {
+        size_t insertion;
+        size_t regraft;
+        double score;
+    };
+
+    struct subtree {
+        size_t number;
+        size_t prune;
+        std::vector<move> moves;
+    };
+
+    spr_delta_decoder( const std::string &data, ivy_mike::tree_parser_ms::ln_pool &pool ) {
+        if( !binary_tree::has_magic( data, spr_delta::magic, sizeof(spr_delta::magic) ) ) {
+            throw std::runtime_error( "not a delta file" );
+        }
+
+        binary_tree::decoder d( data );
+        d.bytes( sizeof(spr_delta::magic) );
+
+        tree_number_ = size_t( d.varint() );
+
+        const size_t len = size_t( d.varint() );
+        const char *newick = d.bytes( len );
+
+        ivy_mike::tree_parser_ms::parser p( newick, newick + len, pool );
+        tree_ = p.parse();
+
+        spr_delta::number_lnodes( tree_, order_ );
+        if( d.varint() != order_.size() ) {
+            throw std::runtime_error( "tree of the delta file does not match its lnode count" );
+        }
+
+        while( true ) {
+            const char type = char( d.byte() );
+
+            if( type == spr_delta::end_record ) {
+                break;
+            } else if( type == spr_delta::subtree_record ) {
+                subtrees_.push_back( subtree() );
+                subtrees_.back().number = size_t( d.varint() );
+                subtrees_.back().prune = lnode_id( d.varint() );
+            } else if( type == spr_delta::insertion_record && !subtrees_.empty() ) {
+                move m;
+                m.insertion = size_t( d.varint() );
+                m.regraft = lnode_id( d.varint() );
+
+                const boost::uint64_t bits = d.u64();
+                std::memcpy( &m.score, &bits, sizeof(bits) );
+
+                subtrees_.back().moves.push_back( m );
+            } else {
+                throw std::runtime_error( "bad record in delta file" );
+            }
+        }
+    }
+
+    size_t tree_number() const {
+        return tree_number_;
+    }
+
+    // the base tree (unmodified between the calls)
+    lnode *tree() const {
+        return tree_;
+    }
+
+    const std::vector<subtree> &subtrees() const {
+        return subtrees_;
+    }
+
+    // the tree with the given key (pruned tree, pruned subtree or SPR tree of this delta file) in
+    // newick, the same as in the full output. Returns false if the file has no such tree.
+    bool reconstruct( const tree_key &key, std::string &newick ) {
+        if( key.tree != tree_number_ ) {
+            return false;
+        }
+
+        for( std::vector<subtree>::const_iterator it = subtrees_.begin(); it != subtrees_.end(); ++it ) {
+            if( it->number == key.subtree ) {
+                string_sink sink( newick );
+                return reconstruct( *it, &key, sink );
+            }
+        }
+        return false;
+    }
+
+    // writes all trees of the delta file to out, in the order of the full output
+    void reconstruct_all( tree_sink &out ) {
+        for( std::vector<subtree>::const_iterator it = subtrees_.begin(); it != subtrees_.end(); ++it ) {
+            reconstruct( *it, 0, out );
+        }
+    }
+
+private:
+    size_t lnode_id( boost::uint64_t id ) const {
+        if( id >= order_.size() ) {
+            throw std::runtime_error( "lnode out of range in delta file" );
+        }
+        return size_t(id);
+    }
+
+    // the trees of subtree s (only the one with key only, if only is not 0). Same prune and splice as
+    // in the trace walk, both are rolled back at the end.
+    bool reconstruct( const subtree &s, const tree_key *only, tree_sink &out ) {
+        using ivy_mike::tree_parser_ms::prune_with_rollback;
+        using ivy_mike::tree_parser_ms::splice_with_rollback;
+
+        lnode *prune_node = order_[s.prune];
+        prune_with_rollback prune( prune_node );
+
+        bool found = false;
+
+        const tree_key pruned_key( tree_key::pruned_tree, tree_number_, s.number );
+        if( only == 0 || only->kind == tree_key::pruned_tree ) {
+            write( out, pruned_key, ivy_mike::tree_parser_ms::next_non_tip( prune.get_save_node() ), true );
+            found = true;
+        }
+
+        const tree_key subtree_key( tree_key::pruned_subtree, tree_number_, s.number );
+        if( only == 0 || only->kind == tree_key::pruned_subtree ) {
+            write( out, subtree_key, prune_node->back, false );
+            found = true;
+        }
+
+        for( std::vector<move>::const_iterator it = s.moves.begin(); it != s.moves.end(); ++it ) {
+            const tree_key key( tree_key::spr_tree, tree_number_, s.number, it->insertion );
+
+            if( only == 0 || (only->kind == tree_key::spr_tree && only->insertion == key.insertion) ) {
+                lnode *insertion_edge = order_[it->regraft];
+                splice_with_rollback splice( insertion_edge, prune_node );
+
+                write( out, key, ivy_mike::tree_parser_ms::next_non_tip( insertion_edge ), true );
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    void write( tree_sink &out, const tree_key &key, lnode *node, bool root ) {
+        scratch_.str( std::string() );
+        ivy_mike::tree_parser_ms::print_newick( node, scratch_, root );
+        out.write( key, scratch_.str() );
+    }
+
+    // keeps the data of the last written tree
+    class string_sink : public tree_sink {
+    public:
+        string_sink( std::string &data ) : data_(data) {}
+
+        virtual void write( const tree_key &, const char *data, size_t size ) {
+            data_.assign( data, data + size );
+        }
+
+    private:
+        std::string &data_;
+    };
+
+    size_t tree_number_;
+    lnode *tree_;
+    std::vector<lnode *> order_;
+    std::vector<subtree> subtrees_;
+
+    std::ostringstream scratch_;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/scoped_ptr.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "spr_delta.h"
+#include "tree_archive.h"
+
+// reconstructs the trees from the delta files of spr_vis_test --delta. The output directory can be in
+// the one-file-per-tree layout or an archive (--archive). The trees are addressed by their names in
+// the full output (e.g., x.1.2, y.1.2 or 1.2.3), m.<tree> streams all trees of a tree as
+// '<name><tab><newick>' lines. Without tree names all trees of the archive are streamed.
+
+static std::string read_file( const std::string &name ) {
+    std::ifstream is( name.c_str(), std::ios::binary );
+
+    if( !is.good() ) {
+        throw std::runtime_error( "cannot open: " + name );
+    }
+
+    std::ostringstream ss;
+    ss << is.rdbuf();
+    return ss.str();
+}
+
+// writes the trees as '<name><tab><newick>' lines (the pruned subtrees have no newline of their own)
+class listing_sink : public tree_sink {
+public:
+    virtual void write( const tree_key &key, const char *data, size_t size ) {
+        std::cout << key.name() << "\t";
+        std::cout.write( data, size );
+
+        if( size == 0 || data[size - 1] != '\n' ) {
+            std::cout << "\n";
+        }
+    }
+};
+
+// the delta files of a tree directory. Only the decoder of the last used delta file is kept.
+class delta_files {
+public:
+    delta_files( const std::string &dir ) : dir_(dir), archive_( std::ifstream( tree_archive::index_name( dir ).c_str() ).good() ) {
+        if( archive_ ) {
+            reader_.reset( new tree_archive_reader( dir ) );
+        }
+    }
+
+    bool archive() const {
+        return archive_;
+    }
+
+    const tree_archive_reader &reader() const {
+        return *reader_;
+    }
+
+    // the decoder of the delta file of tree
+    spr_delta_decoder &get( size_t tree ) {
+        if( decoder_ != 0 && decoder_->tree_number() == tree ) {
+            return *decoder_;
+        }
+
+        const tree_key key( tree_key::delta, tree, 0 );
+        std::string data;
+
+        if( archive_ ) {
+            const tree_archive_reader::entry *e = reader_->find( key );
+            if( e == 0 ) {
+                throw std::runtime_error( "delta file not in archive: " + key.name() );
+            }
+            data = reader_->read( *e );
+        } else {
+            data = read_file( dir_ + "/" + key.name() );
+        }
+
+        // the previous base tree is garbage now
+        decoder_.reset();
+        pool_.clear();
+        pool_.sweep();
+
+        decoder_.reset( new spr_delta_decoder( data, pool_ ) );
+        return *decoder_;
+    }
+
+private:
+    const std::string dir_;
+    const bool archive_;
+    boost::scoped_ptr<tree_archive_reader> reader_;
+
+    ivy_mike::tree_parser_ms::ln_pool pool_;
+    boost::scoped_ptr<spr_delta_decoder> decoder_;
+};
+
+int main( int argc, char *argv[] ) {
+    if( argc < 2 ) {
+        std::cerr << "usage: " << argv[0] << " <tree dir> [tree name ...]\n";
+        return 1;
+    }
+
+    delta_files files( argv[1] );
+    listing_sink listing;
+
+    if( argc == 2 ) {
+        if( !files.archive() ) {
+            std::cerr << "tree names are required for the one-file-per-tree layout (m.<tree> for all trees of a tree)\n";
+            return 1;
+        }
+
+        const std::vector<tree_archive_reader::entry> &entries = files.reader().entries();
+
+        for( std::vector<tree_archive_reader::entry>::const_iterator it = entries.begin(); it != entries.end(); ++it ) {
+            if( it->key.kind == tree_key::delta ) {
+                files.get( it->key.tree ).reconstruct_all( listing );
+            }
+        }
+        return 0;
+    }
+
+    for( int i = 2; i < argc; ++i ) {
+        tree_key key;
+
+        if( !tree_key::parse( argv[i], key ) || (key.kind != tree_key::delta && key.kind != tree_key::pruned_tree && key.kind != tree_key::pruned_subtree && key.kind != tree_key::spr_tree) ) {
+            throw std::runtime_error( std::string( "bad tree name: " ) + argv[i] );
+        }
+
+        spr_delta_decoder &decoder = files.get( key.tree );
+
+        if( key.kind == tree_key::delta ) {
+            decoder.reconstruct_all( listing );
+            continue;
+        }
+
+        std::string newick;
+        if( !decoder.reconstruct( key, newick ) ) {
+            std::cerr << "tree not in delta file: " << argv[i] << "\n";
+            return 1;
+        }
+        std::cout << newick;
+    }
+
+    return 0;
+}
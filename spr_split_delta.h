@@ -0,0 +1,529 @@
+#ifndef __spr_split_delta_h
+#define __spr_split_delta_h
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "taxon_dict.h"
+
+// 128 bit hash of an unrooted topology: the sum of the hashes of the splits of all edges (including
+// the trivial ones). The sum does not depend on the order of the edges, so equal split sets (i.e.,
+// equal topologies) give equal hashes independently of the rooting and the node layout.
+struct topology_hash {
+    boost::uint64_t h[2];
+
+    topology_hash() {
+        h[0] = h[1] = 0;
+    }
+
+    bool operator==( const topology_hash &other ) const {
+        return h[0] == other.h[0] && h[1] == other.h[1];
+    }
+
+    bool operator!=( const topology_hash &other ) const {
+        return !(*this == other);
+    }
+};
+
+struct topology_hash_hasher {
+    size_t operator()( const topology_hash &t ) const {
+        return size_t(t.h[0]);
+    }
+};
+
+// the splits of a tree that differ in one of its SPR neighbours.
+//
+// Moving the subtree S from its attachment node x to the edge e only changes the splits on the path
+// between x and e: the path edges get S toggled to the other side, the two edges at x merge into
+// one and e is split in two. All other splits (and their branch lengths) are the same in both trees,
+// so an SPR tree is described by the few affected splits of the base tree and the ones replacing
+// them. The cost is O(path length) word operations per insertion, after an O(n^2 / 64) setup per
+// tree. Moving S on to an adjacent edge (see move) only changes a constant number of them, so a walk
+// over the edges (--edge-walk) costs O(n / 64) word operations per step.
+//
+// The splits are normalised (taxon 0 on the 0 side), so equal splits have equal words.
+//
+// REMARK: the splits of all edges are kept as bit vectors (about n^2 / 4 bytes for n taxa, see
+// memory_bytes), so reset rejects trees whose splits do not fit into the memory limit.
+class spr_split_delta {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    // max_bytes: memory limit of the edge splits (0: none)
+    spr_split_delta( boost::uint64_t max_bytes = 0 ) : max_bytes_(max_bytes), num_taxa_(0), num_words_(0), walk_prune_(0), walk_edge_(npos), walk_u_(0), walk_v_(0) {}
+
+    // memory of the edge splits of a tree with num_taxa taxa (one split per node of the rooted tree)
+    static boost::uint64_t memory_bytes( size_t num_taxa ) {
+        const boost::uint64_t nodes = 2 * boost::uint64_t(num_taxa);
+        return nodes * ((num_taxa + 63) / 64) * sizeof(boost::uint64_t);
+    }
+
+    // number the nodes and edges of a new tree and compute the splits of all edges. Must be called
+    // on the unmodified tree (before any prune/splice).
+    void reset( lnode *tree, const taxon_dict &taxa ) {
+        tree = ivy_mike::tree_parser_ms::next_non_tip( tree );
+
+        if( max_bytes_ != 0 && memory_bytes( taxa.size() ) > max_bytes_ ) {
+            std::ostringstream os;
+            os << "the splits of a tree with " << taxa.size() << " taxa need " << (memory_bytes( taxa.size() ) >> 20) << " MiB, more than the limit of " << (max_bytes_ >> 20) << " MiB";
+            throw std::runtime_error( os.str() );
+        }
+
+        num_taxa_ = taxa.size();
+        num_words_ = (num_taxa_ + 63) / 64;
+
+        lnode_info_.clear();
+        up_.clear();
+        back_base_.clear();
+        parent_.clear();
+        depth_.clear();
+        base_len_.clear();
+
+        // pre-order numbering. The root (node 0) has no edge, every other node i owns the edge above it.
+        add_node( 0, 0, 0, 0 );
+        std::vector<size_t> order; // pre-order
+        order.push_back( 0 );
+
+        for( size_t i = 0; i < order.size(); ++i ) {
+            const size_t node = order[i];
+            lnode *up = up_[node];
+
+            if( up != 0 && up->m_data->isTip ) {
+                continue;
+            }
+
+            // the ring members that point away from the root
+            lnode *children[3];
+            size_t num_children = 0;
+            if( up == 0 ) {
+                children[num_children++] = tree;
+                children[num_children++] = tree->next;
+                children[num_children++] = tree->next->next;
+            } else {
+                children[num_children++] = up->next;
+                children[num_children++] = up->next->next;
+            }
+
+            for( size_t j = 0; j < num_children; ++j ) {
+                const size_t child = up_.size();
+                add_node( children[j]->back, node, child, depth_[node] + 1 );
+                lnode_info_[children[j]] = info( node, child );
+                order.push_back( child );
+            }
+        }
+
+        // splits (the taxa below each node), in reverse pre-order
+        words_.assign( up_.size() * num_words_, 0 );
+
+        for( size_t i = order.size(); i-- > 1; ) {
+            const size_t node = order[i];
+            lnode *up = up_[node];
+
+            if( up->m_data->isTip ) {
+                const size_t taxon = taxa.lookup( up->m_data->tipName );
+                if( taxon == taxon_dict::npos ) {
+                    throw std::runtime_error( "spr_split_delta: unknown taxon " + up->m_data->tipName );
+                }
+                split( node )[taxon / 64] |= boost::uint64_t(1) << (taxon % 64);
+            }
+
+            boost::uint64_t *p = split( parent_[node] );
+            const boost::uint64_t *s = split( node );
+            for( size_t w = 0; w < num_words_; ++w ) {
+                p[w] |= s[w];
+            }
+        }
+
+        // hash of the base topology
+        base_hash_ = topology_hash();
+        std::vector<boost::uint64_t> s( num_words_ );
+        for( size_t node = 1; node < up_.size(); ++node ) {
+            std::copy( split( node ), split( node ) + num_words_, s.begin() );
+            normalise( &s[0] );
+            add_hash( base_hash_, &s[0], 1 );
+        }
+
+        entries_.clear();
+        scratch_.clear();
+        hash_ = base_hash_;
+        walk_prune_ = 0;
+        walk_edge_ = npos;
+    }
+
+    // the affected splits of the tree with the subtree at prune_node->back moved to insertion_edge.
+    // Must be called after the splice (the branch lengths of the new edges are taken from the tree),
+    // but the nodes are identified by their position in the base tree.
+    void update( lnode *prune_node, lnode *insertion_edge ) {
+        const size_t x = node_of( prune_node );
+        const size_t s_edge = edge_of( prune_node );
+        const size_t a_edge[2] = { edge_of( prune_node->next ), edge_of( prune_node->next->next ) };
+        const size_t e = edge_of( insertion_edge );
+
+        if( e == s_edge ) {
+            throw std::runtime_error( "spr_split_delta: insertion edge is the edge of the pruned subtree" );
+        }
+
+        // S: the taxa on the prune_node->back side
+        subtree_.assign( split( s_edge ), split( s_edge ) + num_words_ );
+        if( s_edge == x ) {
+            complement( &subtree_[0] ); // S is above x
+        }
+
+        entries_.clear();
+        scratch_.clear();
+        hash_ = base_hash_;
+        walk_prune_ = prune_node;
+        walk_edge_ = npos;
+        walk_path_.clear();
+
+        if( e == a_edge[0] || e == a_edge[1] ) {
+            // re-insertion at the original position: same topology, only the lengths of the two
+            // edges at x can differ
+            for( int i = 0; i < 2; ++i ) {
+                add_entry( split( a_edge[i] ), false, false, base_len_[a_edge[i]] );
+                add_entry( split( a_edge[i] ), false, true, far_end( a_edge[i], x )->backLen );
+            }
+            return;
+        }
+
+        // path from x to the lower end c of e, through the lowest common ancestor
+        const size_t c = e;
+        size_t i = x;
+        size_t j = c;
+        path_x_.clear();
+        path_c_.clear();
+
+        while( depth_[i] > depth_[j] ) {
+            path_x_.push_back( i );
+            i = parent_[i];
+        }
+        while( depth_[j] > depth_[i] ) {
+            path_c_.push_back( j );
+            j = parent_[j];
+        }
+        while( i != j ) {
+            path_x_.push_back( i );
+            path_c_.push_back( j );
+            i = parent_[i];
+            j = parent_[j];
+        }
+
+        // u is the end of e closer to x. If the path runs through e, e is the first edge of path_c_.
+        const bool u_is_c = path_c_.empty();
+        if( !u_is_c ) {
+            assert( path_c_.front() == e );
+            path_c_.erase( path_c_.begin() );
+        }
+
+        if( path_x_.empty() && path_c_.empty() ) {
+            throw std::runtime_error( "spr_split_delta: inconsistent path" );
+        }
+
+        // a1: the edge at x on the path, a2 the other edge at x (merged with a1 in the SPR tree)
+        const size_t a1 = !path_x_.empty() ? path_x_.front() : path_c_.back();
+        if( a1 != a_edge[0] && a1 != a_edge[1] ) {
+            throw std::runtime_error( "spr_split_delta: inconsistent path" );
+        }
+        const size_t a2 = a1 == a_edge[0] ? a_edge[1] : a_edge[0];
+
+        // the entries are kept as a stack, so that move can replace the end of the path:
+        // a1, a2 and the merged edge (which has the split of a2), then the path edges from x towards e
+        // (S is on the other side in the SPR tree), then e (see push_target)
+        add_entry( split( a1 ), false, false, base_len_[a1] );
+        add_entry( split( a2 ), false, false, base_len_[a2] );
+        add_entry( split( a2 ), false, true, far_end( a1, x )->backLen );
+
+        if( !path_x_.empty() ) {
+            walk_path_.assign( path_x_.begin() + 1, path_x_.end() );
+            walk_path_.insert( walk_path_.end(), path_c_.rbegin(), path_c_.rend() );
+        } else {
+            walk_path_.assign( path_c_.rbegin() + 1, path_c_.rend() );
+        }
+
+        for( std::vector<size_t>::const_iterator it = walk_path_.begin(); it != walk_path_.end(); ++it ) {
+            push_path_entries( *it );
+        }
+
+        push_target( e, u_is_c ? c : parent_[c] );
+    }
+
+    // like update, but if the last update (or move) had the same pruned subtree on an edge adjacent to
+    // insertion_edge (or on the same edge), only the entries that differ between the two edges are
+    // replaced (O(1) splits instead of the path). The entries are the same as the ones of update.
+    void move( lnode *prune_node, lnode *insertion_edge ) {
+        const size_t e = edge_of( insertion_edge );
+
+        if( prune_node != walk_prune_ || walk_edge_ == npos || e == edge_of( prune_node ) || e == edge_of( prune_node->next ) || e == edge_of( prune_node->next->next ) ) {
+            // no previous position, or from or onto the edges at the pruned node
+            update( prune_node, insertion_edge );
+            return;
+        }
+
+        const size_t u = walk_u_;
+        const size_t v = walk_v_;
+
+        if( e == walk_edge_ ) {
+            // same edge (the lengths of the halves are read again)
+            pop_target();
+            push_target( e, u );
+        } else if( has_end( e, v ) ) {
+            // away from x: the previous edge becomes a path edge
+            const size_t prev = walk_edge_;
+            pop_target();
+            walk_path_.push_back( prev );
+            push_path_entries( prev );
+            push_target( e, v );
+        } else if( !walk_path_.empty() && e == walk_path_.back() ) {
+            // towards x: the last path edge becomes the insertion edge
+            pop_target();
+            pop_entries( 2 );
+            walk_path_.pop_back();
+            push_target( e, e == u ? parent_[e] : e );
+        } else if( has_end( e, u ) ) {
+            // another edge at the end closer to x
+            pop_target();
+            push_target( e, u );
+        } else {
+            update( prune_node, insertion_edge );
+        }
+    }
+
+    // the affected splits of the last update: base tree entries (spr == false) and the SPR tree
+    // entries replacing them
+    size_t num_entries() const {
+        return entries_.size();
+    }
+
+    const boost::uint64_t *entry_split( size_t i ) const {
+        return &scratch_[entries_[i].offset];
+    }
+
+    bool entry_spr( size_t i ) const {
+        return entries_[i].spr;
+    }
+
+    double entry_len( size_t i ) const {
+        return entries_[i].len;
+    }
+
+    size_t num_words() const {
+        return num_words_;
+    }
+
+    // hash of the topology of the last update (kept up to date by the entries)
+    topology_hash hash() const {
+        return hash_;
+    }
+
+    const topology_hash &base_hash() const {
+        return base_hash_;
+    }
+
+private:
+    struct info {
+        size_t node; // the node (ring) the lnode belongs to
+        size_t edge; // the edge of the lnode (named by its lower node)
+
+        info() : node(0), edge(0) {}
+        info( size_t n, size_t e ) : node(n), edge(e) {}
+    };
+
+    struct entry {
+        size_t offset; // of the normalised split in scratch_
+        bool spr;      // false: base tree, true: SPR tree
+        double len;
+    };
+
+    // up: the lnode of the node that points to the parent (0 for the root)
+    void add_node( lnode *up, size_t parent, size_t self, size_t depth ) {
+        const size_t node = up_.size();
+        assert( self == node );
+
+        up_.push_back( up );
+        back_base_.push_back( up != 0 ? up->back : 0 );
+        parent_.push_back( parent );
+        depth_.push_back( depth );
+        base_len_.push_back( up != 0 ? up->backLen : 0.0 );
+
+        if( up != 0 ) {
+            lnode_info_[up] = info( node, node );
+        }
+    }
+
+    boost::uint64_t *split( size_t edge ) {
+        return &words_[edge * num_words_];
+    }
+
+    size_t node_of( const lnode *n ) const {
+        return find_info( n ).node;
+    }
+
+    size_t edge_of( const lnode *n ) const {
+        return find_info( n ).edge;
+    }
+
+    const info &find_info( const lnode *n ) const {
+        info_map::const_iterator it = lnode_info_.find( n );
+        if( it == lnode_info_.end() ) {
+            throw std::runtime_error( "spr_split_delta: node is not in the base tree" );
+        }
+        return it->second;
+    }
+
+    void complement( boost::uint64_t *s ) const {
+        for( size_t w = 0; w < num_words_; ++w ) {
+            s[w] = ~s[w];
+        }
+        if( num_taxa_ % 64 != 0 ) {
+            s[num_words_ - 1] &= (boost::uint64_t(1) << (num_taxa_ % 64)) - 1;
+        }
+    }
+
+    // taxon 0 not set
+    void normalise( boost::uint64_t *s ) const {
+        if( num_taxa_ > 0 && (s[0] & 1) != 0 ) {
+            complement( s );
+        }
+    }
+
+    // adds the split (optionally with S toggled) in the normalised orientation
+    void add_entry( const boost::uint64_t *s, bool toggle, bool spr, double len ) {
+        entry e;
+        e.offset = scratch_.size();
+        e.spr = spr;
+        e.len = len;
+
+        scratch_.insert( scratch_.end(), s, s + num_words_ );
+        boost::uint64_t *p = &scratch_[e.offset];
+
+        if( toggle ) {
+            for( size_t w = 0; w < num_words_; ++w ) {
+                p[w] ^= subtree_[w];
+            }
+        }
+        normalise( p );
+        entries_.push_back( e );
+        add_hash( hash_, p, spr ? 1 : -1 );
+    }
+
+    // removes the last n entries
+    void pop_entries( size_t n ) {
+        for( size_t i = 0; i < n; ++i ) {
+            const entry &e = entries_.back();
+            add_hash( hash_, &scratch_[e.offset], e.spr ? -1 : 1 );
+            scratch_.resize( e.offset );
+            entries_.pop_back();
+        }
+    }
+
+    // the entries of a path edge: the split of the base tree, and the same split with S on the other
+    // side in the SPR tree
+    void push_path_entries( size_t edge ) {
+        add_entry( split( edge ), false, false, base_len_[edge] );
+        add_entry( split( edge ), true, true, base_len_[edge] );
+    }
+
+    // the entries of the insertion edge e (u: its end closer to x): the split of the base tree and the
+    // two halves of the SPR tree (the half at u has S on the other side). The lengths of the halves
+    // are taken from the spliced tree.
+    void push_target( size_t e, size_t u ) {
+        lnode *e_u = end_at( e, u );
+        add_entry( split( e ), false, false, base_len_[e] );
+        add_entry( split( e ), true, true, e_u->backLen );
+        add_entry( split( e ), false, true, other_end( e, e_u )->backLen );
+
+        walk_edge_ = e;
+        walk_u_ = u;
+        walk_v_ = u == e ? parent_[e] : e;
+    }
+
+    void pop_target() {
+        pop_entries( 3 );
+        walk_edge_ = npos;
+    }
+
+    bool has_end( size_t edge, size_t node ) const {
+        return edge == node || parent_[edge] == node;
+    }
+
+    // splitmix64 finaliser
+    static boost::uint64_t mix( boost::uint64_t z ) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // adds (sign 1) or removes (sign -1) a normalised split. The two halves use different seeds, so
+    // they are (practically) independent.
+    void add_hash( topology_hash &h, const boost::uint64_t *s, int sign ) const {
+        boost::uint64_t a = 0x9e3779b97f4a7c15ULL;
+        boost::uint64_t b = 0xc2b2ae3d27d4eb4fULL;
+        for( size_t w = 0; w < num_words_; ++w ) {
+            a = mix( a ^ s[w] );
+            b = mix( b + s[w] );
+        }
+
+        if( sign > 0 ) {
+            h.h[0] += a;
+            h.h[1] += b;
+        } else {
+            h.h[0] -= a;
+            h.h[1] -= b;
+        }
+    }
+
+    // the lnode of edge at the end that is not node (in the base tree)
+    lnode *far_end( size_t edge, size_t node ) const {
+        return edge == node ? back_base_[edge] : up_[edge];
+    }
+
+    lnode *other_end( size_t edge, const lnode *n ) const {
+        return up_[edge] == n ? back_base_[edge] : up_[edge];
+    }
+
+    // the lnode of edge at node (in the base tree)
+    lnode *end_at( size_t edge, size_t node ) const {
+        return edge == node ? up_[edge] : back_base_[edge];
+    }
+
+    typedef std::tr1::unordered_map<const lnode *, info> info_map;
+
+    static const size_t npos = size_t(-1);
+
+    const boost::uint64_t max_bytes_;
+    size_t num_taxa_;
+    size_t num_words_;
+
+    info_map lnode_info_;
+    std::vector<lnode *> up_;
+    std::vector<lnode *> back_base_; // up_[i]->back in the base tree
+    std::vector<size_t> parent_;
+    std::vector<size_t> depth_;
+    std::vector<double> base_len_;
+    std::vector<boost::uint64_t> words_;
+    topology_hash base_hash_;
+
+    std::vector<boost::uint64_t> subtree_;
+    std::vector<size_t> path_x_;
+    std::vector<size_t> path_c_;
+    std::vector<entry> entries_;
+    std::vector<boost::uint64_t> scratch_;
+    topology_hash hash_;
+
+    // the position of the last update / move (see move): the pruned subtree, the path edges from x
+    // outwards and the insertion edge with its end closer to x (u) and the other one (v)
+    lnode *walk_prune_;
+    std::vector<size_t> walk_path_;
+    size_t walk_edge_;
+    size_t walk_u_;
+    size_t walk_v_;
+};
+
+#endif
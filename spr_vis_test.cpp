@@ -7,8 +7,28 @@
 #include <memory>
 #include <map>
 #include <boost/tr1/unordered_map.hpp>
+#include <boost/program_options.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include "ivymike/tree_parser.h"
 #include "ivymike/tree_split_utils.h"
+#include "taxon_dict.h"
+#include "trace_reader.h"
+#include "trace_pipeline.h"
+#include "tree_sink.h"
+#include "tree_archive.h"
+#include "newick_emitter.h"
+#include "binary_tree_encoder.h"
+#include "insertion_filter.h"
+#include "run_stats.h"
+#include "trace_index.h"
+#include "placement_aggregator.h"
+#include "rf_distance.h"
+#include "topology_dedup.h"
+#include "async_tree_sink.h"
+#include "trace_batch.h"
+#include "edge_walk.h"
+#include "spr_delta.h"
+#include "spr_walk.h"
 
 using ivy_mike::tree_parser_ms::lnode;
 using ivy_mike::tree_parser_ms::parser;
@@ -16,641 +36,868 @@ using ivy_mike::tree_parser_ms::ln_pool;
 using ivy_mike::tree_parser_ms::prune_with_rollback;
 using ivy_mike::tree_parser_ms::splice_with_rollback;
 
-boost::dynamic_bitset<> tip_list_to_split( const std::vector<std::string> &split, const std::vector<std::string> &sorted_names ) {
- 
-    boost::dynamic_bitset<> bitset(sorted_names.size());
+// how the trees are written (see the command line options)
+struct tree_output_options {
+    bool incremental_newick;
+    bool binary;
+    binary_tree::length_mode binary_lengths;
     
-    for( std::vector< std::string >::const_iterator it = split.begin(); it != split.end(); ++it ) {
-        std::vector< std::string >::const_iterator sit = std::lower_bound(sorted_names.begin(), sorted_names.end(), *it );
+    // the per-insertion lines on stdout
+    bool insertion_lines;
+    
+    // the binary taxon table is written with this tree
+    size_t first_tree;
+    
+    // placement weight tables instead of the trees (and the annotated trees)
+    bool aggregate;
+    bool annotated_tree;
+    
+    // tables of the (weighted) RF distances of the reconstructed trees
+    bool rf;
+    bool weighted_rf;
+    
+    // only write the first reconstructed tree of each topology (per tree)
+    bool dedup;
+    
+    // memory limit (per thread) of the edge splits kept for rf and dedup, in MiB
+    size_t split_memory_mb;
+    
+    // reconstruct the trees of a subtree in the order of a walk over the tree
+    bool edge_walk;
+    
+    // delta files instead of the trees
+    bool delta;
+    
+    tree_output_options() : incremental_newick(false), binary(false), binary_lengths(binary_tree::float_lengths), insertion_lines(true), first_tree(1), aggregate(false), annotated_tree(false), rf(false), weighted_rf(false), dedup(false), split_memory_mb(1024), edge_walk(false), delta(false) {}
+};
+
+// the output of the reconstructed trees: the trees/ files of one thread (see the options)
+struct tree_output : public spr_visitor {
+    // the pruned trees, pruned subtrees and reconstructed SPR trees
+    tree_sink &trees;
+    
+    // incremental newick output (0: plain print_newick)
+    newick_emitter *newick;
+    
+    // binary instead of newick output (0: newick)
+    binary_tree_encoder *binary;
+    
+    // instrumentation (0: off)
+    run_stats *stats;
+    
+    // only aggregate the placement weights of the insertions, no tree reconstruction (0: off, the walk
+    // has to be a placements only walk if set)
+    placement_aggregator *aggregator;
+    
+    // with aggregator: also write the tree annotated with the placement weights
+    bool annotated_tree;
+    
+    // affected splits of the reconstructed trees (0: off, needed by rf and dedup)
+    spr_split_delta *splits;
+    
+    // RF distances of the reconstructed trees to the tree (0: off)
+    spr_rf_calculator *rf;
+    
+    // only write the first reconstructed tree of each topology (0: off)
+    topology_dedup *dedup;
+    
+    // one delta file per tree (the tree plus the moves) instead of the trees (0: off)
+    spr_delta_encoder *delta;
+    
+    // number of the first tree of the run (not 1 for --trees and --shard)
+    size_t first_tree;
+    
+    tree_output( tree_sink &trees_ ) : trees(trees_), newick(0), binary(0), stats(0), aggregator(0), annotated_tree(false), splits(0), rf(0), dedup(0), delta(0), first_tree(1) {}
+    
+    // set up the tree output for a new tree
+    virtual void on_tree( lnode *tree, const taxon_dict &taxa, size_t tree_count, const char_range &text ) {
+        if( delta != 0 ) {
+            // the delta file starts with the text of the tree, so that the decoder parses the same tree
+            phase_timer timer( stats, run_stats::output );
+            delta->reset( tree, text.first, text.last, tree_count );
+        }
         
-        assert( sit != sorted_names.end() );
+        if( newick != 0 ) {
+            // falls back to print_newick for this tree if the emitter cannot reproduce it exactly
+            newick->reset( tree );
+        }
         
+        if( binary != 0 ) {
+            if( tree_count == first_tree ) {
+                // the taxon names of the binary trees are written only once (per range of trees)
+                std::string table;
+                binary_tree_encoder::write_taxon_table( taxa, table );
+                trees.write( tree_key( tree_key::taxon_table, 1, 0 ), table );
+            }
+            binary->reset( tree, taxa );
+        }
         
-//         std::cout << *sit << " " << *it << "\n";
-        assert( *sit == *it );
+        if( aggregator != 0 ) {
+            aggregator->reset( tree );
+        }
         
-        size_t idx = std::distance( sorted_names.begin(), sit );
-        assert( idx < sorted_names.size() );
+        if( splits != 0 ) {
+            phase_timer timer( stats, run_stats::split_delta );
+            splits->reset( tree, taxa );
+            
+            if( rf != 0 ) {
+                rf->reset( *splits );
+            }
+            if( dedup != 0 ) {
+                dedup->reset();
+            }
+        }
+    }
+    
+    virtual void on_subtree( lnode *split_node, const tree_key &key ) {
+        if( aggregator != 0 ) {
+            aggregator->begin_subtree( key.subtree );
+        }
         
-        bitset[idx] = true;
-      
+        if( newick != 0 ) {
+            newick->set_pruned( split_node->back );
+        }
+    }
+    
+    virtual void on_prune( lnode *prune_node, lnode *save_node, const tree_key &key ) {
+        if( delta != 0 ) {
+            // the decoder reconstructs the pruned tree and subtree from the prune
+            delta->add_subtree( key.subtree, prune_node );
+            return;
+        }
+        
+        // write the tree after the current subtree has been pruned
+        
+        lnode *root = ivy_mike::tree_parser_ms::next_non_tip(save_node);
+        assert( root != 0 );
+        write_tree( key, root );
+        
+        // write the pruned subtree (as rooted newick)
+        
+        write_tree( tree_key( tree_key::pruned_subtree, key.tree, key.subtree ), prune_node->back, false );
+    }
+    
+    virtual void on_placement( lnode *insertion_edge, double score, const tree_key &key ) {
+        if( aggregator != 0 ) {
+            aggregator->add( insertion_edge, score );
+        } else if( newick != 0 ) {
+            newick->set_spliced( insertion_edge );
+        }
+    }
+    
+    // --edge-walk: the affected splits follow the subtree along the walk
+    virtual void on_move( lnode *prune_node, lnode *edge, const tree_key &key ) {
+        if( splits != 0 ) {
+            phase_timer timer( stats, run_stats::split_delta );
+            splits->move( prune_node, edge );
+        }
+    }
+    
+    // writes the reconstructed tree (plus its RF distance and the duplicate check). With --delta only
+    // the move is recorded.
+    virtual void on_insertion( lnode *root, lnode *prune_node, lnode *insertion_edge, double score, const tree_key &key ) {
+        if( splits != 0 ) {
+            // incremental if the previous insertion (or edge of the walk) is adjacent
+            phase_timer timer( stats, run_stats::split_delta );
+            splits->move( prune_node, insertion_edge );
+            
+            if( rf != 0 ) {
+                rf->add( key.subtree, key.insertion );
+            }
+            
+            if( dedup != 0 && !dedup->add( splits->hash(), key.subtree, key.insertion ) ) {
+                // same topology as an already written tree (recorded in the dedup table)
+                if( stats != 0 ) {
+                    stats->inc( run_stats::duplicates );
+                }
+                return;
+            }
+        }
+        
+        if( delta != 0 ) {
+            phase_timer timer( stats, run_stats::output );
+            delta->add_insertion( key.insertion, insertion_edge, score );
+            return;
+        }
+        
+        write_tree( key, root );
+    }
+    
+    virtual void on_subtree_end( const tree_key &key ) {
+        if( aggregator != 0 ) {
+            aggregator->end_subtree();
+        }
+    }
+    
+    // the per-tree tables
+    virtual void on_tree_end( size_t tree_count ) {
+        phase_timer timer( stats, run_stats::output );
+        
+        if( aggregator != 0 ) {
+            // the placement weights of all subtrees of the tree
+            write_data( tree_key( tree_key::placement_table, tree_count, 0 ), aggregator->table() );
+            
+            if( annotated_tree ) {
+                write_data( tree_key( tree_key::annotated_tree, tree_count, 0 ), aggregator->annotated_tree() );
+            }
+        }
+        
+        if( rf != 0 ) {
+            write_data( tree_key( tree_key::rf_table, tree_count, 0 ), rf->table() );
+        }
+        
+        if( dedup != 0 ) {
+            write_data( tree_key( tree_key::dedup_table, tree_count, 0 ), dedup->table() );
+        }
+        
+        if( delta != 0 ) {
+            write_data( tree_key( tree_key::delta, tree_count, 0 ), delta->finish() );
+        }
+    }
+    
+    virtual void flush() {
+        trees.flush();
+    }
+    
+    // serialise a tree to a string: print_newick, the same output from the incremental emitter, or the binary encoding
+    void serialise_tree( lnode *node, bool root, std::string &data ) {
+        if( binary != 0 ) {
+            binary->encode( node, root, data );
+        } else if( newick != 0 && newick->enabled() ) {
+            newick->write( node, data, root );
+        } else {
+            std::ostringstream os;
+            ivy_mike::tree_parser_ms::print_newick( node, os, root );
+            data = os.str();
+        }
+    }
+    
+    void write_data( const tree_key &key, const std::string &data ) {
+        trees.write( key, data );
+        
+        if( stats != 0 ) {
+            stats->inc( run_stats::trees_written );
+            stats->inc( run_stats::bytes_written, data.size() );
+        }
+    }
+    
+    void write_tree( const tree_key &key, lnode *node, bool root = true ) {
+        phase_timer timer( stats, run_stats::output );
+        
+        std::string data;
+        serialise_tree( node, root, data );
+        write_data( key, data );
     }
-    return bitset;
-}
-
-class trace_element {
-public:
-    enum trace_type {
-        tree,
-        subtree,
-        insertion,
-        none
-    };
-    
-    virtual trace_type get_type() = 0;
 };
 
-
-class trace_tree : public trace_element {
+// appends the buffered trees of one block to the shared sink (in trace order)
+class tree_sink_commit : public ordered_commit {
 public:
+    tree_sink_commit( tree_sink &target ) : target_(target) {}
     
-    trace_tree( lnode *t ) : tree_(t) {}
-    
-    virtual trace_type get_type() {
-        return tree;
+    virtual void commit() {
+        buffer_.flush_to( target_ );
     }
     
-    lnode *get_tree() {
-        return tree_;
+    buffered_tree_sink &buffer() {
+        return buffer_;
     }
-    
+
 private:
-    lnode *tree_;
+    tree_sink &target_;
+    buffered_tree_sink buffer_;
 };
 
-class trace_subtree : public trace_element {
+// a worker of the trace pipeline or of a batch run. Each one has its own node pool and taxon
+// dictionary (or uses the shared dictionaries of the batch).
+class tree_processor : public tree_block_processor, public batch_block_processor {
 public:
-    template<typename iiter>
-    trace_subtree( iiter first, iiter last ) : tip_list_(first, last) {
-        std::sort( tip_list_.begin(), tip_list_.end() );
+    // if ordered is set, the trees are written to sink in trace order (e.g., for the archive). Otherwise
+    // they are written directly from the worker thread (sink must be thread safe). In a batch run sink
+    // is 0, the trees go to the sink of the trace of each block.
+    // collector: instrumentation (0: off). parser_check: the self-check of scan_tree_parser shared by all
+    // workers (0: the ivy_mike parser). use_arena: parse the trees into a tree_arena instead of the ln_pool.
+    // taxa: the shared taxon dictionaries of a batch run (0: a private dictionary).
+    tree_processor( tree_sink *sink, bool ordered, const tree_output_options &output, const insertion_filter_options &filter, stats_collector *collector, tree_parser_check *parser_check, bool use_arena, taxon_dict_cache *taxa = 0 )
+      : taxa_(taxa), binary_(output.binary_lengths), filter_(filter), aggregator_(filter.lower_is_better), splits_( boost::uint64_t(output.split_memory_mb) << 20 ), rf_(output.weighted_rf), sink_(sink), ordered_(ordered), output_(output), collector_(collector), parser_check_(parser_check), use_arena_(use_arena) {}
+    
+    virtual void process( const tree_block &block, std::ostream &out ) {
+        assert( sink_ != 0 );
+        process( block, *sink_, out );
     }
     
-    virtual trace_type get_type() {
-        return subtree;
+    virtual void process( const tree_block &block, tree_sink &trees, std::ostream &out ) {
+        trace_reader tr( new block_line_source( block ), &pool_ );
+
+        
+        if( use_arena_ ) {
+            tr.set_arena( &arena_, parser_check_ );
+        } else {
+            tr.set_parser_check( parser_check_ );
+        }
+        
+        if( ordered_ ) {
+            commit_.reset( new tree_sink_commit( trees ) );
+        }
+        tree_output visitor( ordered_ ? commit_->buffer() : trees );
+        visitor.newick = output_.incremental_newick ? &newick_ : 0;
+        visitor.binary = output_.binary ? &binary_ : 0;
+        visitor.stats = collector_ != 0 ? &stats_ : 0;
+        visitor.first_tree = output_.first_tree;
+        visitor.aggregator = output_.aggregate ? &aggregator_ : 0;
+        visitor.annotated_tree = output_.annotated_tree;
+        visitor.splits = output_.rf || output_.dedup ? &splits_ : 0;
+        visitor.rf = output_.rf ? &rf_ : 0;
+        visitor.dedup = output_.dedup ? &dedup_ : 0;
+        visitor.delta = output_.delta ? &delta_ : 0;
+        
+        walk_context ctx( out, visitor, records_ );
+        ctx.filter = filter_.active() ? &filter_ : 0;
+        ctx.stats = visitor.stats;
+        ctx.insertion_lines = output_.insertion_lines;
+        ctx.placements_only = output_.aggregate;
+        ctx.edge_order = output_.edge_walk ? &edge_order_ : 0;
+        
+        trace_element::trace_type next_type = tr.next();
+        assert( next_type == trace_element::tree );
+        
+        next_type = process_tree( tr, pool_, taxa_, block.tree_number, ctx );
+        assert( next_type == trace_element::none );
+        
+        if( collector_ != 0 ) {
+            collector_->add( stats_ );
+        }
     }
     
-    const std::vector<std::string> &get_tip_list() {
-        return tip_list_;
+    virtual boost::shared_ptr<ordered_commit> take_commit() {
+        boost::shared_ptr<ordered_commit> c = commit_;
+        commit_.reset();
+        return c;
     }
-    
+
 private:
-    std::vector<std::string> tip_list_;
+    ln_pool pool_;
+    tree_arena arena_;
+    walk_taxa taxa_;
+    trace_record_batch records_;
+    
+    newick_emitter newick_;
+    binary_tree_encoder binary_;
+    insertion_filter filter_;
+    placement_aggregator aggregator_;
+    spr_split_delta splits_;
+    spr_rf_calculator rf_;
+    topology_dedup dedup_;
+    spr_edge_order edge_order_;
+    spr_delta_encoder delta_;
+    
+    tree_sink *sink_;
+    const bool ordered_;
+    const tree_output_options output_;
+    boost::shared_ptr<tree_sink_commit> commit_;
+    
+    stats_collector *collector_;
+    run_stats stats_;
+    
+    tree_parser_check *parser_check_;
+    const bool use_arena_;
 };
 
-class trace_insertion : public trace_element {
-public:
-    template<typename iiter>
-    trace_insertion( iiter first, iiter last, double score ) : split_(first, last), score_(score) {
-        std::sort( split_.begin(), split_.end() );
+// --rf, --weighted-rf and --dedup keep the splits of all edges of a tree (see spr_split_delta).
+// Checked against --split-memory on the first tree (the taxon set does not change), before any
+// output is written.
+static bool check_split_memory( const char_range &tree_line, const tree_output_options &output ) {
+    if( !output.rf && !output.dedup ) {
+        return true;
     }
     
-    virtual trace_type get_type() {
-        return insertion;
+    const size_t num_taxa = std::count( tree_line.first, tree_line.last, ',' ) + 1;
+    const boost::uint64_t bytes = spr_split_delta::memory_bytes( num_taxa );
+    
+    if( bytes > boost::uint64_t(output.split_memory_mb) << 20 ) {
+        std::cerr << "--rf, --weighted-rf and --dedup need " << (bytes >> 20) << " MiB per thread for the splits of the first tree (" << num_taxa << " taxa), more than --split-memory " << output.split_memory_mb << " MiB\n";
+        return false;
+    }
+    return true;
+}
+
+// the JSON run summary of --stats
+static void write_stats( stats_collector &collector, const std::string &name ) {
+    if( name.empty() ) {
+        return;
     }
     
-    const std::vector<std::string> &get_split() {
-        return split_;
+    if( name == "-" ) {
+        collector.write_json( std::cerr );
+        return;
     }
     
-    double get_score() const {
-        return score_;
+    std::ofstream os( name.c_str() );
+    if( !os.good() ) {
+        throw std::runtime_error( "cannot open stats file: " + name );
+    }
+    collector.write_json( os );
+}
+
+// the tree sinks of the traces of a batch run: one file per tree or an archive per trace
+class batch_tree_sinks : public batch_sink_factory {
+public:
+    batch_tree_sinks( bool archive, boost::uint64_t segment_size ) : archive_(archive), segment_size_(segment_size) {}
+    
+    virtual tree_sink *open( const std::string &dir ) {
+        if( archive_ ) {
+            return new tree_archive_writer( dir, segment_size_ );
+        } else {
+            return new file_tree_sink( dir );
+        }
     }
     
 private:
-    std::vector<std::string> split_;
-    const double score_;
+    const bool archive_;
+    const boost::uint64_t segment_size_;
 };
 
-// template<typename T>
-// std::unique_ptr<T> make_uniqueptr( T *p ) {
-//     return std::unique_ptr<T>(p);
-// }
-class trace_reader {
-public:
-    trace_reader( const char *filename, ln_pool *pool ) : pool_(pool), element_type_(trace_element::none), line_count_(0) {
-        is_.open( filename );
+// --batch: the traces of the list on one pool of num_threads workers (see batch_scheduler). The
+// output of trace n goes to <dir>/<n>, <dir>/traces lists the traces with their numbers.
+static int run_batch( const std::string &list_name, const std::string &dir, size_t num_threads, const tree_output_options &output, const insertion_filter_options &filter, bool archive, boost::uint64_t segment_size, const std::string &stats_name, double progress_interval, bool use_arena ) {
+    const std::vector<std::string> traces = read_trace_list( list_name );
+    
+    if( traces.empty() ) {
+        std::cerr << "no traces in the trace list: " << list_name << "\n";
+        return 1;
+    }
+    
+    make_dir( dir );
+    {
+        const std::string index_name = dir + "/traces";
+        std::ofstream os( index_name.c_str() );
+        
+        for( size_t i = 0; i < traces.size(); ++i ) {
+            os << (i + 1) << "\t" << traces[i] << "\n";
+        }
         
-        assert( is_.good() );
+        if( !os.good() ) {
+            throw std::runtime_error( "cannot write the trace list: " + index_name );
+        }
     }
     
-//     ~trace_reader() {
-//      
-//     }
+    const bool instrument = !stats_name.empty() || progress_interval > 0;
+    stats_collector collector( std::cerr, progress_interval );
     
+    // the traces of a batch usually share the taxon set, so all workers use the same dictionaries
+    taxon_dict_cache taxa;
+    tree_parser_check parser_check;
+    batch_tree_sinks sinks( archive, segment_size );
     
-    void dump_position() {
-        std::cerr << "trace reader lines: " << line_count_ << "\n";
-        std::cerr << line_ << "\n";   
+    boost::ptr_vector<tree_processor> workers;
+    std::vector<batch_block_processor *> processors;
+    for( size_t i = 0; i < num_threads; ++i ) {
+        workers.push_back( new tree_processor( 0, archive, output, filter, instrument ? &collector : 0, &parser_check, use_arena, &taxa ) );
+        processors.push_back( &workers.back() );
     }
     
-    trace_element::trace_type next() {
-        while( true ) {
-            if( is_.eof() ) {
-                element_type_ = trace_element::none;
-                
-                return element_type_;
-            
-            }
-            
-            
-         
-            std::getline(is_, line_);
-            ++line_count_;
-            std::stringstream ss(line_);
-            std::string token;
+    batch_scheduler scheduler( traces, dir, sinks, 2 * num_threads, 4 * num_threads );
+    if( instrument ) {
+        scheduler.set_stats( &collector );
+    }
+    const size_t failed = scheduler.run( processors );
+    
+    if( instrument ) {
+        write_stats( collector, stats_name );
+    }
+    
+    if( failed != 0 ) {
+        std::cerr << failed << " of " << traces.size() << " traces failed (see " << dir << "/<n>/error)\n";
+        return 1;
+    }
+    return 0;
+}
 
-            ss >> token;
-            
-//             std::cout << "token: " << token << "\n";
-            
-            if( token == "@tree" || token == "@tree:" ) {
-                element_type_ = trace_element::tree;
-            } else if( token == "@subtree" ) {
-                element_type_ = trace_element::subtree;
-            } else if( token == "@insertion" ) {
-                element_type_ = trace_element::insertion;
-            } else {
-                continue; // ignore anything else
-            }
-            
-            return element_type_;
-              
-            
-            
-        }
+int main( int argc, char *argv[] ) {
+    namespace po = boost::program_options;
+    
+    size_t num_threads = 1;
+    size_t writer_threads = 0;
+    size_t segment_size_mb = 1024;
+    size_t split_memory_mb = 1024;
+    std::string binary_lengths;
+    insertion_filter_options filter;
+    std::string trace_name;
+    std::string stats_name;
+    double progress_interval = 0;
+    std::string tree_range;
+    std::string shard;
+    double follow_poll = 0.2;
+    double follow_timeout = 0;
+    std::string batch_name;
+    std::string batch_dir;
+    
+    po::options_description desc( "options" );
+    desc.add_options()
+        ( "help,h", "show help" )
+        ( "threads,t", po::value<size_t>( &num_threads )->default_value( 1 ), "number of worker threads (the trees of the trace are processed in parallel)" )
+        ( "archive,a", "write the trees into a few large segment files plus index (trees/trees.idx) instead of one file per tree" )
+        ( "segment-size", po::value<size_t>( &segment_size_mb )->default_value( 1024 ), "size of the archive segment files in MiB" )
+        ( "writer-threads", po::value<size_t>( &writer_threads )->default_value( 0 ), "number of threads writing the trees in the background (0: the trees are written synchronously by the compute threads; the archive uses at most one writer)" )
+        ( "incremental-newick", "only re-serialise the parts of the tree changed by prune/splice (same output as the default, faster on large trees)" )
+        ( "binary,b", "write the trees in the compact binary format instead of newick (see tree_binary_decode)" )
+        ( "binary-lengths", po::value<std::string>( &binary_lengths )->default_value( "float" ), "branch lengths in the binary format: none, float or double" )
+        ( "top-k", po::value<size_t>( &filter.top_k ), "only reconstruct the k best insertions of each subtree" )
+        ( "score-delta", po::value<double>( &filter.delta ), "only reconstruct the insertions within this distance of the best score of the subtree" )
+        ( "min-score", po::value<double>( &filter.threshold ), "only reconstruct the insertions with at least this score" )
+        ( "lower-is-better", "lower insertion scores are better (for --top-k, --score-delta, --min-score and --aggregate)" )
+        ( "aggregate", "only compute the placement weights (lwr, best edge, entropy) of the subtrees over the edges of the tree, without reconstructing any trees (trees/w.<tree>)" )
+        ( "rf", "write the Robinson-Foulds distance of every reconstructed tree to its tree (trees/r.<tree>)" )
+        ( "weighted-rf", "like --rf, plus the weighted RF distance (sum of the branch length differences)" )
+        ( "split-memory", po::value<size_t>( &split_memory_mb )->default_value( 1024 ), "memory limit per thread in MiB for the splits of all edges of a tree that --rf, --weighted-rf and --dedup keep (about n^2 / 4 bytes for n taxa)" )
+        ( "dedup", "only write the first reconstructed tree of each topology per tree (by the branch lengths of that tree), the later ones are listed in trees/d.<tree>" )
+        ( "edge-walk", "reconstruct the trees of a subtree in the DFS order of their insertion edges, moving the subtree from edge to adjacent edge (same trees; in the archive, the delta files and the tables of --rf and --dedup they are in walk order, the splits of --rf and --dedup are updated along the walk)" )
+        ( "delta", "write one delta file per tree (trees/m.<tree>: the tree plus one move record per subtree and insertion) instead of the trees. spr_delta_decode reconstructs the trees" )
+        ( "aggregate-tree", "with --aggregate: also write the tree annotated with the edge numbers and summed placement weights (trees/z.<tree>)" )
+        ( "stats", po::value<std::string>( &stats_name ), "write per-phase times and counters as JSON to this file at the end of the run (- for stderr)" )
+        ( "progress", po::value<double>( &progress_interval ), "write a progress line to stderr every this many seconds" )
+        ( "no-insertion-lines", "do not write the per-insertion lines to stdout" )
+        ( "arena", "parse the trees into a region allocator that is released in O(1) per tree instead of the ln_pool mark-and-sweep (the node serial numbers on stdout differ)" )
+        ( "trees", po::value<std::string>( &tree_range ), "only process the trees a-b of the trace (1-based, inclusive; a- for all trees from a). The numbering stays the one of the whole trace" )
+        ( "shard", po::value<std::string>( &shard ), "only process shard i/n of the trace (i in 1..n, balanced by the number of records)" )
+        ( "build-index", "only (re-)build the trace index sidecar (<trace>.tidx) used by --trees and --shard" )
+        ( "follow,f", "follow a trace that is still being written (a growing file or a pipe, - for stdin): every subtree block is processed as soon as it is complete and the output is flushed after it" )
+        ( "follow-poll", po::value<double>( &follow_poll )->default_value( 0.2 ), "with --follow: seconds between the checks for new data at the end of a growing file" )
+        ( "follow-timeout", po::value<double>( &follow_timeout )->default_value( 0 ), "with --follow: end of the trace after this many seconds without new data (0: wait forever, a pipe ends when it is closed)" )
+        ( "batch", po::value<std::string>( &batch_name ), "process all traces of this list (one file per line, - for stdin) on one pool of --threads workers. The output of the n-th trace goes to <batch-dir>/<n>/out and <batch-dir>/<n>/trees (written by the workers, without --writer-threads)" )
+        ( "batch-dir", po::value<std::string>( &batch_dir )->default_value( "batch" ), "with --batch: the directory of the per-trace outputs (created if needed)" )
+        ( "trace", po::value<std::string>( &trace_name ), "trace file (- for stdin)" );
+    
+    po::positional_options_description pos;
+    pos.add( "trace", 1 );
+    
+    po::variables_map vm;
+    po::store( po::command_line_parser( argc, argv ).options( desc ).positional( pos ).run(), vm );
+    po::notify( vm );
+    
+    if( vm.count( "help" ) || (trace_name.empty() && batch_name.empty()) ) {
+        std::cerr << "usage: " << argv[0] << " [options] <trace>\n       " << argv[0] << " [options] --batch <trace list>\n" << desc << "\n";
+        return vm.count( "help" ) ? 0 : 1;
+    }
+    
+    filter.use_delta = vm.count( "score-delta" ) != 0;
+    filter.use_threshold = vm.count( "min-score" ) != 0;
+    filter.lower_is_better = vm.count( "lower-is-better" ) != 0;
+    
+    // format of the trees: newick (plain or incremental) or binary
+    tree_output_options output;
+    output.incremental_newick = vm.count( "incremental-newick" ) != 0;
+    output.binary = vm.count( "binary" ) != 0;
+    output.insertion_lines = vm.count( "no-insertion-lines" ) == 0;
+    output.aggregate = vm.count( "aggregate" ) != 0;
+    output.annotated_tree = vm.count( "aggregate-tree" ) != 0;
+    
+    output.weighted_rf = vm.count( "weighted-rf" ) != 0;
+    output.rf = vm.count( "rf" ) != 0 || output.weighted_rf;
+    
+    output.dedup = vm.count( "dedup" ) != 0;
+    output.split_memory_mb = split_memory_mb;
+    output.edge_walk = vm.count( "edge-walk" ) != 0;
+    output.delta = vm.count( "delta" ) != 0;
+    
+    if( (output.rf || output.dedup || output.edge_walk || output.delta) && output.aggregate ) {
+        std::cerr << "--rf, --weighted-rf, --dedup, --edge-walk and --delta need the reconstructed trees (not possible with --aggregate)\n";
+        return 1;
     }
     
+    if( output.delta && (output.binary || output.incremental_newick) ) {
+        std::cerr << "--delta replaces the tree output, it cannot be combined with --binary or --incremental-newick\n";
+        return 1;
+    }
     
-    trace_tree get_tree() {
-        if( element_type_ != trace_element::tree ) {
-            throw std::runtime_error( "element_type_ != trace_element::tree" );
+    if( output.annotated_tree && !output.aggregate ) {
+        std::cerr << "--aggregate-tree needs --aggregate\n";
+        return 1;
+    }
+    
+    if( output.aggregate && filter.active() ) {
+        // the weights are normalised over all insertions of a subtree
+        std::cerr << "--aggregate cannot be combined with --top-k, --score-delta or --min-score\n";
+        return 1;
+    }
+    
+    if( binary_lengths == "none" ) {
+        output.binary_lengths = binary_tree::no_lengths;
+    } else if( binary_lengths == "float" ) {
+        output.binary_lengths = binary_tree::float_lengths;
+    } else if( binary_lengths == "double" ) {
+        output.binary_lengths = binary_tree::double_lengths;
+    } else {
+        std::cerr << "bad value for --binary-lengths: " << binary_lengths << "\n";
+        return 1;
+    }
+    
+    if( !batch_name.empty() ) {
+        if( !trace_name.empty() || !tree_range.empty() || !shard.empty() || vm.count( "follow" ) || vm.count( "build-index" ) ) {
+            std::cerr << "--batch cannot be combined with a trace, --trees, --shard, --follow or --build-index\n";
+            return 1;
         }
         
-        std::string::iterator first = std::find( line_.begin(), line_.end(), '(' );
-        assert( first != line_.end() );
-        
-        parser p( first, line_.end(), *pool_ );
-                
-        lnode *t = p.parse();
-            
-        return trace_tree(t);
+        if( num_threads == 0 ) {
+            std::cerr << "--batch needs at least one thread\n";
+            return 1;
+        }
         
+        return run_batch( batch_name, batch_dir, num_threads, output, filter, vm.count( "archive" ) != 0, boost::uint64_t(segment_size_mb) * 1024 * 1024, stats_name, progress_interval, vm.count( "arena" ) != 0 );
     }
     
-    trace_subtree get_subtree() {
-        if( element_type_ != trace_element::subtree ) {
-            throw std::runtime_error( "element_type_ != trace_element::subtree" );
+    // range of trees: the whole trace, or a part of it that is found through the trace index
+    size_t first_tree = 1;
+    size_t last_tree = 0;
+    const bool ranged = !tree_range.empty() || !shard.empty();
+    trace_index index;
     
-        }
+    // the trace index holds offsets into the trace file, so it needs the plain file (no stdin, pipe
+    // or compressed trace)
+    const bool indexable = is_regular_file( trace_name.c_str() ) && detect_compression( trace_name.c_str() ) == no_compression;
     
-        std::string::iterator first = std::find( line_.begin(), line_.end(), '(' );
-        assert( first != line_.end() );
-        ++first;
-        
-        std::string::iterator last = std::find( line_.begin(), line_.end(), ')' );
-        assert( last != line_.end() );
-        
-        // that's a bit clumsy:
-        std::string tmp( first, last );
-//         std::cout << "tmp: " << tmp << "\n";
-        
-        std::stringstream ss(tmp);
-        
-        std::istream_iterator<std::string> sfirst(ss);
-        std::istream_iterator<std::string> slast; 
-        return trace_subtree( sfirst, slast );
+    if( (ranged || vm.count( "build-index" )) && !indexable ) {
+        std::cerr << (ranged ? "--trees/--shard need" : "--build-index needs") << " an uncompressed trace file, not stdin, a pipe or a compressed trace: " << trace_name << "\n";
+        return 1;
     }
     
-    trace_insertion get_insertion() {
-        if( element_type_ != trace_element::insertion ) {
-            throw std::runtime_error( "element_type_ != trace_element::insertion" );
+    if( vm.count( "build-index" ) ) {
+        index.build( trace_name );
+        index.save( trace_name );
+        std::cerr << "indexed " << index.num_trees() << " trees: " << trace_index::sidecar_name( trace_name ) << "\n";
+        return 0;
+    }
     
+    if( ranged ) {
+        if( !tree_range.empty() && !shard.empty() ) {
+            std::cerr << "--trees and --shard are mutually exclusive\n";
+            return 1;
         }
         
-        double score = 1/0.0;
-        {
-            std::stringstream ss( line_ );
-            std::string tmp;
-            ss >> tmp;
-            assert( tmp == "@insertion" );
-            ss >> tmp;
-            assert( !tmp.empty() );
-            
-            score = atof( tmp.c_str() );
+        index.open( trace_name );
+        
+        if( !shard.empty() ) {
+            unsigned long i = 0;
+            unsigned long n = 0;
+            char tail;
+            if( sscanf( shard.c_str(), "%lu/%lu%c", &i, &n, &tail ) != 2 || i < 1 || i > n ) {
+                std::cerr << "bad value for --shard (expected i/n with 1 <= i <= n): " << shard << "\n";
+                return 1;
+            }
+            index.shard( i, n, first_tree, last_tree );
+        } else {
+            unsigned long a = 0;
+            unsigned long b = 0;
+            char tail;
+            const int fields = sscanf( tree_range.c_str(), "%lu-%lu%c", &a, &b, &tail );
+            
+            if( fields == 1 && tree_range[tree_range.size() - 1] == '-' ) {
+                b = index.num_trees();
+            } else if( fields != 2 ) {
+                a = 0;
+            }
             
+            if( a < 1 || a > b ) {
+                std::cerr << "bad value for --trees (expected a-b or a- with 1 <= a <= b): " << tree_range << "\n";
+                return 1;
+            }
+            first_tree = a;
+            last_tree = std::min( size_t(b), index.num_trees() );
         }
-        // now extract the tip list between the ( )
-        // that's all a bit clumsy...
-        
-        std::string::iterator first = std::find( line_.begin(), line_.end(), '(' );
-        assert( first != line_.end() );
-        ++first;
-        
-        std::string::iterator last = std::find( line_.begin(), line_.end(), ')' );
-        assert( last != line_.end() );
         
-      
-        std::string tmp( first, last );
-//         std::cout << "tmp: " << tmp << "\n";
-        
-        std::stringstream ss(tmp);
-        
-        std::istream_iterator<std::string> sfirst(ss);
-        std::istream_iterator<std::string> slast; 
-        return trace_insertion( sfirst, slast, score );
-
+        if( first_tree > last_tree ) {
+            // nothing to do (e.g., more shards than trees)
+            return 0;
+        }
     }
+    output.first_tree = first_tree;
     
+    const bool follow = vm.count( "follow" ) != 0;
     
-private:
-    std::ifstream is_;
-    ln_pool * const pool_; // this is a non owning shared ptr! Switch to shared_ptr at some point!
+#ifdef WIN32
+    if( follow ) {
+        // follow_line_source polls a POSIX file descriptor
+        std::cerr << "--follow is not supported on Windows\n";
+        return 1;
+    }
+#endif
     
-    std::string line_;
-    trace_element::trace_type element_type_;
+    if( follow && (ranged || num_threads > 1) ) {
+        // the trace index and the tree blocks of the pipeline need the complete trees
+        std::cerr << "--follow cannot be combined with --trees, --shard or --threads\n";
+        return 1;
+    }
     
-    size_t line_count_;
-};
-
-
-int main( int argc, char *argv[] ) {
-    assert( argc == 2 );
- 
-    const char *trace_name = argv[1];
-    ln_pool pool;
+    if( follow && (follow_poll <= 0 || follow_timeout < 0) ) {
+        std::cerr << "bad value for --follow-poll or --follow-timeout\n";
+        return 1;
+    }
     
-    trace_reader tr( trace_name, &pool );
+    // output of the trees: the traditional one-file-per-tree layout or the packed archive
+    const bool archive = vm.count( "archive" ) != 0;
+    boost::scoped_ptr<tree_sink> tree_files;
     
+    if( archive ) {
+        tree_files.reset( new tree_archive_writer( "trees", boost::uint64_t(segment_size_mb) * 1024 * 1024 ) );
+    } else {
+        tree_files.reset( new file_tree_sink( "trees" ) );
+    }
     
-    trace_element::trace_type next_type;
-    while( true ) { 
-            
-        next_type = tr.next();
-        
-        if( next_type == trace_element::none ) {
-            throw std::runtime_error( "end of trace while looking for first tree\n" );
-        } else if( next_type == trace_element::tree ) {
-            break;
-        }
+    // --writer-threads: the compute threads hand the trees to the writer threads in batches. The
+    // archive is written in trace order, so it only gets one writer.
+    boost::scoped_ptr<async_tree_sink> async_trees;
+    tree_sink *trees = tree_files.get();
+    
+    if( writer_threads > 0 ) {
+        async_trees.reset( new async_tree_sink( *tree_files, archive ? 1 : writer_threads ) );
+        trees = async_trees.get();
     }
-    size_t tree_count = 0;
-    bool do_exit = false;
     
-    // in the following code there are three levels of nested loops
-    // level 1: trees, level2: subtrees, level3: insertion positions
-    while( next_type == trace_element::tree ) {
-        
-        
-        // read current tree
-        lnode *tree = 0;
-        
-        
-                
-        trace_tree t = tr.get_tree();
-        
-        
-        ++tree_count;
-        
-        std::cout << tree_count << " tree\n";
-        
-        
-        
-        pool.clear();
-        pool.mark(t.get_tree());
-        pool.sweep();
-        
-
-        tree = t.get_tree();
-        
-        
-        
-//         {
-//             std::ofstream os ( "cur_tree" );
-//             ivy_mike::tree_parser_ms::print_newick( tree, os );
-//         }
-     
-        assert( tree != 0 );
-        //getchar();
-        
-        std::vector<lnode *> sorted_tips;
-        
-        typedef std::tr1::unordered_map<boost::dynamic_bitset<>, lnode*, ivy_mike::bitset_hash > split_to_node_map;
-        split_to_node_map split_to_node;
+    // instrumentation: the threads collect into their own run_stats and merge them after every tree
+    const bool instrument = !stats_name.empty() || progress_interval > 0;
+    const bool use_arena = vm.count( "arena" ) != 0;
+    tree_parser_check parser_check;
+    stats_collector collector( std::cerr, progress_interval );
+    
+    if( num_threads > 1 ) {
+        // one reader stage (this thread) and num_threads workers. The stdout output is re-ordered
+        // by the pipeline, so it is identical to the serial run.
+        tree_block_reader reader( ranged ? open_tree_range( trace_name, index, first_tree, last_tree ) : open_line_source( trace_name.c_str() ), first_tree );
         
-        {
-            std::vector<lnode* > nodes;
-            std::vector<boost::dynamic_bitset<> > splits;
-            
-            
-            // get the lists of splits and correponding edges and put them into split_to_edge map
-            ivy_mike::get_all_splits_by_node( tree, nodes, splits, sorted_tips );
-            
-            std::cout << "size: " << nodes.size() << "\n";
-            
-            for( size_t i = 0; i < splits.size(); ++i ) {
-                split_to_node.insert( std::make_pair( splits.at(i), nodes.at(i) ) ); // TODO: change this to emplace and move semantics
-            }
+        run_stats reader_stats;
+        if( instrument ) {
+            reader.set_stats( &reader_stats );
         }
-        std::vector<std::string> sorted_names;
-        for( std::vector< ivy_mike::tree_parser_ms::lnode* >::const_iterator it = sorted_tips.begin(); it != sorted_tips.end(); ++it ) {
-            sorted_names.push_back((*it)->m_data->tipName);
+        
+        boost::ptr_vector<tree_processor> workers;
+        std::vector<tree_block_processor *> processors;
+        for( size_t i = 0; i < num_threads; ++i ) {
+            workers.push_back( new tree_processor( trees, archive, output, filter, instrument ? &collector : 0, &parser_check, use_arena ) );
+            processors.push_back( &workers.back() );
         }
         
+        char_range first_tree_line;
+        if( reader.peek_tree( first_tree_line ) && !check_split_memory( first_tree_line, output ) ) {
+            return 1;
+        }
         
-        // consume next subtree specifier, if there is one
+        trace_pipeline pipeline( reader, std::cout, 4 * num_threads );
+        pipeline.run( processors );
         
-        next_type = tr.next();
-        
-        if( next_type == trace_element::insertion ) {
-            throw std::runtime_error( "unexcpected trace element while looking for subtree: insertion" );
+        if( async_trees ) {
+            async_trees->close();
         }
         
-        size_t subtree_count = 0;
-    
-        
-        // level 2: subtrees
-        while( next_type == trace_element::subtree ) { 
-            trace_subtree st = tr.get_subtree();
-            
-            ++subtree_count;
-            
-            std::cout << tree_count << "." << subtree_count << " subtree: " << st.get_tip_list().size() << "\n";
-            
-            boost::dynamic_bitset<> split = tip_list_to_split( st.get_tip_list(), sorted_names );
-            
-            //split.flip();
-            
-            split_to_node_map::iterator it = split_to_node.find( split );
-            
-            //             if( it == split_to_edge.end() ) {
-                //                 split.flip();
-            //                 it = split_to_edge.find( split );
-            //             }
-            
-            assert( it != split_to_node.end() );
-            
-            std::cout << "split " << split.count() << " " << it->first.count() << "\n";
-            std::cout << "node: " << *(it->second->m_data) << "\n";
-            
-            lnode *prune_node = it->second->back;
-            
-            
-            // this will remove 'prune_node' from the rest of the tree.
-            // REMARK: using the 'transactional' property of prune_with_rollback. When prune goes out of scope
-            // at the end of this block, the prune will rollback automatically. 
-            prune_with_rollback prune(prune_node);
-            
-            assert( prune_node->next->back == 0 && prune_node->next->next->back == 0 ); // prune postcondition
-            {
-                // write the tree after the current subtree has been pruned
-                
-                std::stringstream ss;
-                ss << "trees/x." << tree_count << "." << subtree_count;
-                
-                std::ofstream os( ss.str().c_str() );
-                
-                lnode *root = ivy_mike::tree_parser_ms::next_non_tip(prune.get_save_node());
-                assert( root != 0 );
-                ivy_mike::tree_parser_ms::print_newick( root, os );
-            }
-            {
-                // write the pruned subtree (as rooted newick)
-                
-                std::stringstream ss;
-                ss << "trees/y." << tree_count << "." << subtree_count;
-                
-                std::ofstream os( ss.str().c_str() );
-                
-                lnode *root = ivy_mike::tree_parser_ms::next_non_tip(prune.get_save_node());
-                assert( root != 0 );
-                ivy_mike::tree_parser_ms::print_newick( prune_node->back, os, false );
-            }
-            
-            //assert( prune_node->back == 0 );
-            
-            
-            // consume next insertion positions if there is at least one
-            next_type = tr.next();
-            
-            size_t insertion_count = 0;
-            
-            // level 3: insertions
-            while( next_type == trace_element::insertion ) {
-                
-                
-                trace_insertion pos = tr.get_insertion();
-                
-                ++insertion_count;
-                
-                boost::dynamic_bitset<> split = tip_list_to_split( pos.get_split(), sorted_names );
-                
-                //             split.flip();
-                
-                split_to_node_map::iterator it = split_to_node.find( split );
-                
-                //             if( it == split_to_edge.end() ) {
-                    //                 split.flip();
-                //                 it = split_to_edge.find( split );
-                //             }
-                
-                if( it == split_to_node.end() ) {
-                    {
-                        std::ofstream os ( "error_tree" );
-                        ivy_mike::tree_parser_ms::print_newick( tree, os );
-                    }
-                    tr.dump_position();
-                    throw std::runtime_error( "split not found" );
-                }
-                
-                std::cout << tree_count << "." << subtree_count << "." << insertion_count << " insertion:  " << *(it->second->m_data) << " " << pos.get_score() << "\n";
-                
-                lnode *insertion_edge = it->second;
-                
-                // splice the pruned node into the new insertion position.
-                // REMARK: using the 'transactional' property of splice_with_rollback. When splice goes out of scope
-                // at the end of this block, the splicing will rollback automatically. 
-                
-                assert( prune_node->next->back == 0 && prune_node->next->next->back == 0 ); // check splice precondition (which is also the 'post splice-rollback' postcondition...)
-                splice_with_rollback splice(insertion_edge, prune_node );
-                
-                // write the reconstructed tree
-                {
-                    std::stringstream ss;
-                    ss << "trees/" << tree_count << "." << subtree_count << "." << insertion_count;
-                    
-                    std::ofstream os( ss.str().c_str() );
-                    
-                    lnode *root = ivy_mike::tree_parser_ms::next_non_tip(insertion_edge);
-                    assert( root != 0 );
-                    ivy_mike::tree_parser_ms::print_newick( root, os );
-                } // splice rollback happens here
-                
-                
-                next_type = tr.next();
-            } // prune rollback happens here
+        if( instrument ) {
+            collector.add( reader_stats );
+            write_stats( collector, stats_name );
         }
+        return 0;
     }
     
-    return 0;
-}
-
-
-#if 0
-
-int main3( int argc, char *argv[] ) {
-    assert( argc == 2 );
- 
-    const char *trace_name = argv[1];
     ln_pool pool;
     
-    trace_reader tr( trace_name, &pool );
+    line_source *source;
+#ifndef WIN32
+    if( follow ) {
+        source = new follow_line_source( trace_name.c_str(), follow_poll, follow_timeout );
+    } else
+#endif
+    if( ranged ) {
+        source = open_tree_range( trace_name, index, first_tree, last_tree );
+    } else {
+        source = open_line_source( trace_name.c_str() );
+    }
+    trace_reader tr( source, &pool );
+    
+    run_stats stats;
+    if( instrument ) {
+        tr.set_stats( &stats );
+    }
+    
+    tree_arena arena;
+    if( use_arena ) {
+        tr.set_arena( &arena, &parser_check );
+    } else {
+        tr.set_parser_check( &parser_check );
+    }
     
+    
+    trace_element::trace_type next_type;
     while( true ) { 
-            
-        trace_element::trace_type t = tr.next();
         
-        if( t == trace_element::none ) {
+        next_type = tr.next();
+        
+        if( next_type == trace_element::none ) {
             throw std::runtime_error( "end of trace while looking for first tree\n" );
-        } else if( t == trace_element::tree ) {
+        } else if( next_type == trace_element::tree ) {
             break;
         }
     }
-    size_t tree_count = 0;
-    bool do_exit = false;
-    while( !do_exit ) {
-        lnode *tree = 0;
-        
-        std::cout << "tree\n";
-                
-        trace_tree t = tr.get_tree();
-        
-        
+    
+    if( !check_split_memory( tr.get_tree_text(), output ) ) {
+        return 1;
+    }
+    
+    size_t tree_count = first_tree - 1;
+    
+    // the taxon set does not change over the trace: the dictionary is built on the first tree
+    // and only re-checked for the following ones.
+    walk_taxa taxa;
+    
+    // in the following code there are three levels of nested loops
+    // level 1: trees, level2: subtrees, level3: insertion positions
+    newick_emitter newick;
+    binary_tree_encoder binary( output.binary_lengths );
+    insertion_filter insertion_selection( filter );
+    placement_aggregator aggregator( filter.lower_is_better );
+    spr_split_delta splits( boost::uint64_t(output.split_memory_mb) << 20 );
+    spr_rf_calculator rf( output.weighted_rf );
+    topology_dedup dedup;
+    spr_edge_order edge_order;
+    spr_delta_encoder delta;
+    trace_record_batch records;
+    tree_output visitor( *trees );
+    visitor.newick = output.incremental_newick ? &newick : 0;
+    visitor.binary = output.binary ? &binary : 0;
+    visitor.stats = instrument ? &stats : 0;
+    visitor.first_tree = first_tree;
+    visitor.aggregator = output.aggregate ? &aggregator : 0;
+    visitor.annotated_tree = output.annotated_tree;
+    visitor.splits = output.rf || output.dedup ? &splits : 0;
+    visitor.rf = output.rf ? &rf : 0;
+    visitor.dedup = output.dedup ? &dedup : 0;
+    visitor.delta = output.delta ? &delta : 0;
+    
+    walk_context ctx( std::cout, visitor, records );
+    ctx.filter = filter.active() ? &insertion_selection : 0;
+    ctx.stats = visitor.stats;
+    ctx.insertion_lines = output.insertion_lines;
+    ctx.placements_only = output.aggregate;
+    ctx.edge_order = output.edge_walk ? &edge_order : 0;
+    ctx.follow = follow;
+    
+    while( next_type == trace_element::tree ) {
         ++tree_count;
+        next_type = process_tree( tr, pool, taxa, tree_count, ctx );
         
-        
-        pool.clear();
-        pool.mark(t.get_tree());
-        pool.sweep();
-        
-
-        tree = t.get_tree();
-        
-        
-        
-//         {
-//             std::ofstream os ( "cur_tree" );
-//             ivy_mike::tree_parser_ms::print_newick( tree, os );
-//         }
-     
-        assert( tree != 0 );
-        //getchar();
-        
-        std::vector<lnode *> sorted_tips;
-        
-        typedef std::tr1::unordered_map<boost::dynamic_bitset<>, lnode*, ivy_mike::bitset_hash > split_to_node_map;
-        split_to_node_map split_to_node;
-        
-        {
-            std::vector<lnode* > nodes;
-            std::vector<boost::dynamic_bitset<> > splits;
-            
-            
-            // get the lists of splits and correponding edges and put them into split_to_edge map
-            ivy_mike::get_all_splits_by_node( tree, nodes, splits, sorted_tips );
-            
-            std::cout << "size: " << nodes.size() << "\n";
-            
-            for( size_t i = 0; i < splits.size(); ++i ) {
-                split_to_node.insert( std::make_pair( splits.at(i), nodes.at(i) ) ); // TODO: change this to emplace and move semantics
-            }
+        if( instrument ) {
+            collector.add( stats );
         }
-        std::vector<std::string> sorted_names;
-        for( auto it = sorted_tips.begin(); it != sorted_tips.end(); ++it ) {
-            sorted_names.push_back((*it)->m_data->tipName);
-        }
-        
         
-        
-        while( true ) { 
-            
-            trace_element::trace_type t = tr.next();
-            
-            if( t == trace_element::none ) {
-                do_exit = true;
-                break; // end of stream
-            } else if( t == trace_element::insertion ) {
-                trace_insertion pos = tr.get_insertion();
-                
-                
-                
-                boost::dynamic_bitset<> split = tip_list_to_split( pos.get_split(), sorted_names );
-                
-                //             split.flip();
-                
-                split_to_node_map::iterator it = split_to_node.find( split );
-                
-                //             if( it == split_to_edge.end() ) {
-                    //                 split.flip();
-                //                 it = split_to_edge.find( split );
-                //             }
-                
-                if( it == split_to_node.end() ) {
-                    {
-                        std::ofstream os ( "error_tree" );
-                        ivy_mike::tree_parser_ms::print_newick( tree, os );
-                    }
-                    tr.dump_position();
-                    throw std::runtime_error( "split not found" );
-                }
-                
-                std::cout << "insertion:  " << *(it->second->m_data) << " " << pos.get_score() << "\n";
-                
-            } else if( t == trace_element::subtree ) {
-                trace_subtree st = tr.get_subtree();
-                
-                std::cout << "subtree: " << st.get_tip_list().size() << "\n";
-                
-                boost::dynamic_bitset<> split = tip_list_to_split( st.get_tip_list(), sorted_names );
-                
-                //split.flip();
-                
-                split_to_node_map::iterator it = split_to_node.find( split );
-                
-                //             if( it == split_to_edge.end() ) {
-                    //                 split.flip();
-                //                 it = split_to_edge.find( split );
-                //             }
-                
-                assert( it != split_to_node.end() );
-                
-                std::cout << "split " << split.count() << " " << it->first.count() << "\n";
-                std::cout << "node: " << *(it->second->m_data) << "\n";
-                
-                
-            } else if( t == trace_element::tree ){
-                break;
-            }
+        if( follow ) {
+            // the per-tree tables
+            std::cout.flush();
+            trees->flush();
         }
     }
     
-    return 0;
-}
-
-int main2( int argc, char *argv[] ) {
-    
-    assert( argc == 2 );
-    
-    const char *tree_name = argv[1];
-
-    ln_pool pool;
-    parser p( tree_name, pool );
-    
-    lnode *t = p.parse();
-    
-    std::vector< std::pair< lnode*, lnode* > > edges;
-    std::vector<boost::dynamic_bitset<> > splits;
-    std::vector<lnode *> sorted_tips;
-    
-    ivy_mike::get_all_splits( t, edges, splits, sorted_tips );
-    
-    std::vector<std::string> sorted_names;
-    for( auto it = sorted_tips.begin(); it != sorted_tips.end(); ++it ) {
-        sorted_names.push_back((*it)->m_data->tipName);
+    if( async_trees ) {
+        async_trees->close();
     }
     
-    std::vector<std::string> split_names = { "Sbay", "Scas", "Sklu", "Calb" };
-    boost::dynamic_bitset<> split = tip_list_to_split( split_names, sorted_names );
-    
+    if( instrument ) {
+        write_stats( collector, stats_name );
+    }
     return 0;
 }
-#endif
\ No newline at end of file
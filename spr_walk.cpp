@@ -0,0 +1,412 @@
+#include <cassert>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/dynamic_bitset.hpp>
+#include "ivymike/tree_parser.h"
+#include "ivymike/tree_split_utils.h"
+#include "spr_walk.h"
+#include "fixed_split.h"
+#include "split_index.h"
+#include "interval_split_index.h"
+#include "insertion_filter.h"
+#include "edge_walk.h"
+
+using ivy_mike::tree_parser_ms::lnode;
+using ivy_mike::tree_parser_ms::ln_pool;
+using ivy_mike::tree_parser_ms::prune_with_rollback;
+using ivy_mike::tree_parser_ms::splice_with_rollback;
+
+// the trace walk behind spr_walk.h. The three levels of nested loops are
+// level 1: trees (process_tree), level 2: subtrees (process_subtrees), level 3: insertion positions.
+
+static void count_insertion( walk_context &ctx ) {
+    if( ctx.stats != 0 ) {
+        ctx.stats->inc( run_stats::insertions );
+    }
+}
+
+// looks up the insertion edge of the record with index record in ctx.records and writes its
+// insertion line
+template<typename index_type>
+static lnode *find_insertion_edge( size_t record, lnode *tree, const index_type &split_to_node, const tree_key &key, walk_context &ctx ) {
+    typedef typename index_type::split_type split_type;
+
+    phase_timer lookup_timer( ctx.stats, run_stats::split_lookup );
+
+    split_type split = split_to_node.make_split();
+    ctx.records.get_split( record, split );
+    const double score = ctx.records.score( record );
+
+    lnode *insertion_edge = split_to_node.find( split );
+
+    lookup_timer.stop();
+    if( ctx.stats != 0 ) {
+        ctx.stats->inc( run_stats::lookups );
+    }
+
+    if( insertion_edge == 0 ) {
+        {
+            std::ofstream os ( "error_tree" );
+            ivy_mike::tree_parser_ms::print_newick( tree, os );
+        }
+        std::cerr << "insertion record at trace line " << ctx.records.line( record ) << "\n";
+        throw std::runtime_error( "split not found" );
+    }
+
+    if( ctx.insertion_lines ) {
+        ctx.out << key.tree << "." << key.subtree << "." << key.insertion << " insertion:  " << *(insertion_edge->m_data) << " " << score << "\n";
+    }
+
+    return insertion_edge;
+}
+
+// the reconstructed tree, i.e., the tree with the pruned subtree spliced into insertion_edge
+static void visit_spr_tree( lnode *prune_node, lnode *insertion_edge, double score, const tree_key &key, walk_context &ctx ) {
+    lnode *root = ivy_mike::tree_parser_ms::next_non_tip(insertion_edge);
+    assert( root != 0 );
+    ctx.visitor.on_insertion( root, prune_node, insertion_edge, score, key );
+}
+
+// level 3 of the trace walk: one @insertion record (the record with index record in ctx.records).
+// Looks up the insertion edge, splices the pruned subtree into it and visits the reconstructed tree.
+template<typename index_type>
+static void process_insertion( size_t record, lnode *tree, lnode *prune_node, const index_type &split_to_node, const tree_key &key, walk_context &ctx ) {
+    lnode *insertion_edge = find_insertion_edge( record, tree, split_to_node, key, ctx );
+    const double score = ctx.records.score( record );
+
+    // splice the pruned node into the new insertion position.
+    // REMARK: using the 'transactional' property of splice_with_rollback. When splice goes out of scope
+    // at the end of this function, the splicing will rollback automatically.
+
+    assert( prune_node->next->back == 0 && prune_node->next->next->back == 0 ); // check splice precondition (which is also the 'post splice-rollback' postcondition...)
+
+    ctx.visitor.on_placement( insertion_edge, score, key );
+
+    phase_timer splice_timer( ctx.stats, run_stats::prune_splice );
+    splice_with_rollback splice(insertion_edge, prune_node );
+    splice_timer.stop();
+
+    visit_spr_tree( prune_node, insertion_edge, score, key, ctx );
+} // splice rollback happens here
+
+// level 3 of the trace walk with an edge order: the insertions (record index, insertion number) of one
+// pruned subtree. All insertion edges are looked up first (the insertion lines keep the given order),
+// then the subtree walks through them in the DFS order of the tree, one adjacent edge at a time (see
+// spr_edge_walk).
+template<typename index_type>
+static void walk_insertions( const std::vector<std::pair<size_t, size_t> > &insertions, lnode *tree, lnode *prune_node, const index_type &split_to_node, size_t tree_count, size_t subtree_count, walk_context &ctx ) {
+    assert( prune_node->next->back == 0 && prune_node->next->next->back == 0 );
+
+    spr_edge_walk walk( *ctx.edge_order, prune_node );
+
+    for( size_t i = 0; i < insertions.size(); ++i ) {
+        const tree_key key( tree_key::spr_tree, tree_count, subtree_count, insertions[i].second );
+        walk.add( find_insertion_edge( insertions[i].first, tree, split_to_node, key, ctx ), i );
+    }
+    walk.plan();
+
+    for( size_t i = 0; i < walk.num_steps(); ++i ) {
+        lnode *edge = walk.edge( i );
+
+        if( walk.id( i ) == spr_edge_walk::npos ) {
+            // an edge between two insertion positions
+            const tree_key key( tree_key::spr_tree, tree_count, subtree_count, 0 );
+
+            phase_timer splice_timer( ctx.stats, run_stats::prune_splice );
+            walk.regraft( i );
+            splice_timer.stop();
+
+            ctx.visitor.on_move( prune_node, edge, key );
+            continue;
+        }
+
+        const std::pair<size_t, size_t> &insertion = insertions[walk.id( i )];
+        const tree_key key( tree_key::spr_tree, tree_count, subtree_count, insertion.second );
+        const double score = ctx.records.score( insertion.first );
+
+        // the insertion edge is unmodified for on_placement
+        walk.detach();
+        ctx.visitor.on_placement( edge, score, key );
+
+        phase_timer splice_timer( ctx.stats, run_stats::prune_splice );
+        walk.regraft( i );
+        splice_timer.stop();
+
+        visit_spr_tree( prune_node, edge, score, key, ctx );
+    }
+} // the subtree is detached from the last edge here
+
+// level 3 of the placements only walk: only looks up the insertion edges of the records [first,last)
+// of ctx.records (no prune, splice or reconstructed trees).
+template<typename index_type>
+static void place_insertions( size_t first, size_t last, lnode *tree, const index_type &split_to_node, size_t tree_count, size_t subtree_count, walk_context &ctx ) {
+    for( size_t record = first; record != last; ++record ) {
+        const tree_key key( tree_key::spr_tree, tree_count, subtree_count, record - first + 1 );
+        count_insertion( ctx );
+
+        lnode *insertion_edge = find_insertion_edge( record, tree, split_to_node, key, ctx );
+        ctx.visitor.on_placement( insertion_edge, ctx.records.score( record ), key );
+    }
+}
+
+// true if there is another subtree block to process: the next one in ctx.records or, if those are all
+// processed, the first one of the next batch of records from tr. In the follow mode the output is
+// flushed before waiting for more records.
+static bool next_subtree_block( trace_reader &tr, const taxon_dict &taxa, walk_context &ctx, size_t &record, trace_element::trace_type &next_type ) {
+    if( record != ctx.records.size() ) {
+        return true;
+    }
+
+    if( next_type != trace_element::subtree ) {
+        return false; // end of the tree
+    }
+
+    if( ctx.follow ) {
+        ctx.out.flush();
+        ctx.visitor.flush();
+    }
+
+    next_type = tr.read_records( taxa, ctx.records, ctx.follow ? 1 : 0 );
+    record = 0;
+    return !ctx.records.empty();
+}
+
+// level 2 of the trace walk: the subtrees of one tree and their insertion positions.
+// split_to_node is the split index of the (unpruned) tree, either a split_node_index or an
+// interval_split_index. Returns the type of the first record that does not belong to this tree anymore.
+template<typename index_type>
+static trace_element::trace_type process_subtrees( trace_reader &tr, lnode *tree, const index_type &split_to_node, const taxon_dict &taxa, size_t tree_count, walk_context &ctx ) {
+    typedef typename index_type::split_type split_type;
+
+    // decode the subtree specifiers and insertion positions of the tree (in the follow mode one
+    // subtree block at a time, see next_subtree_block)
+    const trace_record_batch &records = ctx.records;
+    trace_element::trace_type next_type = tr.read_records( taxa, ctx.records, ctx.follow ? 1 : 0 );
+
+    if( !records.empty() && records.kind( 0 ) == trace_element::insertion ) {
+        throw std::runtime_error( "unexcpected trace element while looking for subtree: insertion" );
+    }
+
+    size_t subtree_count = 0;
+    size_t record = 0;
+
+    // level 2: subtrees
+    while( next_subtree_block( tr, taxa, ctx, record, next_type ) ) {
+        assert( records.kind( record ) == trace_element::subtree );
+
+        phase_timer lookup_timer( ctx.stats, run_stats::split_lookup );
+
+        split_type split = split_to_node.make_split();
+        const size_t num_tips = records.get_split( record, split );
+
+        ++subtree_count;
+
+        // the insertion positions of the subtree are the records [first_insertion,record)
+        const size_t first_insertion = ++record;
+        while( record != records.size() && records.kind( record ) == trace_element::insertion ) {
+            ++record;
+        }
+
+        // REMARK: the index is normalised against the split complement, so no need to do the 'flip and lookup again' dance here.
+        lnode *split_node = split_to_node.find( split );
+
+        lookup_timer.stop();
+        if( ctx.stats != 0 ) {
+            ctx.stats->inc( run_stats::subtrees );
+            ctx.stats->inc( run_stats::lookups );
+        }
+
+        ctx.out << tree_count << "." << subtree_count << " subtree: " << num_tips << "\n";
+
+        assert( split_node != 0 );
+
+        ctx.out << "split " << num_tips << " " << split.count() << "\n";
+        ctx.out << "node: " << *(split_node->m_data) << "\n";
+
+        const tree_key subtree_key( tree_key::pruned_tree, tree_count, subtree_count );
+        ctx.visitor.on_subtree( split_node, subtree_key );
+
+        if( ctx.placements_only ) {
+            place_insertions( first_insertion, record, tree, split_to_node, tree_count, subtree_count, ctx );
+            ctx.visitor.on_subtree_end( subtree_key );
+            continue;
+        }
+
+        lnode *prune_node = split_node->back;
+
+        // this will remove 'prune_node' from the rest of the tree.
+        // REMARK: using the 'transactional' property of prune_with_rollback. When prune goes out of scope
+        // at the end of this block, the prune will rollback automatically.
+        phase_timer prune_timer( ctx.stats, run_stats::prune_splice );
+        prune_with_rollback prune(prune_node);
+        prune_timer.stop();
+
+        assert( prune_node->next->back == 0 && prune_node->next->next->back == 0 ); // prune postcondition
+        ctx.visitor.on_prune( prune_node, prune.get_save_node(), subtree_key );
+
+        // level 3: insertions
+        if( ctx.filter == 0 && ctx.edge_order == 0 ) {
+            for( size_t i = first_insertion; i != record; ++i ) {
+                count_insertion( ctx );
+
+                process_insertion( i, tree, prune_node, split_to_node, tree_key( tree_key::spr_tree, tree_count, subtree_count, i - first_insertion + 1 ), ctx );
+            }
+        } else if( ctx.filter == 0 ) {
+            std::vector<std::pair<size_t, size_t> > insertions;
+
+            for( size_t i = first_insertion; i != record; ++i ) {
+                count_insertion( ctx );
+                insertions.push_back( std::make_pair( i, i - first_insertion + 1 ) );
+            }
+
+            walk_insertions( insertions, tree, prune_node, split_to_node, tree_count, subtree_count, ctx );
+        } else {
+            // select by the scores first, only the selected insertions are reconstructed
+            insertion_filter &filter = *ctx.filter;
+            filter.clear();
+
+            for( size_t i = first_insertion; i != record; ++i ) {
+                count_insertion( ctx );
+                filter.add( i - first_insertion + 1, records.score( i ), i );
+            }
+
+            std::vector<size_t> selected;
+            filter.select( selected );
+
+            ctx.out << tree_count << "." << subtree_count << " selected insertions: " << selected.size() << " of " << filter.size() << "\n";
+
+            if( ctx.edge_order == 0 ) {
+                for( std::vector<size_t>::iterator it = selected.begin(); it != selected.end(); ++it ) {
+                    process_insertion( filter.record( *it ), tree, prune_node, split_to_node, tree_key( tree_key::spr_tree, tree_count, subtree_count, filter.insertion( *it ) ), ctx );
+                }
+            } else {
+                std::vector<std::pair<size_t, size_t> > insertions;
+
+                for( std::vector<size_t>::iterator it = selected.begin(); it != selected.end(); ++it ) {
+                    insertions.push_back( std::make_pair( filter.record( *it ), filter.insertion( *it ) ) );
+                }
+
+                walk_insertions( insertions, tree, prune_node, split_to_node, tree_count, subtree_count, ctx );
+            }
+        }
+
+        ctx.visitor.on_subtree_end( subtree_key );
+    } // prune rollback happens here
+
+    ctx.visitor.on_tree_end( tree_count );
+    return next_type;
+}
+
+// builds the split index with the given split type and continues the trace walk with it
+template<typename split_type>
+static trace_element::trace_type process_with_split_index( trace_reader &tr, lnode *tree, const std::vector<lnode *> &nodes, const std::vector<boost::dynamic_bitset<> > &splits, const taxon_dict &taxa, size_t tree_count, walk_context &ctx ) {
+    phase_timer build_timer( ctx.stats, run_stats::split_build );
+    const split_node_index<split_type> split_to_node( taxa.size(), nodes, splits );
+    build_timer.stop();
+
+    return process_subtrees( tr, tree, split_to_node, taxa, tree_count, ctx );
+}
+
+// start the walk of a new tree. Must be called after the taxon dictionary has been checked.
+static void start_tree( trace_reader &tr, lnode *tree, const taxon_dict &taxa, size_t tree_count, walk_context &ctx ) {
+    if( ctx.edge_order != 0 ) {
+        ctx.edge_order->reset( tree );
+    }
+
+    ctx.visitor.on_tree( tree, taxa, tree_count, tr.get_tree_text() );
+}
+
+// level 1 of the trace walk
+trace_element::trace_type process_tree( trace_reader &tr, ln_pool &pool, walk_taxa &taxa, size_t tree_count, walk_context &ctx ) {
+    // read current tree
+    lnode *tree = 0;
+
+    phase_timer parse_timer( ctx.stats, run_stats::parse );
+    trace_tree t = tr.get_tree();
+    parse_timer.stop();
+
+    ctx.out << tree_count << " tree\n";
+
+    if( ctx.stats != 0 ) {
+        // unrooted binary tree: n tips and n - 2 inner nodes with 3 lnodes each
+        const size_t tips = count_tips( t.get_tree() );
+        if( tr.uses_arena() ) {
+            ctx.stats->arena_tree( tips + 3 * (tips - 2) );
+        } else {
+            ctx.stats->pool_tree( tips + 3 * (tips - 2) );
+        }
+        ctx.stats->inc( run_stats::trees );
+    }
+
+    // with the arena the previous tree was already released by get_tree
+    if( !tr.uses_arena() ) {
+        phase_timer gc_timer( ctx.stats, run_stats::pool_gc );
+        pool.clear();
+        pool.mark(t.get_tree());
+        pool.sweep();
+    }
+
+    tree = t.get_tree();
+    assert( tree != 0 );
+
+    // very large trees: avoid the O(n^2) memory of one split per edge and use the DFS interval index.
+    // The taxon count of the previous tree is a good guess (the taxon set does not change), only
+    // the first tree needs to be counted.
+    const size_t guessed_taxa = taxa.dict().size() != 0 ? taxa.dict().size() : count_tips( tree );
+
+    if( guessed_taxa > interval_index_min_taxa ) {
+        phase_timer build_timer( ctx.stats, run_stats::split_build );
+        interval_split_index split_to_node( tree );
+
+        if( !split_to_node.bind( taxa.dict() ) ) {
+            std::vector<lnode *> sorted_tips( split_to_node.tips() );
+            std::sort( sorted_tips.begin(), sorted_tips.end(), tip_name_less );
+            taxa.update( sorted_tips );
+
+            const bool bound = split_to_node.bind( taxa.dict() );
+            assert( bound );
+        }
+        build_timer.stop();
+
+        ctx.out << "size: " << split_to_node.size() << "\n";
+
+        start_tree( tr, tree, taxa.dict(), tree_count, ctx );
+        return process_subtrees( tr, tree, split_to_node, taxa.dict(), tree_count, ctx );
+    }
+
+    std::vector<lnode *> sorted_tips;
+    std::vector<lnode* > nodes;
+    std::vector<boost::dynamic_bitset<> > splits;
+
+    // get the lists of splits and correponding edges. They are put into the split index below.
+    {
+        phase_timer build_timer( ctx.stats, run_stats::split_build );
+        ivy_mike::get_all_splits_by_node( tree, nodes, splits, sorted_tips );
+    }
+
+    ctx.out << "size: " << nodes.size() << "\n";
+
+    taxa.update( sorted_tips );
+    const taxon_dict &dict = taxa.dict();
+
+    start_tree( tr, tree, dict, tree_count, ctx );
+
+    // dispatch to the smallest fixed split width that can hold the taxon set. Lookups on the
+    // fixed width splits do not allocate. Larger taxon sets fall back to dynamic_bitset.
+    switch( fixed_split_words_for( dict.size() ) ) {
+    case 1:
+        return process_with_split_index<fixed_split<1> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    case 2:
+        return process_with_split_index<fixed_split<2> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    case 4:
+        return process_with_split_index<fixed_split<4> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    case 8:
+        return process_with_split_index<fixed_split<8> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    case 16:
+        return process_with_split_index<fixed_split<16> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    default:
+        return process_with_split_index<boost::dynamic_bitset<> >( tr, tree, nodes, splits, dict, tree_count, ctx );
+    }
+}
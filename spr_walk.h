@@ -0,0 +1,122 @@
+#ifndef __spr_walk_h
+#define __spr_walk_h
+
+#include <iostream>
+
+#include "ivymike/tree_parser.h"
+#include "trace_reader.h"
+#include "taxon_dict.h"
+#include "tree_sink.h"
+#include "run_stats.h"
+
+class insertion_filter;
+class spr_edge_order;
+
+// the trace walk (library spr_walk): reconstructs the SPR trees of a trace in memory and hands them to
+// a visitor. spr_vis_test writes them to the trees/ output, other consumers (e.g., a scoring code)
+// can evaluate them in place without the round trip through the files.
+//
+// All lnodes passed to a visitor are the live tree of the walk. They are only valid during the call
+// and the visitor must not modify the tree (or has to restore it before returning): the walk rolls
+// the prune and the splice back afterwards. A visitor that keeps something must copy it (e.g., with
+// print_newick).
+//
+// Order of the calls for one @tree record of the trace:
+//
+//   on_tree
+//   for every subtree:   on_subtree, on_prune
+//       for every (selected) insertion:   on_placement, on_insertion
+//       on_subtree_end
+//   on_tree_end
+//
+// In the placements only walk (walk_context::placements_only) there is no prune and no splice, so
+// on_prune and on_insertion are not called. In the edge walk (walk_context::edge_order) the
+// insertions of a subtree come in walk order, with on_move for the edges the subtree passes in
+// between.
+class spr_visitor {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    virtual ~spr_visitor() {}
+
+    // a new tree, unmodified. text is its newick text in the trace.
+    virtual void on_tree( lnode *tree, const taxon_dict &taxa, size_t tree_number, const char_range &text ) {}
+
+    // the next subtree, before the prune (the tree is unmodified). The subtree is the one below
+    // split_node, i.e., split_node->back is the prune node. key is the key of the pruned tree.
+    virtual void on_subtree( lnode *split_node, const tree_key &key ) {}
+
+    // the subtree is pruned: prune_node->back is the root of the pruned subtree, the rest of the tree
+    // contains save_node (see prune_with_rollback).
+    virtual void on_prune( lnode *prune_node, lnode *save_node, const tree_key &key ) {}
+
+    // the insertion edge of the next insertion, before the splice (the subtree is still pruned).
+    // In the placements only walk the edge is the one of the unmodified tree.
+    virtual void on_placement( lnode *insertion_edge, double score, const tree_key &key ) {}
+
+    // edge walk: the pruned subtree is moved on to edge, adjacent to its previous edge, on the way to
+    // the next insertion (there is no insertion on edge). A visitor can follow the walk with it, e.g.,
+    // spr_split_delta::move.
+    virtual void on_move( lnode *prune_node, lnode *edge, const tree_key &key ) {}
+
+    // the pruned subtree is spliced into insertion_edge. root (next_non_tip of insertion_edge) is the
+    // root of the reconstructed tree, as it is written to the output.
+    virtual void on_insertion( lnode *root, lnode *prune_node, lnode *insertion_edge, double score, const tree_key &key ) {}
+
+    // after the last insertion of the subtree (the subtree is still pruned)
+    virtual void on_subtree_end( const tree_key &key ) {}
+
+    // after the last subtree of the tree (the tree is unmodified again)
+    virtual void on_tree_end( size_t tree_number ) {}
+
+    // live mode (walk_context::follow): called after every subtree block, before waiting for more of
+    // the trace
+    virtual void flush() {}
+};
+
+// state and options of the trace walk (one per thread)
+struct walk_context {
+    // the log of the walk: tree, subtree and insertion lines (what goes to stdout in spr_vis_test)
+    std::ostream &out;
+
+    // gets the trees of the walk
+    spr_visitor &visitor;
+
+    // only visit the selected insertions (0: all)
+    insertion_filter *filter;
+
+    // instrumentation (0: off)
+    run_stats *stats;
+
+    // only look up the insertion edges (on_placement), no prune and splice
+    bool placements_only;
+
+    // enumerate the insertions of a subtree as a walk over the edges of the tree, moving the subtree
+    // from edge to adjacent edge (0: one splice per insertion in the order of the trace)
+    spr_edge_order *edge_order;
+
+    // write the per-insertion lines to out
+    bool insertion_lines;
+
+    // the decoded @subtree / @insertion records of the current tree (reused for all trees)
+    trace_record_batch &records;
+
+    // live mode (--follow): decode and process the trace one subtree block at a time and flush the
+    // output after every block
+    bool follow;
+
+    walk_context( std::ostream &out_, spr_visitor &visitor_, trace_record_batch &records_ ) : out(out_), visitor(visitor_), filter(0), stats(0), placements_only(false), edge_order(0), insertion_lines(true), records(records_), follow(false) {}
+};
+
+// the walk of one tree: tr is positioned on a @tree record. Parses the tree (into pool or the arena of
+// tr), builds the split index and visits the subtrees/insertions that follow. taxa is updated with the
+// taxon set of the tree. Returns the type of the first record that does not belong to this tree anymore.
+//
+// The walk of a whole trace:
+//
+//   while( next_type == trace_element::tree ) {
+//       next_type = process_tree( tr, pool, taxa, ++tree_number, ctx );
+//   }
+trace_element::trace_type process_tree( trace_reader &tr, ivy_mike::tree_parser_ms::ln_pool &pool, walk_taxa &taxa, size_t tree_count, walk_context &ctx );
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef __taxon_dict_h
+#define __taxon_dict_h
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "ivymike/tree_parser.h"
+
+// interned taxon names with direct name -> bit index lookup. The bit index of a taxon is its
+// position in the sorted tip list returned by get_all_splits_by_node, so the splits built from
+// the dictionary are compatible with the ones in the split_to_node map. The taxon set does not
+// change within a trace, so the dictionary is built once (on the first tree) and only re-checked
+// for the following trees.
+class taxon_dict {
+public:
+    static const size_t npos = size_t(-1);
+
+    taxon_dict() : mask_(0) {}
+
+    void init( const std::vector<ivy_mike::tree_parser_ms::lnode *> &sorted_tips ) {
+        names_.clear();
+        offsets_.clear();
+        hashes_.clear();
+
+        offsets_.push_back(0);
+        for( std::vector<ivy_mike::tree_parser_ms::lnode *>::const_iterator it = sorted_tips.begin(); it != sorted_tips.end(); ++it ) {
+            const std::string &name = (*it)->m_data->tipName;
+
+            names_.insert( names_.end(), name.begin(), name.end() );
+            offsets_.push_back( boost::uint32_t(names_.size()) );
+            hashes_.push_back( hash( name.data(), name.data() + name.size() ) );
+        }
+
+        // open addressing with linear probing, load factor <= 0.5
+        size_t table_size = 16;
+        while( table_size < 2 * size() ) {
+            table_size *= 2;
+        }
+        table_.assign( table_size, 0 );
+        mask_ = table_size - 1;
+
+        for( size_t i = 0; i < size(); ++i ) {
+            size_t slot = hashes_[i] & mask_;
+
+            while( table_[slot] != 0 ) {
+                if( equals( table_[slot] - 1, name_ptr(i), name_ptr(i) + name_len(i) )) {
+                    throw std::runtime_error( "duplicate taxon name in tree: " + name(i) );
+                }
+                slot = (slot + 1) & mask_;
+            }
+            table_[slot] = boost::uint32_t(i + 1);
+        }
+    }
+
+    // true if the (sorted) tips of a tree are exactly the taxa of this dictionary
+    bool matches( const std::vector<ivy_mike::tree_parser_ms::lnode *> &sorted_tips ) const {
+        if( sorted_tips.size() != size() ) {
+            return false;
+        }
+
+        for( size_t i = 0; i < sorted_tips.size(); ++i ) {
+            const std::string &name = sorted_tips[i]->m_data->tipName;
+            if( !equals( i, name.data(), name.data() + name.size() ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const {
+        return hashes_.size();
+    }
+
+    std::string name( size_t idx ) const {
+        return std::string( name_ptr(idx), name_ptr(idx) + name_len(idx) );
+    }
+
+    // bit index of the taxon or npos if the name is unknown
+    size_t lookup( const char *first, const char *last ) const {
+        if( table_.empty() ) {
+            return npos;
+        }
+
+        const boost::uint64_t h = hash( first, last );
+        size_t slot = h & mask_;
+
+        while( table_[slot] != 0 ) {
+            const size_t idx = table_[slot] - 1;
+
+            if( hashes_[idx] == h && equals( idx, first, last ) ) {
+                return idx;
+            }
+            slot = (slot + 1) & mask_;
+        }
+        return npos;
+    }
+
+    size_t lookup( const std::string &name ) const {
+        return lookup( name.data(), name.data() + name.size() );
+    }
+
+private:
+    // FNV-1a
+    static boost::uint64_t hash( const char *first, const char *last ) {
+        boost::uint64_t h = 14695981039346656037ULL;
+
+        for( ; first != last; ++first ) {
+            h ^= (unsigned char)*first;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    const char *name_ptr( size_t idx ) const {
+        return &names_[0] + offsets_[idx];
+    }
+
+    size_t name_len( size_t idx ) const {
+        return offsets_[idx + 1] - offsets_[idx];
+    }
+
+    bool equals( size_t idx, const char *first, const char *last ) const {
+        const size_t len = last - first;
+        return name_len(idx) == len && memcmp( name_ptr(idx), first, len ) == 0;
+    }
+
+    std::vector<char> names_;
+    std::vector<boost::uint32_t> offsets_;
+    std::vector<boost::uint64_t> hashes_;
+
+    std::vector<boost::uint32_t> table_;
+    size_t mask_;
+};
+
+// the taxon dictionaries of a batch run (--batch), shared by all worker threads. The traces of a
+// batch (e.g., bootstrap replicates) usually have the same taxon set, so its dictionary is built
+// once per batch instead of once per trace and thread. A published dictionary is never changed,
+// so it can be used without locking.
+class taxon_dict_cache {
+public:
+    typedef boost::shared_ptr<const taxon_dict> dict_ptr;
+
+    // the dictionary of the (sorted) tips of a tree
+    dict_ptr get( const std::vector<ivy_mike::tree_parser_ms::lnode *> &sorted_tips ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+
+        for( std::vector<dict_ptr>::iterator it = dicts_.begin(); it != dicts_.end(); ++it ) {
+            if( (*it)->matches( sorted_tips ) ) {
+                return *it;
+            }
+        }
+
+        boost::shared_ptr<taxon_dict> dict( new taxon_dict );
+        dict->init( sorted_tips );
+        dicts_.push_back( dict );
+        return dict;
+    }
+
+private:
+    boost::mutex mtx_;
+    std::vector<dict_ptr> dicts_;
+};
+
+// the taxon dictionary of a trace walk: a private one that is rebuilt when the taxon set changes,
+// or the shared ones of a taxon_dict_cache
+class walk_taxa {
+public:
+    walk_taxa( taxon_dict_cache *cache = 0 ) : cache_(cache) {}
+
+    const taxon_dict &dict() const {
+        return shared_ != 0 ? *shared_ : own_;
+    }
+
+    // make the dictionary match the (sorted) tips of a tree
+    void update( const std::vector<ivy_mike::tree_parser_ms::lnode *> &sorted_tips ) {
+        if( dict().matches( sorted_tips ) ) {
+            return;
+        }
+
+        if( cache_ != 0 ) {
+            shared_ = cache_->get( sorted_tips );
+        } else {
+            own_.init( sorted_tips );
+        }
+    }
+
+private:
+    taxon_dict_cache *cache_;
+    taxon_dict_cache::dict_ptr shared_;
+    taxon_dict own_;
+};
+
+#endif
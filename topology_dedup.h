@@ -0,0 +1,52 @@
+#ifndef __topology_dedup_h
+#define __topology_dedup_h
+
+#include <string>
+#include <sstream>
+#include <boost/tr1/unordered_map.hpp>
+
+#include "spr_split_delta.h"
+
+// content-addressed deduplication of the reconstructed trees of one tree: the first SPR tree with a
+// topology is written, the later ones with the same topology (e.g., the re-insertions next to the
+// original position) only get a row in the reference table of the tree:
+//
+//   <subtree> <insertion> <subtree of the written tree> <insertion of the written tree>
+//
+// The topologies are identified by their topology_hash (128 bit, the collision probability is
+// negligible even for billions of trees). Only the topology counts, the branch lengths of a
+// duplicate are not kept.
+class topology_dedup {
+public:
+    void reset() {
+        first_.clear();
+
+        table_.str( std::string() );
+        table_ << "# subtree insertion same_as_subtree same_as_insertion\n";
+    }
+
+    // returns true if the topology has not been seen before in the current tree (i.e., the tree
+    // has to be written)
+    bool add( const topology_hash &hash, size_t subtree, size_t insertion ) {
+        std::pair<first_map::iterator, bool> res = first_.insert( std::make_pair( hash, std::make_pair( subtree, insertion ) ) );
+
+        if( res.second ) {
+            return true;
+        }
+
+        table_ << subtree << "\t" << insertion << "\t" << res.first->second.first << "\t" << res.first->second.second << "\n";
+        return false;
+    }
+
+    std::string table() const {
+        return table_.str();
+    }
+
+private:
+    typedef std::tr1::unordered_map<topology_hash, std::pair<size_t, size_t>, topology_hash_hasher> first_map;
+
+    first_map first_;
+    std::ostringstream table_;
+};
+
+#endif
@@ -0,0 +1,478 @@
+#ifndef __trace_batch_h
+#define __trace_batch_h
+
+#include <cassert>
+#include <cerrno>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include <sys/stat.h>
+#ifdef WIN32
+#include <direct.h>
+#endif
+
+#include "trace_pipeline.h"
+#include "tree_sink.h"
+#include "run_stats.h"
+
+// creates a directory (it is no error if it exists already)
+inline void make_dir( const std::string &name ) {
+#ifdef WIN32
+    const int res = _mkdir( name.c_str() );
+#else
+    const int res = mkdir( name.c_str(), 0777 );
+#endif
+    if( res != 0 && errno != EEXIST ) {
+        throw std::runtime_error( "cannot create directory: " + name );
+    }
+}
+
+// reads the trace list of a batch run: one trace file per line, empty lines and lines starting
+// with # are skipped (- for stdin)
+inline std::vector<std::string> read_trace_list( const std::string &name ) {
+    std::ifstream file;
+    if( name != "-" ) {
+        file.open( name.c_str() );
+        if( !file.good() ) {
+            throw std::runtime_error( "cannot open trace list: " + name );
+        }
+    }
+    std::istream &is = name == "-" ? std::cin : file;
+
+    std::vector<std::string> traces;
+    std::string line;
+    while( std::getline( is, line ) ) {
+        const size_t first = line.find_first_not_of( " \t\r" );
+        if( first == std::string::npos || line[first] == '#' ) {
+            continue;
+        }
+        const size_t last = line.find_last_not_of( " \t\r" );
+        traces.push_back( line.substr( first, last - first + 1 ) );
+    }
+    return traces;
+}
+
+// the per-block work of a batch worker. Like a tree_block_processor, but the trees go to the
+// output namespace of the trace the block belongs to.
+class batch_block_processor {
+public:
+    virtual ~batch_block_processor() {}
+
+    // everything that would go to stdout in the serial run of the trace has to be written to out
+    virtual void process( const tree_block &block, tree_sink &trees, std::ostream &out ) = 0;
+
+    // see tree_block_processor::take_commit (the commits are in the order of the trace)
+    virtual boost::shared_ptr<ordered_commit> take_commit() {
+        return boost::shared_ptr<ordered_commit>();
+    }
+};
+
+// opens the tree sink of one trace of a batch run (e.g., a file_tree_sink or an archive in dir)
+class batch_sink_factory {
+public:
+    virtual ~batch_sink_factory() {}
+
+    virtual tree_sink *open( const std::string &dir ) = 0;
+};
+
+// processes the trees of many traces on one pool of worker threads (--batch), instead of one
+// process per trace with its own startup and a long tail of single-threaded stragglers.
+//
+// Every trace gets its own output namespace <dir>/<n> (n: 1-based position in the trace list): the
+// stdout of the serial run goes to <dir>/<n>/out (in trace order, re-ordered like in the
+// trace_pipeline) and the trees to the sink opened on <dir>/<n>/trees.
+//
+// The blocks are scheduled by work stealing. Every worker has its own deque of tasks, a task is
+// either a tree block or reading the next block of a trace. A worker takes the newest task of its
+// own deque and, if that is empty, steals the oldest one of another worker. Reading a block
+// pushes the read of the next block and then the block itself, so the reader goes on with the
+// block while an idle worker steals the read and keeps the trace going. New traces are only
+// opened by workers that found nothing to steal, which keeps the number of open traces (and
+// output files) low while all workers stay busy until the last block of the last trace.
+//
+// An error in a trace (e.g., an unreadable file or a malformed record) only stops that trace: it is
+// written to <dir>/<n>/error (and stderr), the remaining tasks of the trace are dropped and the
+// other traces go on. run returns the number of failed traces.
+//
+// REMARK: the deques share one mutex. A task is at least one whole tree, so the contention on it
+// is negligible and not worth the lock-free deques of fine grained work stealing.
+class batch_scheduler {
+public:
+    // max_open: number of traces that are open at the same time, max_in_flight: number of blocks
+    // per trace that have been read but not yet written to its out (bounds the memory per trace)
+    batch_scheduler( const std::vector<std::string> &traces, const std::string &dir, batch_sink_factory &sinks, size_t max_open, size_t max_in_flight )
+      : sinks_(sinks),
+        max_open_(max_open),
+        max_in_flight_(max_in_flight),
+        collector_(0),
+        next_trace_(0),
+        open_(0),
+        traces_done_(0),
+        traces_failed_(0)
+    {
+        assert( max_open_ > 0 && max_in_flight_ > 0 );
+
+        for( size_t i = 0; i < traces.size(); ++i ) {
+            std::ostringstream number_dir;
+            number_dir << dir << "/" << (i + 1);
+
+            traces_.push_back( new trace_state( traces[i], number_dir.str() ) );
+        }
+    }
+
+    // the reader stats of the traces are added to collector (0: off)
+    void set_stats( stats_collector *collector ) {
+        collector_ = collector;
+    }
+
+    // runs one worker thread per processor and returns when all traces have been processed.
+    // Returns the number of traces that failed (see <dir>/<n>/error).
+    size_t run( const std::vector<batch_block_processor *> &processors ) {
+        assert( !processors.empty() );
+
+        queues_.resize( processors.size() );
+
+        boost::thread_group workers;
+        for( size_t i = 0; i < processors.size(); ++i ) {
+            workers.create_thread( boost::bind( &batch_scheduler::worker_main, this, i, processors[i] ) );
+        }
+        workers.join_all();
+
+        return traces_failed_;
+    }
+
+private:
+    typedef std::pair<std::string, boost::shared_ptr<ordered_commit> > block_output;
+
+    struct trace_state {
+        const std::string name;
+        const std::string dir;
+
+        // only used by the read task of the trace (there is at most one at any time)
+        boost::scoped_ptr<tree_block_reader> reader;
+        run_stats reader_stats;
+        bool first_read;
+
+        boost::scoped_ptr<tree_sink> trees;
+        std::ofstream out;
+
+        // the re-ordered output and the read-ahead limit, guarded by mtx
+        boost::mutex mtx;
+        std::map<size_t, block_output> pending_output;
+        size_t next_output;
+        size_t in_flight;
+        bool read_parked;   // the next read waits until in_flight drops below max_in_flight
+        bool reader_done;
+        bool finished;
+
+        // the queued and running tasks of the trace, and the first error (guarded by mtx). A failed
+        // trace is closed by the task that brings tasks to 0.
+        size_t tasks;
+        bool failed;
+        std::string error;
+
+        trace_state( const std::string &name_, const std::string &dir_ ) : name(name_), dir(dir_), first_read(true), next_output(1), in_flight(0), read_parked(false), reader_done(false), finished(false), tasks(0), failed(false) {}
+    };
+
+    struct task {
+        trace_state *trace;
+
+        // 0: read the next block of the trace
+        boost::shared_ptr<tree_block> block;
+
+        task() : trace(0) {}
+        task( trace_state *trace_, boost::shared_ptr<tree_block> block_ ) : trace(trace_), block(block_) {}
+    };
+
+    void worker_main( size_t self, batch_block_processor *processor ) {
+        while( true ) {
+            task t;
+            bool open = false;
+            {
+                boost::unique_lock<boost::mutex> lock( mtx_ );
+                while( true ) {
+                    if( traces_done_ == traces_.size() ) {
+                        return;
+                    }
+
+                    if( take_task( self, t ) ) {
+                        break;
+                    }
+
+                    // nothing to steal: start the next trace
+                    if( next_trace_ < traces_.size() && open_ < max_open_ ) {
+                        t.trace = &traces_[next_trace_++];
+                        t.trace->tasks = 1; // not shared with other workers yet
+                        ++open_;
+                        open = true;
+                        break;
+                    }
+
+                    work_cond_.wait( lock );
+                }
+            }
+
+            bool skip;
+            {
+                boost::lock_guard<boost::mutex> lock( t.trace->mtx );
+                skip = t.trace->failed;
+            }
+
+            if( !skip ) {
+                try {
+                    if( open ) {
+                        open_trace( *t.trace );
+                    }
+
+                    if( t.block == 0 ) {
+                        read_block( self, *t.trace );
+                    } else {
+                        process_block( self, processor, t );
+                    }
+                } catch( std::exception &x ) {
+                    fail_trace( *t.trace, x.what() );
+                }
+            }
+
+            task_done( *t.trace );
+        }
+    }
+
+    // mtx_ must be held. The newest own task or the oldest task of another worker.
+    bool take_task( size_t self, task &t ) {
+        if( !queues_[self].empty() ) {
+            t = queues_[self].back();
+            queues_[self].pop_back();
+            return true;
+        }
+
+        for( size_t i = 1; i < queues_.size(); ++i ) {
+            std::deque<task> &victim = queues_[(self + i) % queues_.size()];
+
+            if( !victim.empty() ) {
+                t = victim.front();
+                victim.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void push_task( size_t self, const task &t ) {
+        {
+            boost::lock_guard<boost::mutex> lock( t.trace->mtx );
+            ++t.trace->tasks;
+        }
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            queues_[self].push_back( t );
+        }
+        work_cond_.notify_one();
+    }
+
+    void open_trace( trace_state &t ) {
+        make_dir( t.dir );
+        make_dir( t.dir + "/trees" );
+
+        const std::string out_name = t.dir + "/out";
+        t.out.open( out_name.c_str() );
+        if( !t.out.good() ) {
+            throw std::runtime_error( "cannot open output file: " + out_name );
+        }
+
+        t.trees.reset( sinks_.open( t.dir + "/trees" ) );
+        t.reader.reset( new tree_block_reader( open_line_source( t.name.c_str() ) ) );
+
+        if( collector_ != 0 ) {
+            t.reader->set_stats( &t.reader_stats );
+        }
+    }
+
+    void read_block( size_t self, trace_state &t ) {
+        boost::shared_ptr<tree_block> block( new tree_block );
+        const bool more = t.reader->next( *block );
+
+        if( !more && t.first_read ) {
+            throw std::runtime_error( "end of trace while looking for first tree" );
+        }
+        t.first_read = false;
+
+        bool read_next = false;
+        {
+            boost::lock_guard<boost::mutex> lock( t.mtx );
+            if( more ) {
+                ++t.in_flight;
+
+                if( t.in_flight < max_in_flight_ ) {
+                    read_next = true;
+                } else {
+                    t.read_parked = true;
+                }
+            } else {
+                t.reader_done = true;
+            }
+        }
+
+        if( !more ) {
+            finish_if_done( t );
+            return;
+        }
+
+        if( read_next ) {
+            push_task( self, task( &t, boost::shared_ptr<tree_block>() ) );
+        }
+        push_task( self, task( &t, block ) );
+    }
+
+    void process_block( size_t self, batch_block_processor *processor, const task &t ) {
+        std::ostringstream os;
+        processor->process( *t.block, *t.trace->trees, os );
+        boost::shared_ptr<ordered_commit> commit = processor->take_commit();
+
+        write_ordered( self, *t.trace, t.block->tree_number, os.str(), commit );
+    }
+
+    // write the output of block tree_number as soon as all preceding blocks of the trace are written
+    void write_ordered( size_t self, trace_state &t, size_t tree_number, const std::string &output, boost::shared_ptr<ordered_commit> commit ) {
+        bool resume_read = false;
+        {
+            boost::lock_guard<boost::mutex> lock( t.mtx );
+
+            t.pending_output[tree_number] = std::make_pair( output, commit );
+
+            std::map<size_t, block_output>::iterator it;
+            while( (it = t.pending_output.find( t.next_output )) != t.pending_output.end() ) {
+                t.out << it->second.first;
+
+                if( it->second.second != 0 ) {
+                    it->second.second->commit();
+                }
+                t.pending_output.erase( it );
+
+                ++t.next_output;
+                --t.in_flight;
+            }
+
+            if( t.read_parked && t.in_flight < max_in_flight_ ) {
+                t.read_parked = false;
+                resume_read = true;
+            }
+        }
+
+        if( resume_read ) {
+            push_task( self, task( &t, boost::shared_ptr<tree_block>() ) );
+        }
+
+        finish_if_done( t );
+    }
+
+    // closes the outputs of the trace once the last block is written
+    void finish_if_done( trace_state &t ) {
+        {
+            boost::lock_guard<boost::mutex> lock( t.mtx );
+            if( t.failed || !t.reader_done || t.in_flight != 0 || t.finished ) {
+                return;
+            }
+            t.finished = true;
+        }
+
+        t.trees->flush();
+        t.trees.reset();
+        t.reader.reset();
+
+        t.out.close();
+        if( t.out.fail() ) {
+            throw std::runtime_error( "error while writing: " + t.dir + "/out" );
+        }
+
+        if( collector_ != 0 ) {
+            collector_->add( t.reader_stats );
+        }
+
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            --open_;
+            ++traces_done_;
+        }
+        work_cond_.notify_all();
+    }
+
+    // the remaining tasks of the trace are dropped (see worker_main), the last one closes it
+    void fail_trace( trace_state &t, const std::string &error ) {
+        boost::lock_guard<boost::mutex> lock( t.mtx );
+        if( !t.failed ) {
+            t.failed = true;
+            t.error = error;
+        }
+    }
+
+    void task_done( trace_state &t ) {
+        {
+            boost::lock_guard<boost::mutex> lock( t.mtx );
+            if( --t.tasks != 0 || !t.failed ) {
+                return;
+            }
+        }
+        close_failed( t );
+    }
+
+    // releases a failed trace and writes its error. Nobody else refers to the trace anymore.
+    void close_failed( trace_state &t ) {
+        std::cerr << "batch: " << t.name << ": " << t.error << "\n";
+
+        t.pending_output.clear();
+        t.reader.reset();
+        try {
+            t.trees.reset();
+        } catch( std::exception & ) {
+            // the error of the trace is already recorded
+        }
+        t.out.close();
+
+        try {
+            make_dir( t.dir );
+            const std::string error_name = t.dir + "/error";
+            std::ofstream os( error_name.c_str() );
+            os << t.name << ": " << t.error << "\n";
+        } catch( std::exception &x ) {
+            std::cerr << "batch: " << x.what() << "\n";
+        }
+
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            --open_;
+            ++traces_done_;
+            ++traces_failed_;
+        }
+        work_cond_.notify_all();
+    }
+
+    batch_sink_factory &sinks_;
+    const size_t max_open_;
+    const size_t max_in_flight_;
+    stats_collector *collector_;
+
+    boost::ptr_vector<trace_state> traces_;
+
+    boost::mutex mtx_;
+    boost::condition_variable work_cond_;
+    std::vector<std::deque<task> > queues_;
+    size_t next_trace_;
+    size_t open_;
+    size_t traces_done_;
+    size_t traces_failed_;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef __trace_generator_h
+#define __trace_generator_h
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+
+// small deterministic PRNG (xorshift64*), so that the same parameters give the same trace everywhere
+class bench_rng {
+public:
+    bench_rng( boost::uint64_t seed ) : s_(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+
+    boost::uint64_t next() {
+        s_ ^= s_ >> 12;
+        s_ ^= s_ << 25;
+        s_ ^= s_ >> 27;
+        return s_ * 2685821657736338717ULL;
+    }
+
+    // uniform in [0,n)
+    size_t uniform( size_t n ) {
+        assert( n > 0 );
+        return size_t( next() % n );
+    }
+
+    // uniform in [0,1)
+    double real() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    boost::uint64_t s_;
+};
+
+struct trace_generator_params {
+    size_t taxa;
+    size_t trees;
+    size_t subtrees;   // per tree
+    size_t insertions; // per subtree
+    boost::uint64_t seed;
+
+    trace_generator_params() : taxa(100), trees(10), subtrees(10), insertions(10), seed(1) {}
+};
+
+// writes synthetic traces in the format spr_vis_test reads: random unrooted trees over the taxa
+// t0..t<n-1>, each followed by @subtree records (random clades) and @insertion records (random
+// clades disjoint from the subtree, i.e., edges of the pruned tree) with random scores.
+class trace_generator {
+public:
+    trace_generator( const trace_generator_params &params ) : params_(params), rng_(params.seed) {
+        if( params_.taxa < 6 ) {
+            throw std::runtime_error( "trace_generator: need at least 6 taxa" );
+        }
+    }
+
+    void write( std::ostream &os ) {
+        for( size_t t = 0; t < params_.trees; ++t ) {
+            write_tree( os );
+        }
+    }
+
+private:
+    // a clade is the range [lo,hi) of the leaf order. For inner nodes left/right are node indices.
+    struct node {
+        size_t lo;
+        size_t hi;
+        size_t left;
+        size_t right;
+    };
+
+    static const size_t no_node = size_t(-1);
+
+    void write_tree( std::ostream &os ) {
+        const size_t n = params_.taxa;
+
+        order_.resize( n );
+        for( size_t i = 0; i < n; ++i ) {
+            order_[i] = i;
+        }
+        for( size_t i = n - 1; i > 0; --i ) {
+            std::swap( order_[i], order_[rng_.uniform( i + 1 )] );
+        }
+
+        // the unrooted root has three subtrees
+        nodes_.clear();
+        const size_t a = build( 0, n / 3 );
+        const size_t b = build( n / 3, 2 * n / 3 );
+        const size_t c = build( 2 * n / 3, n );
+
+        os << "@tree: (";
+        write_newick( os, a );
+        os << ",";
+        write_newick( os, b );
+        os << ",";
+        write_newick( os, c );
+        os << ");\n";
+
+        for( size_t s = 0; s < params_.subtrees; ++s ) {
+            const node &st = nodes_[rng_.uniform( nodes_.size() )];
+
+            os << "@subtree (";
+            write_tips( os, st );
+            os << " )\n";
+
+            for( size_t i = 0; i < params_.insertions; ++i ) {
+                char score[32];
+                snprintf( score, sizeof(score), "%.4f", -1000 * rng_.real() );
+
+                os << "@insertion " << score << " (";
+                write_tips( os, disjoint_clade( st ) );
+                os << " )\n";
+            }
+        }
+    }
+
+    // random binary topology over the leaf range [lo,hi). Returns the index of the root node.
+    size_t build( size_t lo, size_t hi ) {
+        assert( lo < hi );
+
+        const size_t root = nodes_.size();
+        nodes_.push_back( make_node( lo, hi ) );
+
+        std::vector<size_t> stack( 1, root );
+        while( !stack.empty() ) {
+            const size_t cur = stack.back();
+            stack.pop_back();
+
+            const size_t clo = nodes_[cur].lo;
+            const size_t chi = nodes_[cur].hi;
+
+            if( chi - clo == 1 ) {
+                continue;
+            }
+
+            const size_t k = clo + 1 + rng_.uniform( chi - clo - 1 );
+
+            nodes_[cur].left = nodes_.size();
+            nodes_.push_back( make_node( clo, k ) );
+            nodes_[cur].right = nodes_.size();
+            nodes_.push_back( make_node( k, chi ) );
+
+            stack.push_back( nodes_[cur].left );
+            stack.push_back( nodes_[cur].right );
+        }
+        return root;
+    }
+
+    static node make_node( size_t lo, size_t hi ) {
+        node n;
+        n.lo = lo;
+        n.hi = hi;
+        n.left = no_node;
+        n.right = no_node;
+        return n;
+    }
+
+    void write_newick( std::ostream &os, size_t root ) {
+        // iterative: 0 = open, 1 = between the children, 2 = close
+        std::vector<std::pair<size_t, int> > stack( 1, std::make_pair( root, 0 ) );
+
+        while( !stack.empty() ) {
+            const size_t cur = stack.back().first;
+            const int state = stack.back().second;
+            stack.pop_back();
+
+            const node &n = nodes_[cur];
+
+            if( n.left == no_node ) {
+                os << "t" << order_[n.lo];
+                write_length( os );
+            } else if( state == 0 ) {
+                os << "(";
+                stack.push_back( std::make_pair( cur, 1 ) );
+                stack.push_back( std::make_pair( n.left, 0 ) );
+            } else if( state == 1 ) {
+                os << ",";
+                stack.push_back( std::make_pair( cur, 2 ) );
+                stack.push_back( std::make_pair( n.right, 0 ) );
+            } else {
+                os << ")";
+                write_length( os );
+            }
+        }
+    }
+
+    void write_length( std::ostream &os ) {
+        char len[32];
+        snprintf( len, sizeof(len), ":%.3f", rng_.real() );
+        os << len;
+    }
+
+    void write_tips( std::ostream &os, const node &n ) {
+        for( size_t i = n.lo; i < n.hi; ++i ) {
+            os << " t" << order_[i];
+        }
+    }
+
+    const node &disjoint_clade( const node &st ) {
+        // rejection sampling, the subtree is usually small compared to the tree
+        for( size_t i = 0; i < 64; ++i ) {
+            const node &n = nodes_[rng_.uniform( nodes_.size() )];
+
+            if( n.hi <= st.lo || n.lo >= st.hi ) {
+                return n;
+            }
+        }
+
+        // there is always a leaf outside the subtree (the subtree is within one of the three root subtrees)
+        for( size_t i = 0; i < nodes_.size(); ++i ) {
+            if( nodes_[i].hi <= st.lo || nodes_[i].lo >= st.hi ) {
+                return nodes_[i];
+            }
+        }
+        assert( 0 );
+        return st;
+    }
+
+    const trace_generator_params params_;
+    bench_rng rng_;
+
+    std::vector<size_t> order_;
+    std::vector<node> nodes_;
+};
+
+#endif
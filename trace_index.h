@@ -0,0 +1,280 @@
+#ifndef __trace_index_h
+#define __trace_index_h
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "trace_reader.h"
+#include "tree_archive.h"
+
+// seekable index of a trace: byte offset and record counts of every @tree record. It is kept in a
+// sidecar file next to the trace (<trace>.tidx), so that a range of trees (--trees a-b) or a shard
+// of the trace (--shard i/n) can be processed without reading the trace from the beginning.
+//
+// Layout of the sidecar: 8 byte magic, u64 size and u64 mtime of the trace (to detect a stale
+// index), then one 32 byte little-endian record per tree:
+//
+//   u64 offset | u64 tree | u64 subtrees | u64 insertions
+namespace trace_index_format {
+    const char magic[8] = { 'S', 'P', 'R', 'T', 'I', 'D', 'X', '1' };
+    const size_t header_size = 24;
+    const size_t record_size = 32;
+}
+
+struct trace_index_entry {
+    boost::uint64_t offset;     // of the @tree line
+    boost::uint64_t tree;       // 1-based number of the tree (as in the serial run)
+    boost::uint64_t subtrees;   // @subtree records up to the next tree
+    boost::uint64_t insertions; // @insertion records up to the next tree
+
+    // the number of records, i.e., roughly the number of trees written for this tree
+    boost::uint64_t work() const {
+        return 1 + subtrees + insertions;
+    }
+};
+
+class trace_index {
+public:
+    trace_index() : trace_size_(0), trace_mtime_(0) {}
+
+    static std::string sidecar_name( const std::string &trace_name ) {
+        return trace_name + ".tidx";
+    }
+
+    // one pass over the trace
+    void build( const std::string &trace_name ) {
+        if( detect_compression( trace_name.c_str() ) != no_compression ) {
+            throw std::runtime_error( "the trace index (--trees, --shard) needs an uncompressed trace: " + trace_name );
+        }
+
+        mapped_line_source source( trace_name.c_str() );
+
+        entries_.clear();
+        trace_size_ = source.size();
+        trace_mtime_ = file_mtime( trace_name );
+
+        while( true ) {
+            const boost::uint64_t offset = source.position();
+
+            char_range line;
+            if( !source.next_line( line ) ) {
+                break;
+            }
+
+            const trace_element::trace_type type = classify_record( line );
+
+            if( type == trace_element::tree ) {
+                trace_index_entry e;
+                e.offset = offset;
+                e.tree = entries_.size() + 1;
+                e.subtrees = 0;
+                e.insertions = 0;
+                entries_.push_back( e );
+            } else if( entries_.empty() ) {
+                continue; // records before the first tree are skipped (like in the trace walk)
+            } else if( type == trace_element::subtree ) {
+                ++entries_.back().subtrees;
+            } else if( type == trace_element::insertion ) {
+                ++entries_.back().insertions;
+            }
+        }
+    }
+
+    // returns false if the sidecar does not exist or does not match the trace
+    bool load( const std::string &trace_name ) {
+        const std::string name = sidecar_name( trace_name );
+        std::ifstream is( name.c_str(), std::ios::binary );
+
+        char header[trace_index_format::header_size];
+        if( !is.read( header, sizeof(header) ) || !std::equal( header, header + sizeof(trace_index_format::magic), trace_index_format::magic ) ) {
+            return false;
+        }
+
+        const boost::uint64_t size = tree_archive::get_le( header + 8, 8 );
+        const boost::uint64_t mtime = tree_archive::get_le( header + 16, 8 );
+
+        if( size != file_size( trace_name ) || mtime != file_mtime( trace_name ) ) {
+            return false;
+        }
+
+        std::vector<trace_index_entry> entries;
+        char rec[trace_index_format::record_size];
+        while( is.read( rec, sizeof(rec) ) ) {
+            trace_index_entry e;
+            e.offset = tree_archive::get_le( rec, 8 );
+            e.tree = tree_archive::get_le( rec + 8, 8 );
+            e.subtrees = tree_archive::get_le( rec + 16, 8 );
+            e.insertions = tree_archive::get_le( rec + 24, 8 );
+            entries.push_back( e );
+        }
+
+        entries_.swap( entries );
+        trace_size_ = size;
+        trace_mtime_ = mtime;
+        return true;
+    }
+
+    // written to a temporary file first, so that concurrent jobs on the same trace never see a
+    // partial sidecar
+    void save( const std::string &trace_name ) const {
+        const std::string name = sidecar_name( trace_name );
+
+        std::stringstream tmp_name;
+        tmp_name << name << ".tmp." << getpid();
+
+        {
+            std::ofstream os( tmp_name.str().c_str(), std::ios::binary );
+            if( !os.good() ) {
+                throw std::runtime_error( "cannot write trace index: " + tmp_name.str() );
+            }
+
+            char header[trace_index_format::header_size];
+            std::copy( trace_index_format::magic, trace_index_format::magic + sizeof(trace_index_format::magic), header );
+            tree_archive::put_le( header + 8, trace_size_, 8 );
+            tree_archive::put_le( header + 16, trace_mtime_, 8 );
+            os.write( header, sizeof(header) );
+
+            char rec[trace_index_format::record_size];
+            for( std::vector<trace_index_entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it ) {
+                tree_archive::put_le( rec, it->offset, 8 );
+                tree_archive::put_le( rec + 8, it->tree, 8 );
+                tree_archive::put_le( rec + 16, it->subtrees, 8 );
+                tree_archive::put_le( rec + 24, it->insertions, 8 );
+                os.write( rec, sizeof(rec) );
+            }
+
+            if( !os.good() ) {
+                throw std::runtime_error( "cannot write trace index: " + tmp_name.str() );
+            }
+        }
+
+        if( rename( tmp_name.str().c_str(), name.c_str() ) != 0 ) {
+            remove( tmp_name.str().c_str() );
+            throw std::runtime_error( "cannot write trace index: " + name );
+        }
+    }
+
+    // loads the sidecar, or builds the index and tries to save it (a read-only trace directory
+    // only costs the indexing pass on every run)
+    void open( const std::string &trace_name ) {
+        if( load( trace_name ) ) {
+            return;
+        }
+
+        build( trace_name );
+
+        try {
+            save( trace_name );
+        } catch( std::runtime_error &x ) {
+            std::cerr << x.what() << " (continuing without sidecar)\n";
+        }
+    }
+
+    size_t num_trees() const {
+        return entries_.size();
+    }
+
+    // tree is 1-based
+    const trace_index_entry &entry( size_t tree ) const {
+        assert( tree >= 1 && tree <= entries_.size() );
+        return entries_[tree - 1];
+    }
+
+    // the bytes of the trees [first,last] (1-based, inclusive)
+    void byte_range( size_t first, size_t last, boost::uint64_t &begin, boost::uint64_t &end ) const {
+        assert( first >= 1 && first <= last && last <= entries_.size() );
+
+        begin = entries_[first - 1].offset;
+        end = last < entries_.size() ? entries_[last].offset : trace_size_;
+    }
+
+    // the trees [first,last] of shard i of n (i is 1-based). The shards are contiguous and balanced
+    // by the number of records, not by the number of trees. first > last for an empty shard.
+    void shard( size_t i, size_t n, size_t &first, size_t &last ) const {
+        assert( i >= 1 && i <= n );
+
+        boost::uint64_t total = 0;
+        for( std::vector<trace_index_entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it ) {
+            total += it->work();
+        }
+
+        // a tree belongs to the shard in which its first record falls
+        first = entries_.size() + 1;
+        last = entries_.size();
+
+        boost::uint64_t before = 0;
+        for( size_t t = 0; t < entries_.size(); ++t ) {
+            const size_t s = size_t( before * n / total ) + 1;
+
+            if( s == i && first > entries_.size() ) {
+                first = t + 1;
+            } else if( s > i ) {
+                last = t;
+                break;
+            }
+            before += entries_[t].work();
+        }
+
+        if( first > entries_.size() ) {
+            last = first - 1;
+        }
+    }
+
+private:
+    static boost::uint64_t file_size( const std::string &name ) {
+#ifndef WIN32
+        struct stat st;
+        return stat( name.c_str(), &st ) == 0 ? boost::uint64_t(st.st_size) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    static boost::uint64_t file_mtime( const std::string &name ) {
+#ifndef WIN32
+        struct stat st;
+        return stat( name.c_str(), &st ) == 0 ? boost::uint64_t(st.st_mtime) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    std::vector<trace_index_entry> entries_;
+    boost::uint64_t trace_size_;
+    boost::uint64_t trace_mtime_;
+};
+
+// a source for the trees [first,last] (1-based, inclusive) of a regular trace file
+inline line_source *open_tree_range( const std::string &trace_name, const trace_index &index, size_t first, size_t last ) {
+    if( !is_regular_file( trace_name.c_str() ) ) {
+        throw std::runtime_error( "tree ranges need a regular (seekable) trace file: " + trace_name );
+    }
+
+    boost::uint64_t begin;
+    boost::uint64_t end;
+    index.byte_range( first, last, begin, end );
+
+    mapped_line_source *source = new mapped_line_source( trace_name.c_str() );
+    try {
+        source->set_range( begin, end );
+    } catch( ... ) {
+        delete source;
+        throw;
+    }
+    return source;
+}
+
+#endif
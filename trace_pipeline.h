@@ -0,0 +1,419 @@
+#ifndef __trace_pipeline_h
+#define __trace_pipeline_h
+
+#include <cassert>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "trace_reader.h"
+
+// one @tree record plus all @subtree/@insertion records up to the next @tree. The blocks are
+// independent of each other, which is what the pipeline exploits.
+struct tree_block {
+    // 1-based number of the tree in the trace (the tree_count of the serial loop)
+    size_t tree_number;
+
+    std::vector<char_range> lines;
+
+    // backing store for the lines if the line source is not stable (otherwise the lines point
+    // directly into the source, e.g., the mapped trace file)
+    std::string storage;
+
+    tree_block() : tree_number(0) {}
+};
+
+// line source over the records of a tree_block, so that the usual trace_reader can be used on it
+class block_line_source : public line_source {
+public:
+    block_line_source( const tree_block &block ) : block_(block), pos_(0) {}
+
+    virtual bool next_line( char_range &line ) {
+        if( pos_ == block_.lines.size() ) {
+            return false;
+        }
+
+        line = block_.lines[pos_++];
+        return true;
+    }
+
+    virtual bool stable() const {
+        return true;
+    }
+
+private:
+    const tree_block &block_;
+    size_t pos_;
+};
+
+// the reader stage: cuts the trace into tree_blocks. Non-record lines are dropped, records before
+// the first @tree are skipped (like in the serial loop).
+class tree_block_reader {
+public:
+    // takes ownership of source. first_tree is the number of the first tree of source in the whole
+    // trace (for a source restricted to a range of trees).
+    tree_block_reader( line_source *source, size_t first_tree = 1 ) : source_(source), have_pending_(false), tree_count_(first_tree - 1), first_tree_(first_tree), stats_(0) {
+        assert( first_tree >= 1 );
+    }
+
+    // count the lines and the time spent in next() (0: off)
+    void set_stats( run_stats *stats ) {
+        stats_ = stats;
+    }
+
+    size_t first_tree() const {
+        return first_tree_;
+    }
+
+    // the @tree record of the next block, without consuming it (e.g., to check the first tree before
+    // the pipeline starts). Returns false at the end of the trace.
+    bool peek_tree( char_range &line ) {
+        if( !have_pending_ && !find_tree() ) {
+            return false;
+        }
+
+        line = pending_view();
+        return true;
+    }
+
+    // returns false at the end of the trace
+    bool next( tree_block &block ) {
+        phase_timer timer( stats_, run_stats::trace_io );
+
+        block.lines.clear();
+        block.storage.clear();
+
+        const bool stable = source_->stable();
+        std::vector<std::pair<size_t, size_t> > spans; // offsets into storage, if not stable
+
+        if( !have_pending_ && !find_tree() ) {
+            return false;
+        }
+
+        ++tree_count_;
+        block.tree_number = tree_count_;
+        add_line( block, spans, pending_view(), stable );
+        have_pending_ = false;
+
+        char_range line;
+        while( source_->next_line( line ) ) {
+            count_line();
+            const trace_element::trace_type type = classify_record( line );
+
+            if( type == trace_element::tree ) {
+                set_pending( line );
+                break;
+            } else if( type != trace_element::none ) {
+                add_line( block, spans, line, stable );
+            }
+        }
+
+        if( !stable ) {
+            const char *base = block.storage.data();
+            for( std::vector<std::pair<size_t, size_t> >::iterator it = spans.begin(); it != spans.end(); ++it ) {
+                block.lines.push_back( char_range( base + it->first, base + it->second ) );
+            }
+        }
+
+        return true;
+    }
+
+private:
+    // search for the first tree and make it the pending record
+    bool find_tree() {
+        char_range line;
+        while( true ) {
+            if( !source_->next_line( line ) ) {
+                return false;
+            }
+            count_line();
+
+            if( classify_record( line ) == trace_element::tree ) {
+                break;
+            }
+        }
+        set_pending( line );
+        return true;
+    }
+
+    void count_line() {
+        if( stats_ != 0 ) {
+            stats_->inc( run_stats::lines );
+        }
+    }
+
+    void set_pending( const char_range &line ) {
+        if( source_->stable() ) {
+            pending_ = line;
+        } else {
+            pending_storage_.assign( line.first, line.last );
+        }
+        have_pending_ = true;
+    }
+
+    char_range pending_view() const {
+        if( source_->stable() ) {
+            return pending_;
+        } else {
+            return char_range( pending_storage_.data(), pending_storage_.data() + pending_storage_.size() );
+        }
+    }
+
+    static void add_line( tree_block &block, std::vector<std::pair<size_t, size_t> > &spans, const char_range &line, bool stable ) {
+        if( stable ) {
+            block.lines.push_back( line );
+        } else {
+            const size_t first = block.storage.size();
+            block.storage.append( line.first, line.last );
+            spans.push_back( std::make_pair( first, block.storage.size() ) );
+        }
+    }
+
+    boost::scoped_ptr<line_source> source_;
+
+    bool have_pending_;
+    char_range pending_;
+    std::string pending_storage_;
+
+    size_t tree_count_;
+    const size_t first_tree_;
+    run_stats *stats_;
+};
+
+// side effects of a processed block that have to happen in trace order (e.g., appending the trees
+// of the block to an archive)
+class ordered_commit {
+public:
+    virtual ~ordered_commit() {}
+
+    virtual void commit() = 0;
+};
+
+// the per-block work done by a worker thread. Each worker gets its own processor, so processors
+// can keep private state (node pool, taxon dictionary, ...) without locking.
+class tree_block_processor {
+public:
+    virtual ~tree_block_processor() {}
+
+    // everything that would go to stdout in the serial run has to be written to out
+    virtual void process( const tree_block &block, std::ostream &out ) = 0;
+
+    // called in the worker thread right after process. The returned object (if any) is committed
+    // in trace order, directly after the stdout output of the block has been written.
+    virtual boost::shared_ptr<ordered_commit> take_commit() {
+        return boost::shared_ptr<ordered_commit>();
+    }
+};
+
+// reader stage -> N workers -> ordered output. The reader runs in the calling thread and cuts the
+// trace into blocks, the workers process them in any order. The per-block output is re-ordered
+// by tree number, so that out receives exactly what the serial run would have written.
+class trace_pipeline {
+public:
+    // max_in_flight bounds the number of blocks that have been read but not yet written to out
+    trace_pipeline( tree_block_reader &reader, std::ostream &out, size_t max_in_flight )
+      : reader_(reader),
+        out_(out),
+        max_in_flight_(max_in_flight),
+        in_flight_(0),
+        next_output_(reader.first_tree()),
+        committing_(false),
+        reader_done_(false),
+        failed_(false)
+    {
+        assert( max_in_flight_ > 0 );
+    }
+
+    // runs one worker thread per processor and returns when the whole trace has been processed.
+    // An exception in any worker stops the pipeline and is re-thrown here as std::runtime_error.
+    void run( const std::vector<tree_block_processor *> &processors ) {
+        assert( !processors.empty() );
+
+        boost::thread_group workers;
+        for( std::vector<tree_block_processor *>::const_iterator it = processors.begin(); it != processors.end(); ++it ) {
+            workers.create_thread( boost::bind( &trace_pipeline::worker_main, this, *it ) );
+        }
+
+        try {
+            read_blocks();
+        } catch( std::exception &x ) {
+            fail( x.what() );
+        }
+
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            reader_done_ = true;
+        }
+        work_cond_.notify_all();
+
+        workers.join_all();
+
+        if( failed_ ) {
+            throw std::runtime_error( error_ );
+        }
+        assert( pending_output_.empty() );
+        out_.flush();
+    }
+
+private:
+    void read_blocks() {
+        for( bool first = true; ; first = false ) {
+            boost::shared_ptr<tree_block> block( new tree_block );
+
+            if( !reader_.next( *block ) ) {
+                if( first ) {
+                    throw std::runtime_error( "end of trace while looking for first tree\n" );
+                }
+                return;
+            }
+
+            boost::unique_lock<boost::mutex> lock( mtx_ );
+            while( in_flight_ >= max_in_flight_ && !failed_ ) {
+                space_cond_.wait( lock );
+            }
+
+            if( failed_ ) {
+                return;
+            }
+
+            ++in_flight_;
+            queue_.push_back( block );
+            work_cond_.notify_one();
+        }
+    }
+
+    void worker_main( tree_block_processor *processor ) {
+        while( true ) {
+            boost::shared_ptr<tree_block> block;
+            {
+                boost::unique_lock<boost::mutex> lock( mtx_ );
+                while( queue_.empty() && !reader_done_ && !failed_ ) {
+                    work_cond_.wait( lock );
+                }
+
+                if( failed_ || queue_.empty() ) {
+                    return;
+                }
+
+                block = queue_.front();
+                queue_.pop_front();
+            }
+
+            std::ostringstream os;
+            boost::shared_ptr<ordered_commit> commit;
+
+            try {
+                processor->process( *block, os );
+                commit = processor->take_commit();
+            } catch( std::exception &x ) {
+                fail( x.what() );
+                return;
+            }
+
+            write_ordered( block->tree_number, os.str(), commit );
+        }
+    }
+
+    // write the output of block tree_number as soon as all preceding blocks are written. The ready
+    // blocks are taken out of pending_output_ under the lock, but written and committed after
+    // releasing it, so the other workers can hand in their blocks meanwhile (commits can be slow,
+    // e.g., the archive). Only one worker at a time is the committer (committing_), it keeps
+    // going until no block is ready, so the output stays in trace order.
+    void write_ordered( size_t tree_number, const std::string &output, boost::shared_ptr<ordered_commit> commit ) {
+        boost::unique_lock<boost::mutex> lock( mtx_ );
+
+        pending_output_[tree_number] = std::make_pair( output, commit );
+
+        if( committing_ ) {
+            return; // the current committer picks it up
+        }
+        committing_ = true;
+
+        std::vector<block_output> ready;
+        while( true ) {
+            ready.clear();
+
+            std::map<size_t, block_output>::iterator it;
+            while( (it = pending_output_.find( next_output_ )) != pending_output_.end() ) {
+                ready.push_back( block_output() );
+                ready.back().first.swap( it->second.first );
+                ready.back().second.swap( it->second.second );
+                pending_output_.erase( it );
+
+                ++next_output_;
+            }
+
+            if( ready.empty() ) {
+                committing_ = false;
+                return;
+            }
+
+            lock.unlock();
+
+            for( std::vector<block_output>::iterator rit = ready.begin(); rit != ready.end(); ++rit ) {
+                out_ << rit->first;
+
+                if( rit->second != 0 ) {
+                    try {
+                        rit->second->commit();
+                    } catch( std::exception &x ) {
+                        fail( x.what() );
+
+                        lock.lock();
+                        committing_ = false;
+                        return;
+                    }
+                }
+            }
+
+            lock.lock();
+            in_flight_ -= ready.size();
+            space_cond_.notify_one();
+        }
+    }
+
+    void fail( const std::string &error ) {
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            if( !failed_ ) {
+                failed_ = true;
+                error_ = error;
+            }
+
+            // drop the queued blocks, nobody is going to process them
+            queue_.clear();
+        }
+        work_cond_.notify_all();
+        space_cond_.notify_all();
+    }
+
+    tree_block_reader &reader_;
+    std::ostream &out_;
+    const size_t max_in_flight_;
+
+    boost::mutex mtx_;
+    boost::condition_variable work_cond_;
+    boost::condition_variable space_cond_;
+
+    std::deque<boost::shared_ptr<tree_block> > queue_;
+    typedef std::pair<std::string, boost::shared_ptr<ordered_commit> > block_output;
+    std::map<size_t, block_output> pending_output_;
+    size_t in_flight_;
+    size_t next_output_;
+    bool committing_;
+
+    bool reader_done_;
+    bool failed_;
+    std::string error_;
+};
+
+#endif
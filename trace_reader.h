@@ -0,0 +1,1023 @@
+#ifndef __trace_reader_h
+#define __trace_reader_h
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#ifdef HAVE_ZSTD_INPUT
+#include <boost/iostreams/filter/zstd.hpp>
+#endif
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+#include "ivymike/tree_parser.h"
+#include "taxon_dict.h"
+#include "run_stats.h"
+#include "tree_arena.h"
+
+// non-owning view of a range of characters. This is what the line sources hand out: for the
+// mapped source it points directly into the mapped trace file, for the stream source into the
+// line buffer. In both cases it is only valid until the next call to line_source::next_line.
+struct char_range {
+    const char *first;
+    const char *last;
+
+    char_range() : first(0), last(0) {}
+    char_range( const char *f, const char *l ) : first(f), last(l) {}
+
+    size_t size() const {
+        return last - first;
+    }
+
+    bool empty() const {
+        return first == last;
+    }
+
+    std::string str() const {
+        return std::string( first, last );
+    }
+
+    bool operator==( const char *s ) const {
+        const size_t len = strlen(s);
+        return size() == len && std::equal( first, last, s );
+    }
+};
+
+inline bool is_trace_ws( char c ) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// split a char_range into whitespace separated tokens without copying (replaces the
+// std::stringstream >> std::string idiom on the hot path)
+class ws_tokenizer {
+public:
+    ws_tokenizer( const char *first, const char *last ) : cur_(first), last_(last) {}
+
+    bool next( char_range &tok ) {
+        while( cur_ != last_ && is_trace_ws(*cur_) ) {
+            ++cur_;
+        }
+        if( cur_ == last_ ) {
+            return false;
+        }
+
+        const char *start = cur_;
+        while( cur_ != last_ && !is_trace_ws(*cur_) ) {
+            ++cur_;
+        }
+        tok = char_range( start, cur_ );
+        return true;
+    }
+
+private:
+    const char *cur_;
+    const char * const last_;
+};
+
+// the record types of a trace
+class trace_element {
+public:
+    enum trace_type {
+        tree,
+        subtree,
+        insertion,
+        none
+    };
+};
+
+
+class trace_tree : public trace_element {
+public:
+
+    trace_tree( ivy_mike::tree_parser_ms::lnode *t ) : tree_(t) {}
+
+    ivy_mike::tree_parser_ms::lnode *get_tree() {
+        return tree_;
+    }
+
+private:
+    ivy_mike::tree_parser_ms::lnode *tree_;
+};
+
+// the @subtree and @insertion records of one @tree block, decoded by trace_reader::read_records.
+// The records are kept as flat arrays (structure of arrays): kind, score, line number and the text of
+// the tip list. The arrays keep their capacity across blocks, so decoding a block does not allocate
+// once the largest block has been seen.
+//
+// The tip names are only resolved to taxon indices by get_split, in the same pass that sets the bits
+// of the split (like the streaming get_*_split of trace_reader). Decoding a record does not touch the
+// tip list at all, and the records that are never looked up (e.g., the insertions dropped by an
+// insertion_filter) are never resolved.
+//
+// REMARK: with a stable line source the tip lists point into the lines of the source, otherwise they
+// are copied into the batch (about as much memory as the record text of the block).
+class trace_record_batch {
+public:
+    trace_record_batch() : dict_(0) {
+        clear();
+    }
+
+    void clear() {
+        kinds_.clear();
+        scores_.clear();
+        lines_.clear();
+        tip_lists_.clear();
+        text_.clear();
+        text_spans_.clear();
+    }
+
+    size_t size() const {
+        return kinds_.size();
+    }
+
+    bool empty() const {
+        return kinds_.empty();
+    }
+
+    trace_element::trace_type kind( size_t i ) const {
+        return trace_element::trace_type( kinds_[i] );
+    }
+
+    // score of an @insertion record (0 for @subtree records)
+    double score( size_t i ) const {
+        return scores_[i];
+    }
+
+    // line number of the record in the trace (or in the block, for diagnostics)
+    size_t line( size_t i ) const {
+        return lines_[i];
+    }
+
+    // sets the bits of the tip list of record i in split (which must already have the size of the
+    // dictionary and be cleared). The tip names are resolved through the dictionary given to
+    // read_records. Returns the number of tips.
+    template<typename split_type>
+    size_t get_split( size_t i, split_type &split ) const {
+        ws_tokenizer tok( tip_lists_[i].first, tip_lists_[i].last );
+        char_range name;
+        size_t n = 0;
+
+        while( tok.next( name ) ) {
+            const size_t idx = dict_->lookup( name.first, name.last );
+
+            if( idx == taxon_dict::npos ) {
+                std::cerr << "record at trace line " << lines_[i] << "\n";
+                throw std::runtime_error( "unknown taxon in trace: " + name.str() );
+            }
+            split.set( idx );
+            ++n;
+        }
+        return n;
+    }
+
+private:
+    friend class trace_reader;
+
+    void add( trace_element::trace_type kind, double score, size_t line, const char_range &tips, bool stable ) {
+        kinds_.push_back( (unsigned char)kind );
+        scores_.push_back( score );
+        lines_.push_back( line );
+
+        if( stable ) {
+            tip_lists_.push_back( tips );
+        } else {
+            const size_t first = text_.size();
+            text_.append( tips.first, tips.last );
+            text_spans_.push_back( std::make_pair( first, text_.size() ) );
+        }
+    }
+
+    // after the last add: the views of the copied tip lists (text_ does not move anymore)
+    void finish() {
+        if( text_spans_.empty() ) {
+            return;
+        }
+
+        const char *base = text_.data();
+        for( std::vector<std::pair<size_t, size_t> >::iterator it = text_spans_.begin(); it != text_spans_.end(); ++it ) {
+            tip_lists_.push_back( char_range( base + it->first, base + it->second ) );
+        }
+    }
+
+    const taxon_dict *dict_;
+
+    std::vector<unsigned char> kinds_;
+    std::vector<double> scores_;
+    std::vector<size_t> lines_;
+    std::vector<char_range> tip_lists_;
+
+    // backing store of the tip lists if the line source is not stable
+    std::string text_;
+    std::vector<std::pair<size_t, size_t> > text_spans_;
+};
+
+
+// a line_source hands out the lines of a trace one at a time. The returned range (without the
+// line terminator) stays valid until the next call to next_line.
+class line_source {
+public:
+    virtual ~line_source() {}
+
+    // returns false at the end of the input
+    virtual bool next_line( char_range &line ) = 0;
+
+    // true if the lines stay valid for the lifetime of the source (not only until the next call to
+    // next_line). Consumers can then keep views instead of copying the lines.
+    virtual bool stable() const {
+        return false;
+    }
+};
+
+// the traditional std::getline based source. Used for anything that cannot be mapped (pipes etc.)
+class stream_line_source : public line_source {
+public:
+    stream_line_source( const char *filename ) : is_(&ifs_) {
+        ifs_.open( filename );
+
+        if( !ifs_.good() ) {
+            throw std::runtime_error( std::string( "cannot open trace file: " ) + filename );
+        }
+    }
+
+    stream_line_source( std::istream &is ) : is_(&is) {}
+
+    virtual bool next_line( char_range &line ) {
+        if( !std::getline( *is_, line_ ) ) {
+            return false;
+        }
+
+        line = char_range( line_.data(), line_.data() + line_.size() );
+        return true;
+    }
+
+private:
+    std::ifstream ifs_;
+    std::istream *is_;
+    std::string line_;
+};
+
+// zero-copy source: the whole trace is mapped read-only and the lines are handed out as views
+// directly into the mapping. The lines of a mapped trace stay valid as long as the source lives.
+class mapped_line_source : public line_source {
+public:
+    mapped_line_source( const char *filename ) : file_( filename ) {
+        if( !file_.is_open() ) {
+            throw std::runtime_error( std::string( "cannot map trace file: " ) + filename );
+        }
+
+        cur_ = file_.data();
+        end_ = cur_ + file_.size();
+#ifndef WIN32
+        // we only ever stream front to back through the trace, so tell the kernel to read ahead aggressively
+        madvise( const_cast<char *>(cur_), file_.size(), MADV_SEQUENTIAL );
+#endif
+    }
+
+    virtual bool next_line( char_range &line ) {
+        if( cur_ == end_ ) {
+            return false;
+        }
+
+        const char *eol = static_cast<const char *>( memchr( cur_, '\n', end_ - cur_ ) );
+        const char *next = eol == 0 ? end_ : eol + 1;
+
+        if( eol == 0 ) {
+            eol = end_;
+        }
+
+        if( eol != cur_ && *(eol - 1) == '\r' ) {
+            --eol;
+        }
+
+        line = char_range( cur_, eol );
+        cur_ = next;
+        return true;
+    }
+
+    virtual bool stable() const {
+        return true;
+    }
+
+    boost::uint64_t size() const {
+        return file_.size();
+    }
+
+    // byte offset of the next line
+    boost::uint64_t position() const {
+        return cur_ - file_.data();
+    }
+
+    // restrict the source to the bytes [first,last) of the trace (first must be at a line start)
+    void set_range( boost::uint64_t first, boost::uint64_t last ) {
+        if( first > last || last > file_.size() ) {
+            throw std::runtime_error( "mapped_line_source: range outside of the trace file" );
+        }
+
+        cur_ = file_.data() + first;
+        end_ = file_.data() + last;
+    }
+
+private:
+    boost::iostreams::mapped_file_source file_;
+    const char *cur_;
+    const char *end_;
+};
+
+enum trace_compression {
+    no_compression,
+    gzip_compression,
+    zstd_compression
+};
+
+// decompresses the trace on a read-ahead thread into a ring of buffers, so that the parsing thread
+// only waits for decompression if it is faster than the inflate.
+class compressed_line_source : public line_source {
+public:
+    compressed_line_source( const char *filename, trace_compression compression, size_t buffer_size = 4 * 1024 * 1024, size_t num_buffers = 4 )
+      : ring_(num_buffers),
+        fill_(0),
+        read_(0),
+        filled_(0),
+        eof_(false),
+        stop_(false),
+        have_buffer_(false),
+        cur_(0),
+        end_(0)
+    {
+        assert( num_buffers >= 2 && buffer_size > 0 );
+
+        for( std::vector<buffer>::iterator it = ring_.begin(); it != ring_.end(); ++it ) {
+            it->data.resize( buffer_size );
+            it->size = 0;
+        }
+
+        if( compression == gzip_compression ) {
+            in_.push( boost::iostreams::gzip_decompressor() );
+        } else if( compression == zstd_compression ) {
+#ifdef HAVE_ZSTD_INPUT
+            in_.push( boost::iostreams::zstd_decompressor() );
+#else
+            throw std::runtime_error( std::string( "zstd compressed trace, but built without zstd support (cmake -DZSTD_INPUT=ON): " ) + filename );
+#endif
+        } else {
+            throw std::runtime_error( "compressed_line_source: not a compressed trace" );
+        }
+
+        boost::iostreams::file_source file( filename, std::ios::in | std::ios::binary );
+        if( !file.is_open() ) {
+            throw std::runtime_error( std::string( "cannot open trace file: " ) + filename );
+        }
+        in_.push( file );
+
+        thread_ = boost::thread( boost::bind( &compressed_line_source::read_ahead_main, this ) );
+    }
+
+    ~compressed_line_source() {
+        {
+            boost::lock_guard<boost::mutex> lock( mtx_ );
+            stop_ = true;
+        }
+        not_full_.notify_all();
+        thread_.join();
+    }
+
+    virtual bool next_line( char_range &line ) {
+        bool carrying = false; // the line started in an earlier buffer
+        carry_.clear();
+
+        while( true ) {
+            if( cur_ == end_ ) {
+                if( !next_buffer() ) {
+                    if( !carrying ) {
+                        return false;
+                    }
+
+                    // last line without terminator
+                    line = strip_cr( char_range( carry_.data(), carry_.data() + carry_.size() ) );
+                    return true;
+                }
+                continue;
+            }
+
+            const char *eol = static_cast<const char *>( memchr( cur_, '\n', end_ - cur_ ) );
+
+            if( eol == 0 ) {
+                carry_.append( cur_, end_ );
+                carrying = true;
+                cur_ = end_;
+                continue;
+            }
+
+            if( carrying ) {
+                carry_.append( cur_, eol );
+                line = strip_cr( char_range( carry_.data(), carry_.data() + carry_.size() ) );
+            } else {
+                line = strip_cr( char_range( cur_, eol ) );
+            }
+            cur_ = eol + 1;
+            return true;
+        }
+    }
+
+private:
+    struct buffer {
+        std::vector<char> data;
+        size_t size;
+    };
+
+    static char_range strip_cr( char_range line ) {
+        if( !line.empty() && *(line.last - 1) == '\r' ) {
+            --line.last;
+        }
+        return line;
+    }
+
+    // hands the current buffer back to the read-ahead thread and waits for the next one. Returns
+    // false at the end of the trace.
+    bool next_buffer() {
+        boost::unique_lock<boost::mutex> lock( mtx_ );
+
+        if( have_buffer_ ) {
+            have_buffer_ = false;
+            read_ = (read_ + 1) % ring_.size();
+            --filled_;
+            not_full_.notify_one();
+        }
+
+        while( filled_ == 0 && !eof_ ) {
+            not_empty_.wait( lock );
+        }
+
+        if( filled_ == 0 ) {
+            if( !error_.empty() ) {
+                throw std::runtime_error( error_ );
+            }
+            return false;
+        }
+
+        have_buffer_ = true;
+        const buffer &b = ring_[read_];
+        cur_ = &b.data[0];
+        end_ = cur_ + b.size;
+        return true;
+    }
+
+    void read_ahead_main() {
+        try {
+            while( true ) {
+                {
+                    boost::unique_lock<boost::mutex> lock( mtx_ );
+                    while( filled_ == ring_.size() && !stop_ ) {
+                        not_full_.wait( lock );
+                    }
+                    if( stop_ ) {
+                        return;
+                    }
+                }
+
+                // the consumer does not touch the buffers that are not filled, so no lock is needed here
+                buffer &b = ring_[fill_];
+                in_.read( &b.data[0], b.data.size() );
+                b.size = size_t( in_.gcount() );
+
+                const bool eof = !in_.good();
+                if( eof && in_.bad() ) {
+                    throw std::runtime_error( "error while decompressing the trace" );
+                }
+
+                {
+                    boost::lock_guard<boost::mutex> lock( mtx_ );
+                    if( b.size > 0 ) {
+                        fill_ = (fill_ + 1) % ring_.size();
+                        ++filled_;
+                    }
+                    eof_ = eof;
+                }
+                not_empty_.notify_one();
+
+                if( eof ) {
+                    return;
+                }
+            }
+        } catch( std::exception &x ) {
+            {
+                boost::lock_guard<boost::mutex> lock( mtx_ );
+                error_ = x.what();
+                eof_ = true;
+            }
+            not_empty_.notify_one();
+        }
+    }
+
+    boost::iostreams::filtering_istream in_;
+
+    std::vector<buffer> ring_;
+    size_t fill_;   // next buffer to fill (read-ahead thread)
+    size_t read_;   // current buffer of the consumer
+    size_t filled_; // buffers ready for (or in use by) the consumer
+    bool eof_;
+    bool stop_;
+    std::string error_;
+
+    boost::mutex mtx_;
+    boost::condition_variable not_empty_;
+    boost::condition_variable not_full_;
+    boost::thread thread_;
+
+    bool have_buffer_;
+    const char *cur_;
+    const char *end_;
+    std::string carry_;
+};
+
+inline bool is_regular_file( const char *filename ) {
+#ifndef WIN32
+    struct stat st;
+    return stat( filename, &st ) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+#else
+    return true;
+#endif
+}
+
+// compression of a regular trace file, by its magic bytes
+inline trace_compression detect_compression( const char *filename ) {
+    std::ifstream is( filename, std::ios::binary );
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    is.read( reinterpret_cast<char *>( magic ), sizeof(magic) );
+
+    if( is.gcount() >= 2 && magic[0] == 0x1f && magic[1] == 0x8b ) {
+        return gzip_compression;
+    } else if( is.gcount() == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd ) {
+        return zstd_compression;
+    }
+    return no_compression;
+}
+
+// regular files are mapped (or decompressed on the fly if they are gzip or zstd compressed),
+// everything else (fifos, /dev/stdin, ...) goes through std::getline. "-" is stdin.
+inline line_source *open_line_source( const char *filename ) {
+    if( strcmp( filename, "-" ) == 0 ) {
+        return new stream_line_source( std::cin );
+    } else if( is_regular_file( filename ) ) {
+        const trace_compression compression = detect_compression( filename );
+
+        if( compression != no_compression ) {
+            return new compressed_line_source( filename, compression );
+        }
+        return new mapped_line_source( filename );
+    } else {
+        return new stream_line_source( filename );
+    }
+}
+
+#ifndef WIN32
+// source for a trace that is still being written (--follow): a growing regular file, or a pipe
+// ("-" is stdin). Only complete lines are handed out, a partial last line is kept until its line
+// terminator arrives. At the current end of a regular file the source polls for new data every
+// poll_interval seconds, the trace ends after idle_timeout seconds without new data (0: never).
+// A partial last line is dropped then (with a warning), the writer may still be in the middle of
+// it. A pipe ends when the writer closes it (a last line without terminator is handed out then).
+class follow_line_source : public line_source {
+public:
+    follow_line_source( const char *filename, double poll_interval, double idle_timeout )
+      : fd_(0),
+        own_fd_(false),
+        buf_(1024 * 1024),
+        pos_(0),
+        end_(0),
+        eof_(false),
+        poll_ns_( boost::uint64_t(poll_interval * 1e9) ),
+        idle_ns_( boost::uint64_t(idle_timeout * 1e9) )
+    {
+        if( strcmp( filename, "-" ) != 0 ) {
+            fd_ = open( filename, O_RDONLY );
+            if( fd_ < 0 ) {
+                throw std::runtime_error( std::string( "cannot open trace file: " ) + filename );
+            }
+            own_fd_ = true;
+        }
+
+        struct stat st;
+        regular_ = fstat( fd_, &st ) == 0 && S_ISREG(st.st_mode);
+    }
+
+    ~follow_line_source() {
+        if( own_fd_ ) {
+            close( fd_ );
+        }
+    }
+
+    virtual bool next_line( char_range &line ) {
+        while( true ) {
+            const char *first = &buf_[0] + pos_;
+            const char *nl = static_cast<const char *>( memchr( first, '\n', end_ - pos_ ) );
+
+            if( nl != 0 ) {
+                pos_ = nl + 1 - &buf_[0];
+                line = strip_cr( char_range( first, nl ) );
+                return true;
+            }
+
+            if( eof_ ) {
+                if( pos_ == end_ ) {
+                    return false;
+                }
+                pos_ = end_;
+
+                if( regular_ ) {
+                    std::cerr << "follow: no data for the idle timeout, dropping the unterminated last line of the trace (" << (end_ - (first - &buf_[0])) << " bytes)\n";
+                    return false;
+                }
+                line = strip_cr( char_range( first, &buf_[0] + end_ ) );
+                return true;
+            }
+
+            fill();
+        }
+    }
+
+private:
+    static char_range strip_cr( char_range line ) {
+        if( !line.empty() && line.last[-1] == '\r' ) {
+            --line.last;
+        }
+        return line;
+    }
+
+    // reads more data, waiting for it at the end of a growing file. Sets eof_ at the end of the trace.
+    void fill() {
+        // move the partial line to the front (the buffer grows only for lines longer than the buffer)
+        if( pos_ > 0 ) {
+            memmove( &buf_[0], &buf_[0] + pos_, end_ - pos_ );
+            end_ -= pos_;
+            pos_ = 0;
+        }
+        if( end_ == buf_.size() ) {
+            buf_.resize( 2 * buf_.size() );
+        }
+
+        const boost::uint64_t idle_start = run_stats::now_ns();
+
+        while( true ) {
+            const ssize_t n = read( fd_, &buf_[end_], buf_.size() - end_ );
+
+            if( n > 0 ) {
+                end_ += n;
+                return;
+            } else if( n < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                throw std::runtime_error( "error while reading trace" );
+            }
+
+            if( !regular_ || (idle_ns_ != 0 && run_stats::now_ns() - idle_start >= idle_ns_) ) {
+                eof_ = true;
+                return;
+            }
+
+            timespec ts;
+            ts.tv_sec = time_t( poll_ns_ / 1000000000ULL );
+            ts.tv_nsec = long( poll_ns_ % 1000000000ULL );
+            nanosleep( &ts, 0 );
+        }
+    }
+
+    int fd_;
+    bool own_fd_;
+    bool regular_;
+
+    std::vector<char> buf_;
+    size_t pos_;
+    size_t end_;
+    bool eof_;
+
+    const boost::uint64_t poll_ns_;
+    const boost::uint64_t idle_ns_;
+};
+#endif
+
+// type of the record on a trace line (trace_element::none for anything that is not a record)
+inline trace_element::trace_type classify_record( const char_range &line ) {
+    char_range token;
+    ws_tokenizer tok( line.first, line.last );
+
+    if( !tok.next( token ) || token.first[0] != '@' ) {
+        return trace_element::none; // fast path for non-record lines
+    }
+
+    if( token == "@tree" || token == "@tree:" ) {
+        return trace_element::tree;
+    } else if( token == "@subtree" ) {
+        return trace_element::subtree;
+    } else if( token == "@insertion" ) {
+        return trace_element::insertion;
+    } else {
+        return trace_element::none;
+    }
+}
+
+class trace_reader {
+public:
+    trace_reader( const char *filename, ivy_mike::tree_parser_ms::ln_pool *pool ) : source_(open_line_source( filename )), pool_(pool), pool_alloc_(*pool), pool_parser_(pool_alloc_), arena_(0), parser_check_(0), element_type_(trace_element::none), line_count_(0), stats_(0) {}
+
+    // takes ownership of source
+    trace_reader( line_source *source, ivy_mike::tree_parser_ms::ln_pool *pool ) : source_(source), pool_(pool), pool_alloc_(*pool), pool_parser_(pool_alloc_), arena_(0), parser_check_(0), element_type_(trace_element::none), line_count_(0), stats_(0) {
+        assert( source != 0 );
+    }
+
+    // count the lines and the time spent in next() (0: off)
+    void set_stats( run_stats *stats ) {
+        stats_ = stats;
+    }
+
+    // parse the trees with scan_tree_parser (newick_scan) instead of the ivy_mike parser (0: off). check
+    // is the self-check of scan_tree_parser shared by all readers of the run; if it has already
+    // failed, the reader stays on the ivy_mike parser.
+    void set_parser_check( tree_parser_check *check ) {
+        if( check != 0 && check->failed() ) {
+            check = 0;
+        }
+
+        parser_check_ = check;
+        if( check == 0 ) {
+            set_arena( 0, 0 );
+        }
+    }
+
+    // parse the trees into arena instead of the ln_pool (0: off). Every get_tree then retires the
+    // previous tree, so the ln_pool mark-and-sweep is not needed (see uses_arena). The arena implies
+    // scan_tree_parser, with the self-check check (see set_parser_check).
+    void set_arena( tree_arena *arena, tree_parser_check *check ) {
+        if( arena != 0 ) {
+            set_parser_check( check );
+
+            if( parser_check_ == 0 ) {
+                return;
+            }
+        }
+
+        arena_ = arena;
+        arena_parser_.reset( arena != 0 ? new arena_tree_parser( *arena ) : 0 );
+    }
+
+    // true if the trees are in the arena. Can become false at any tree, if scan_tree_parser does not
+    // reproduce the ivy_mike parser or rejects the tree.
+    bool uses_arena() const {
+        return arena_ != 0;
+    }
+
+
+    void dump_position() {
+        std::cerr << "trace reader lines: " << line_count_ << "\n";
+        std::cerr << line_.str() << "\n";
+    }
+
+    trace_element::trace_type next() {
+        phase_timer timer( stats_, run_stats::trace_io );
+
+        while( true ) {
+            if( !source_->next_line( line_ ) ) {
+                element_type_ = trace_element::none;
+
+                return element_type_;
+            }
+            ++line_count_;
+
+            if( stats_ != 0 ) {
+                stats_->inc( run_stats::lines );
+            }
+
+            element_type_ = classify_record( line_ );
+
+            if( element_type_ == trace_element::none ) {
+                continue; // ignore anything else
+            }
+
+            return element_type_;
+        }
+    }
+
+    // the newick text of the current @tree record, as parsed by get_tree. Valid until the next call
+    // to next()
+    char_range get_tree_text() const {
+        if( element_type_ != trace_element::tree ) {
+            throw std::runtime_error( "element_type_ != trace_element::tree" );
+        }
+
+        const char *first = std::find( line_.first, line_.last, '(' );
+        assert( first != line_.last );
+
+        return char_range( first, line_.last );
+    }
+
+    trace_tree get_tree() {
+        const char *first = get_tree_text().first;
+
+        if( parser_check_ != 0 ) {
+            ivy_mike::tree_parser_ms::lnode *t = 0;
+
+            try {
+                if( arena_ != 0 ) {
+                    arena_->clear();
+                    t = arena_parser_->parse( first, line_.last );
+                } else {
+                    t = pool_parser_.parse( first, line_.last );
+                }
+            } catch( const std::runtime_error &e ) {
+                std::ostringstream what;
+                what << e.what() << " (trace line " << line_count_ << ")";
+                parser_check_->reject( what.str() );
+            }
+
+            if( t != 0 && parser_check_->accept( t, first, line_.last ) ) {
+                return trace_tree(t);
+            }
+
+            // the ivy_mike parser and the ln_pool from now on (the nodes of a rejected tree in the
+            // pool are released by the next sweep)
+            set_parser_check( 0 );
+        }
+
+        ivy_mike::tree_parser_ms::parser p( first, line_.last, *pool_ );
+
+        ivy_mike::tree_parser_ms::lnode *t = p.parse();
+
+        return trace_tree(t);
+
+    }
+
+    // decodes all @subtree and @insertion records up to the next @tree record (or the end of the
+    // trace) into batch (the tip names are resolved through the taxon dictionary). The reader must be
+    // positioned on a @tree record (the tree itself is not parsed). Returns the type of the record
+    // that ended the block, i.e., the reader is positioned as after the corresponding calls to next().
+    //
+    // max_subtrees: decode at most this many subtree blocks (0: all of the tree). The reader then
+    // stops on the next @subtree record (and returns trace_element::subtree), the following call
+    // continues with it.
+    trace_element::trace_type read_records( const taxon_dict &dict, trace_record_batch &batch, size_t max_subtrees = 0 ) {
+        batch.clear();
+        batch.dict_ = &dict;
+
+        const bool stable = source_->stable();
+        size_t subtrees = 0;
+
+        // the current record only belongs to the batch if it is the @subtree record a previous call stopped on
+        trace_element::trace_type type = element_type_ == trace_element::subtree ? element_type_ : next();
+
+        for( ; ; type = next() ) {
+            if( type != trace_element::subtree && type != trace_element::insertion ) {
+                break;
+            }
+
+            if( type == trace_element::subtree ) {
+                if( max_subtrees != 0 && subtrees == max_subtrees ) {
+                    break;
+                }
+                ++subtrees;
+            }
+
+            phase_timer timer( stats_, run_stats::trace_io );
+            batch.add( type, type == trace_element::insertion ? insertion_score( line_ ) : 0.0, line_count_, tip_list_range(), stable );
+        }
+
+        batch.finish();
+        return type;
+    }
+
+    // the get_*_split variants decode the current record: they resolve the tip names through the
+    // taxon dictionary and set the corresponding bits directly in split while scanning the record
+    // (split must already have the size of the dictionary and be cleared). Only spr_bench uses them
+    // (as the streaming baseline), the trace walk decodes the records with read_records.
+
+    // returns the number of tips in the subtree
+    template<typename split_type>
+    size_t get_subtree_split( const taxon_dict &dict, split_type &split ) {
+        if( element_type_ != trace_element::subtree ) {
+            throw std::runtime_error( "element_type_ != trace_element::subtree" );
+        }
+
+        return tip_list_to_bits( dict, split );
+    }
+
+    // returns the score of the insertion
+    template<typename split_type>
+    double get_insertion_split( const taxon_dict &dict, split_type &split ) {
+        if( element_type_ != trace_element::insertion ) {
+            throw std::runtime_error( "element_type_ != trace_element::insertion" );
+        }
+
+        tip_list_to_bits( dict, split );
+        return insertion_score( line_ );
+    }
+
+private:
+    // the tip list between the ( ) of the current record line
+    char_range tip_list_range() const {
+        const char *first = std::find( line_.first, line_.last, '(' );
+        if( first == line_.last ) {
+            throw std::runtime_error( bad_record( "no '(' before the tip list" ) );
+        }
+        ++first;
+
+        const char *last = std::find( first, line_.last, ')' );
+        if( last == line_.last ) {
+            throw std::runtime_error( bad_record( "no ')' after the tip list" ) );
+        }
+
+        return char_range( first, last );
+    }
+
+    std::string bad_record( const char *what ) const {
+        std::ostringstream os;
+        os << "malformed record at trace line " << line_count_ << ": " << what;
+        return os.str();
+    }
+
+    static double insertion_score( const char_range &line ) {
+        ws_tokenizer tok( line.first, line.last );
+        char_range token;
+        tok.next( token );
+        assert( token == "@insertion" );
+        tok.next( token );
+        assert( !token.empty() );
+
+        return parse_score( token );
+    }
+
+    template<typename split_type>
+    size_t tip_list_to_bits( const taxon_dict &dict, split_type &split ) {
+        char_range tips = tip_list_range();
+        ws_tokenizer tok( tips.first, tips.last );
+        char_range name;
+        size_t n = 0;
+
+        while( tok.next( name ) ) {
+            const size_t idx = dict.lookup( name.first, name.last );
+
+            if( idx == taxon_dict::npos ) {
+                dump_position();
+                throw std::runtime_error( "unknown taxon in trace: " + name.str() );
+            }
+            split.set( idx );
+            ++n;
+        }
+        return n;
+    }
+
+    static double parse_score( const char_range &token ) {
+        // the token is not 0-terminated inside the mapping, so copy it to a small buffer for strtod
+        char buf[64];
+        const size_t len = std::min( token.size(), sizeof(buf) - 1 );
+        std::copy( token.first, token.first + len, buf );
+        buf[len] = 0;
+
+        return strtod( buf, 0 );
+    }
+
+    boost::scoped_ptr<line_source> source_;
+    ivy_mike::tree_parser_ms::ln_pool * const pool_; // this is a non owning shared ptr! Switch to shared_ptr at some point!
+
+    ln_pool_alloc pool_alloc_;
+    pool_tree_parser pool_parser_;
+
+    tree_arena *arena_; // non owning
+    boost::scoped_ptr<arena_tree_parser> arena_parser_;
+    tree_parser_check *parser_check_; // non owning
+
+    char_range line_;
+    trace_element::trace_type element_type_;
+
+    size_t line_count_;
+    run_stats *stats_;
+};
+
+#endif
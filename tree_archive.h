@@ -0,0 +1,219 @@
+#ifndef __tree_archive_h
+#define __tree_archive_h
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "tree_sink.h"
+
+// packed output: instead of one file per tree, the trees are appended to a few large segment
+// files (<dir>/trees.<n>.seg) and a compact index (<dir>/trees.idx) maps the tree keys to
+// (segment, offset, size). Layout of the index: 8 byte magic, then one 32 byte little-endian
+// record per tree:
+//
+//   u32 tree | u32 subtree | u32 insertion | u8 kind | 3 x u8 pad | u32 segment | u32 size | u64 offset
+namespace tree_archive {
+    const char magic[8] = { 'S', 'P', 'R', 'A', 'R', 'C', '0', '1' };
+    const size_t record_size = 32;
+
+    inline std::string index_name( const std::string &dir ) {
+        return dir + "/trees.idx";
+    }
+
+    inline std::string segment_name( const std::string &dir, boost::uint32_t segment ) {
+        std::stringstream ss;
+        ss << dir << "/trees." << segment << ".seg";
+        return ss.str();
+    }
+
+    inline void put_le( char *p, boost::uint64_t v, size_t bytes ) {
+        for( size_t i = 0; i < bytes; ++i ) {
+            p[i] = char( (v >> (8 * i)) & 0xff );
+        }
+    }
+
+    inline boost::uint64_t get_le( const char *p, size_t bytes ) {
+        boost::uint64_t v = 0;
+        for( size_t i = 0; i < bytes; ++i ) {
+            v |= boost::uint64_t( (unsigned char)p[i] ) << (8 * i);
+        }
+        return v;
+    }
+
+    struct entry {
+        tree_key key;
+        boost::uint32_t segment;
+        boost::uint32_t size;
+        boost::uint64_t offset;
+
+        void encode( char *rec ) const {
+            std::fill( rec, rec + record_size, 0 );
+            put_le( rec, key.tree, 4 );
+            put_le( rec + 4, key.subtree, 4 );
+            put_le( rec + 8, key.insertion, 4 );
+            rec[12] = char(key.kind);
+            put_le( rec + 16, segment, 4 );
+            put_le( rec + 20, size, 4 );
+            put_le( rec + 24, offset, 8 );
+        }
+
+        void decode( const char *rec ) {
+            key.tree = boost::uint32_t( get_le( rec, 4 ) );
+            key.subtree = boost::uint32_t( get_le( rec + 4, 4 ) );
+            key.insertion = boost::uint32_t( get_le( rec + 8, 4 ) );
+            key.kind = tree_key::kind_type( rec[12] );
+            segment = boost::uint32_t( get_le( rec + 16, 4 ) );
+            size = boost::uint32_t( get_le( rec + 20, 4 ) );
+            offset = get_le( rec + 24, 8 );
+        }
+
+        bool operator<( const entry &other ) const {
+            return key < other.key;
+        }
+    };
+}
+
+class tree_archive_writer : public tree_sink {
+public:
+    tree_archive_writer( const std::string &dir, boost::uint64_t segment_size )
+      : dir_(dir),
+        segment_size_(segment_size),
+        segment_(0),
+        segment_offset_(0)
+    {
+        idx_.open( tree_archive::index_name( dir_ ).c_str(), std::ios::binary );
+        if( !idx_.good() ) {
+            throw std::runtime_error( "cannot open archive index: " + tree_archive::index_name( dir_ ) );
+        }
+        idx_.write( tree_archive::magic, sizeof( tree_archive::magic ) );
+
+        open_segment();
+    }
+
+    virtual void write( const tree_key &key, const char *data, size_t size ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+
+        if( segment_offset_ > 0 && segment_offset_ + size > segment_size_ ) {
+            ++segment_;
+            segment_offset_ = 0;
+            open_segment();
+        }
+
+        seg_.write( data, size );
+
+        tree_archive::entry e;
+        e.key = key;
+        e.segment = segment_;
+        e.size = boost::uint32_t(size);
+        e.offset = segment_offset_;
+
+        char rec[tree_archive::record_size];
+        e.encode( rec );
+        idx_.write( rec, sizeof(rec) );
+
+        segment_offset_ += size;
+
+        if( !seg_.good() || !idx_.good() ) {
+            throw std::runtime_error( "error while writing tree archive in " + dir_ );
+        }
+    }
+
+    // the index is written with the trees, so a flushed archive can already be read
+    virtual void flush() {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+        seg_.flush();
+        idx_.flush();
+    }
+
+private:
+    void open_segment() {
+        const std::string name = tree_archive::segment_name( dir_, segment_ );
+
+        seg_.close();
+        seg_.open( name.c_str(), std::ios::binary );
+
+        if( !seg_.good() ) {
+            throw std::runtime_error( "cannot open archive segment: " + name );
+        }
+    }
+
+    const std::string dir_;
+    const boost::uint64_t segment_size_;
+
+    boost::uint32_t segment_;
+    boost::uint64_t segment_offset_;
+
+    std::ofstream seg_;
+    std::ofstream idx_;
+
+    boost::mutex mtx_;
+};
+
+class tree_archive_reader {
+public:
+    typedef tree_archive::entry entry;
+
+    tree_archive_reader( const std::string &dir ) : dir_(dir) {
+        const std::string name = tree_archive::index_name( dir_ );
+        std::ifstream is( name.c_str(), std::ios::binary );
+
+        char magic[sizeof(tree_archive::magic)];
+        if( !is.read( magic, sizeof(magic) ) || !std::equal( magic, magic + sizeof(magic), tree_archive::magic ) ) {
+            throw std::runtime_error( "not a tree archive index: " + name );
+        }
+
+        char rec[tree_archive::record_size];
+        while( is.read( rec, sizeof(rec) ) ) {
+            entry e;
+            e.decode( rec );
+            entries_.push_back( e );
+        }
+
+        sorted_ = entries_;
+        std::sort( sorted_.begin(), sorted_.end() );
+    }
+
+    // in archive (i.e., trace) order
+    const std::vector<entry> &entries() const {
+        return entries_;
+    }
+
+    const entry *find( const tree_key &key ) const {
+        entry e;
+        e.key = key;
+
+        std::vector<entry>::const_iterator it = std::lower_bound( sorted_.begin(), sorted_.end(), e );
+        if( it == sorted_.end() || e < *it ) {
+            return 0;
+        }
+        return &(*it);
+    }
+
+    std::string read( const entry &e ) const {
+        const std::string name = tree_archive::segment_name( dir_, e.segment );
+        std::ifstream is( name.c_str(), std::ios::binary );
+
+        std::string data( e.size, 0 );
+
+        is.seekg( e.offset );
+        if( e.size > 0 && !is.read( &data[0], e.size ) ) {
+            throw std::runtime_error( "cannot read tree from archive segment: " + name );
+        }
+        return data;
+    }
+
+private:
+    const std::string dir_;
+    std::vector<entry> entries_;
+    std::vector<entry> sorted_;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include <iostream>
+#include <stdexcept>
+
+#include "tree_archive.h"
+
+// reads trees back out of the packed output of spr_vis_test --archive. The trees are addressed by
+// their names in the one-file-per-tree layout (e.g., x.1.2, y.1.2 or 1.2.3). Without tree names,
+// the index is listed.
+int main( int argc, char *argv[] ) {
+    if( argc < 2 ) {
+        std::cerr << "usage: " << argv[0] << " <archive dir> [tree name ...]\n";
+        return 1;
+    }
+
+    tree_archive_reader archive( argv[1] );
+
+    if( argc == 2 ) {
+        const std::vector<tree_archive_reader::entry> &entries = archive.entries();
+
+        for( std::vector<tree_archive_reader::entry>::const_iterator it = entries.begin(); it != entries.end(); ++it ) {
+            std::cout << it->key.name() << "\t" << it->segment << "\t" << it->offset << "\t" << it->size << "\n";
+        }
+        return 0;
+    }
+
+    for( int i = 2; i < argc; ++i ) {
+        tree_key key;
+
+        if( !tree_key::parse( argv[i], key ) ) {
+            throw std::runtime_error( std::string( "bad tree name: " ) + argv[i] );
+        }
+
+        const tree_archive_reader::entry *e = archive.find( key );
+
+        if( e == 0 ) {
+            std::cerr << "tree not in archive: " << argv[i] << "\n";
+            return 1;
+        }
+
+        std::cout << archive.read( *e );
+    }
+
+    return 0;
+}
@@ -0,0 +1,393 @@
+#ifndef __tree_arena_h
+#define __tree_arena_h
+
+#include <cassert>
+#include <cctype>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "ivymike/tree_parser.h"
+#include "newick_scan.h"
+
+// region allocation of the lnodes and node data of one tree. The nodes are bump-allocated from
+// slabs (in parse order, i.e., a tree sits contiguously in DFS order) and the whole tree is
+// released in O(1) by clear(), instead of a mark-and-sweep pass over an ln_pool.
+//
+// REMARK: the slabs are never shrunk and the objects are only destroyed with the arena. A recycled
+// lnode keeps the allocations of its strings (tip names, labels), so a trace with a constant taxon
+// set does not allocate after the first tree.
+class tree_arena {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+    typedef ivy_mike::tree_parser_ms::adata adata;
+
+    tree_arena( size_t slab_size = 4096 ) : slab_size_(slab_size), node_slab_(0), node_pos_(0), data_slab_(0), data_pos_(0), keepalive_(new int(0)) {
+        assert( slab_size_ > 0 );
+    }
+
+    ~tree_arena() {
+        for( size_t i = 0; i < node_slabs_.size(); ++i ) {
+            delete[] node_slabs_[i];
+        }
+        for( size_t i = 0; i < data_slabs_.size(); ++i ) {
+            delete[] data_slabs_[i];
+        }
+    }
+
+    // retire the current tree. All lnodes handed out since the last clear become invalid.
+    void clear() {
+        node_slab_ = 0;
+        node_pos_ = 0;
+        data_slab_ = 0;
+        data_pos_ = 0;
+    }
+
+    // a fresh (unlinked) lnode
+    lnode *alloc_node() {
+        lnode *n = bump( node_slabs_, node_slab_, node_pos_ );
+
+        n->next = 0;
+        n->back = 0;
+        n->m_data.reset();
+        n->backLen = 0;
+        n->backSupport = 0;
+        n->backLabel.clear();
+        n->mark = false;
+        n->towards_root = false;
+        return n;
+    }
+
+    // fresh node data. The shared_ptr does not own the object (it shares the reference count of
+    // the arena), so handing it out does not allocate.
+    boost::shared_ptr<adata> alloc_data() {
+        adata *d = bump( data_slabs_, data_slab_, data_pos_ );
+
+        d->isTip = false;
+        d->tipName.clear();
+        return boost::shared_ptr<adata>( keepalive_, d );
+    }
+
+    // number of lnodes of the current tree
+    size_t size() const {
+        return node_slab_ * slab_size_ + node_pos_;
+    }
+
+private:
+    tree_arena( const tree_arena & );
+    tree_arena &operator=( const tree_arena & );
+
+    template<typename T>
+    T *bump( std::vector<T *> &slabs, size_t &slab, size_t &pos ) {
+        if( pos == slab_size_ ) {
+            ++slab;
+            pos = 0;
+        }
+
+        if( slab == slabs.size() ) {
+            slabs.push_back( new T[slab_size_] );
+        }
+
+        return &slabs[slab][pos++];
+    }
+
+    const size_t slab_size_;
+
+    std::vector<lnode *> node_slabs_;
+    size_t node_slab_;
+    size_t node_pos_;
+
+    std::vector<adata *> data_slabs_;
+    size_t data_slab_;
+    size_t data_pos_;
+
+    boost::shared_ptr<int> keepalive_;
+};
+
+// the node allocation of scan_tree_parser for the ln_pool: the nodes come from ln_pool::alloc, the
+// node data is allocated per node like in the ivy_mike parser, so the tree is released by the usual
+// mark-and-sweep of the pool.
+class ln_pool_alloc {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+    typedef ivy_mike::tree_parser_ms::adata adata;
+
+    ln_pool_alloc( ivy_mike::tree_parser_ms::ln_pool &pool ) : pool_(pool) {}
+
+    lnode *alloc_node() {
+        return pool_.alloc();
+    }
+
+    boost::shared_ptr<adata> alloc_data() {
+        return boost::shared_ptr<adata>( new adata );
+    }
+
+private:
+    ivy_mike::tree_parser_ms::ln_pool &pool_;
+};
+
+// newick parser building the tree in a tree_arena or an ln_pool (alloc: tree_arena or ln_pool_alloc).
+// The tree has the same layout as the one of the ivy_mike parser: an unrooted (trifurcating) root
+// ring with the children on node, node->next and node->next->next, inner rings with the children on
+// next and next->next and the node itself pointing towards the root. Both ends of an edge carry the
+// branch length.
+//
+// The parser is iterative, so deep (e.g., caterpillar) trees do not exhaust the stack. The tokens are
+// scanned with newick_scan (SSE2 search for the delimiters, branch lengths converted in place),
+// the tip names are assigned to the strings of the node data. In a tree_arena the strings are
+// recycled, so a tree is parsed without any allocation once the arena has grown to its size.
+template<typename alloc_type>
+class scan_tree_parser {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    scan_tree_parser( alloc_type &alloc ) : alloc_(alloc) {}
+
+    // parses the newick tree in [first,last) (starting at the opening bracket) into the allocator.
+    // Returns the root node.
+    lnode *parse( const char *first, const char *last ) {
+        p_ = first;
+        last_ = last;
+        stack_.clear();
+
+        skip_ws();
+        expect( '(' );
+
+        lnode *root = alloc_inner();
+        stack_.push_back( frame( root, true ) );
+
+        while( true ) {
+            // one child of the innermost open node
+            skip_ws();
+
+            if( p_ != last_ && *p_ == '(' ) {
+                ++p_;
+                lnode *n = alloc_inner();
+                attach( n );
+                stack_.push_back( frame( n, false ) );
+                continue;
+            }
+
+            lnode *tip = alloc_tip();
+            attach( tip );
+            parse_length( tip );
+
+            // separators and closing brackets up to the next child
+            while( true ) {
+                skip_ws();
+
+                if( p_ == last_ ) {
+                    throw std::runtime_error( "newick parser: unexpected end of tree" );
+                }
+
+                if( *p_ == ',' ) {
+                    ++p_;
+                    break;
+                }
+
+                expect( ')' );
+
+                const frame f = stack_.back();
+                stack_.pop_back();
+
+                if( f.children != (f.root ? 3 : 2) ) {
+                    throw std::runtime_error( "newick parser: only binary trees with a trifurcating root are supported" );
+                }
+
+                if( stack_.empty() ) {
+                    return root;
+                }
+
+                parse_label( f.node );
+                parse_length( f.node );
+            }
+        }
+    }
+
+private:
+    struct frame {
+        lnode *node;
+        bool root;
+        int children;
+
+        frame( lnode *n, bool r ) : node(n), root(r), children(0) {}
+    };
+
+    void skip_ws() {
+        while( p_ != last_ && std::isspace( (unsigned char)*p_ ) ) {
+            ++p_;
+        }
+    }
+
+    void expect( char c ) {
+        if( p_ == last_ || *p_ != c ) {
+            throw std::runtime_error( std::string( "newick parser: expected " ) + c );
+        }
+        ++p_;
+    }
+
+    lnode *alloc_inner() {
+        lnode *a = alloc_.alloc_node();
+        lnode *b = alloc_.alloc_node();
+        lnode *c = alloc_.alloc_node();
+
+        a->next = b;
+        b->next = c;
+        c->next = a;
+        a->m_data = b->m_data = c->m_data = alloc_.alloc_data();
+        return a;
+    }
+
+    lnode *alloc_tip() {
+        skip_ws();
+        const char *start = p_;
+        p_ = newick_scan::find_delimiter( p_, last_ );
+
+        if( start == p_ ) {
+            throw std::runtime_error( "newick parser: empty tip name" );
+        }
+
+        lnode *n = alloc_.alloc_node();
+        n->m_data = alloc_.alloc_data();
+        n->m_data->isTip = true;
+        n->m_data->tipName.assign( start, p_ );
+        return n;
+    }
+
+    // links n to the next free child slot of the innermost open node
+    void attach( lnode *n ) {
+        frame &f = stack_.back();
+
+        if( f.children == (f.root ? 3 : 2) ) {
+            throw std::runtime_error( "newick parser: only binary trees with a trifurcating root are supported" );
+        }
+
+        lnode *slot = f.root ? f.node : f.node->next;
+        for( int i = 0; i < f.children; ++i ) {
+            slot = slot->next;
+        }
+        ++f.children;
+
+        slot->back = n;
+        n->back = slot;
+    }
+
+    // optional label of an inner node (e.g., a support value)
+    void parse_label( lnode *n ) {
+        skip_ws();
+        const char *start = p_;
+        p_ = newick_scan::find_delimiter( p_, last_ );
+        if( start != p_ ) {
+            n->backLabel.assign( start, p_ );
+            n->back->backLabel = n->backLabel;
+        }
+    }
+
+    // optional branch length of the edge above n
+    void parse_length( lnode *n ) {
+        skip_ws();
+        if( p_ == last_ || *p_ != ':' ) {
+            return;
+        }
+        ++p_;
+        skip_ws();
+
+        const char *start = p_;
+        p_ = newick_scan::find_delimiter( p_, last_ );
+
+        double l;
+        if( !newick_scan::parse_double( start, p_, l ) ) {
+            throw std::runtime_error( "newick parser: bad branch length" );
+        }
+
+        n->backLen = l;
+        n->back->backLen = l;
+    }
+
+    alloc_type &alloc_;
+
+    const char *p_;
+    const char *last_;
+    std::vector<frame> stack_;
+};
+
+typedef scan_tree_parser<tree_arena> arena_tree_parser;
+typedef scan_tree_parser<ln_pool_alloc> pool_tree_parser;
+
+// true if both trees give the same print_newick output (used to check scan_tree_parser against the
+// ivy_mike parser before relying on it)
+inline bool same_newick( ivy_mike::tree_parser_ms::lnode *a, ivy_mike::tree_parser_ms::lnode *b ) {
+    std::ostringstream sa;
+    std::ostringstream sb;
+    ivy_mike::tree_parser_ms::print_newick( a, sa );
+    ivy_mike::tree_parser_ms::print_newick( b, sb );
+    return sa.str() == sb.str();
+}
+
+// the self-check of scan_tree_parser: the first tree of a run is also parsed with the ivy_mike parser
+// and both trees are compared. One check is shared by all readers of a run (i.e., by all worker
+// threads and all trees), so it runs once per process. If it fails, or scan_tree_parser rejects a
+// tree, all readers fall back to the ivy_mike parser and the ln_pool (see trace_reader::set_parser_check).
+class tree_parser_check {
+public:
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    tree_parser_check() : state_(not_checked) {}
+
+    // true if the tree parsed by scan_tree_parser from the newick text [first,last) can be used. The
+    // first call parses the text again (into a scratch pool, so the pool of the caller is not swept)
+    // and compares the trees.
+    bool accept( lnode *tree, const char *first, const char *last ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+
+        if( state_ == not_checked ) {
+            ivy_mike::tree_parser_ms::ln_pool pool;
+            ivy_mike::tree_parser_ms::parser p( first, last, pool );
+            lnode *ref = p.parse();
+
+            if( same_newick( tree, ref ) ) {
+                state_ = check_passed;
+            } else {
+                std::cerr << "newick parser does not reproduce the ivy_mike parser. Falling back to the ivy_mike parser.\n";
+                state_ = check_failed;
+            }
+
+            pool.clear();
+            pool.sweep();
+        }
+        return state_ == check_passed;
+    }
+
+    // scan_tree_parser failed on a tree (what: the parse error)
+    void reject( const std::string &what ) {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+
+        if( state_ != check_failed ) {
+            std::cerr << what << ". Falling back to the ivy_mike parser.\n";
+            state_ = check_failed;
+        }
+    }
+
+    bool failed() const {
+        boost::lock_guard<boost::mutex> lock( mtx_ );
+        return state_ == check_failed;
+    }
+
+private:
+    enum check_state {
+        not_checked,
+        check_passed,
+        check_failed
+    };
+
+    mutable boost::mutex mtx_;
+    check_state state_;
+};
+
+#endif
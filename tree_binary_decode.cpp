@@ -0,0 +1,96 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "binary_tree.h"
+#include "tree_archive.h"
+
+// converts the binary output of spr_vis_test --binary back to newick. The output directory can be in
+// the one-file-per-tree layout or an archive (--archive). The trees are addressed by their names
+// (e.g., x.1.2, y.1.2 or 1.2.3), without tree names all trees are converted.
+
+static std::string read_file( const std::string &name ) {
+    std::ifstream is( name.c_str(), std::ios::binary );
+
+    if( !is.good() ) {
+        throw std::runtime_error( "cannot open: " + name );
+    }
+
+    std::ostringstream ss;
+    ss << is.rdbuf();
+    return ss.str();
+}
+
+int main( int argc, char *argv[] ) {
+    if( argc < 2 ) {
+        std::cerr << "usage: " << argv[0] << " <tree dir> [tree name ...]\n";
+        return 1;
+    }
+
+    const std::string dir = argv[1];
+    const bool archive = std::ifstream( tree_archive::index_name( dir ).c_str() ).good();
+
+    if( !archive ) {
+        if( argc == 2 ) {
+            std::cerr << "tree names are required for the one-file-per-tree layout\n";
+            return 1;
+        }
+
+        const binary_tree::taxon_table taxa( read_file( dir + "/taxa" ) );
+
+        for( int i = 2; i < argc; ++i ) {
+            std::cout << binary_tree::to_newick( read_file( dir + "/" + argv[i] ), taxa );
+        }
+        return 0;
+    }
+
+    tree_archive_reader reader( dir );
+
+    tree_key taxa_key;
+    tree_key::parse( "taxa", taxa_key );
+
+    const tree_archive_reader::entry *taxa_entry = reader.find( taxa_key );
+    if( taxa_entry == 0 ) {
+        std::cerr << "no taxon table in archive (not written with --binary?)\n";
+        return 1;
+    }
+
+    const binary_tree::taxon_table taxa( reader.read( *taxa_entry ) );
+
+    if( argc == 2 ) {
+        const std::vector<tree_archive_reader::entry> &entries = reader.entries();
+
+        for( std::vector<tree_archive_reader::entry>::const_iterator it = entries.begin(); it != entries.end(); ++it ) {
+            if( it->key.kind == tree_key::pruned_tree || it->key.kind == tree_key::pruned_subtree || it->key.kind == tree_key::spr_tree ) {
+                const std::string newick = binary_tree::to_newick( reader.read( *it ), taxa );
+                std::cout << it->key.name() << "\t" << newick;
+
+                // the rooted subtrees (y.*) have no line end
+                if( newick.empty() || newick[newick.size() - 1] != '\n' ) {
+                    std::cout << "\n";
+                }
+            }
+        }
+        return 0;
+    }
+
+    for( int i = 2; i < argc; ++i ) {
+        tree_key key;
+
+        if( !tree_key::parse( argv[i], key ) ) {
+            throw std::runtime_error( std::string( "bad tree name: " ) + argv[i] );
+        }
+
+        const tree_archive_reader::entry *e = reader.find( key );
+
+        if( e == 0 ) {
+            std::cerr << "tree not in archive: " << argv[i] << "\n";
+            return 1;
+        }
+
+        std::cout << binary_tree::to_newick( reader.read( *e ), taxa );
+    }
+
+    return 0;
+}
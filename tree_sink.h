@@ -0,0 +1,183 @@
+#ifndef __tree_sink_h
+#define __tree_sink_h
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+
+// identifies one of the trees written for a trace:
+//  - pruned_tree:    the tree after a subtree has been pruned (trees/x.<tree>.<subtree>)
+//  - pruned_subtree: the pruned subtree as rooted newick (trees/y.<tree>.<subtree>)
+//  - spr_tree:       the tree with the subtree re-inserted (trees/<tree>.<subtree>.<insertion>)
+//  - taxon_table:    the taxon names of the binary output, written once with the first tree (trees/taxa)
+//  - placement_table: the placement weights of all subtrees of a tree (trees/w.<tree>, --aggregate)
+//  - annotated_tree: the tree with the per-edge placement weights (trees/z.<tree>, --aggregate-tree)
+//  - rf_table:       the RF distances of the SPR trees of a tree to the tree (trees/r.<tree>, --rf)
+//  - dedup_table:    the SPR trees not written because of an equal topology (trees/d.<tree>, --dedup)
+//  - delta:          the tree and the moves of all its SPR trees, instead of the trees (trees/m.<tree>, --delta)
+struct tree_key {
+    enum kind_type {
+        pruned_tree = 'x',
+        pruned_subtree = 'y',
+        spr_tree = 't',
+        taxon_table = 'n',
+        placement_table = 'w',
+        annotated_tree = 'z',
+        rf_table = 'r',
+        dedup_table = 'd',
+        delta = 'm'
+    };
+
+    kind_type kind;
+    boost::uint32_t tree;
+    boost::uint32_t subtree;
+    boost::uint32_t insertion; // 0 for everything but spr_tree
+
+    tree_key() : kind(spr_tree), tree(0), subtree(0), insertion(0) {}
+
+    tree_key( kind_type k, size_t t, size_t s, size_t i = 0 )
+      : kind(k), tree(boost::uint32_t(t)), subtree(boost::uint32_t(s)), insertion(boost::uint32_t(i)) {}
+
+    // the file name in the traditional one-file-per-tree layout
+    std::string name() const {
+        std::stringstream ss;
+
+        if( kind == spr_tree ) {
+            ss << tree << "." << subtree << "." << insertion;
+        } else if( kind == taxon_table ) {
+            ss << "taxa";
+        } else if( kind == placement_table || kind == annotated_tree || kind == rf_table || kind == dedup_table || kind == delta ) {
+            ss << char(kind) << "." << tree;
+        } else {
+            ss << char(kind) << "." << tree << "." << subtree;
+        }
+        return ss.str();
+    }
+
+    // inverse of name(). Returns false if name is not a valid tree name.
+    static bool parse( const std::string &name, tree_key &key ) {
+        unsigned int t = 0, s = 0, i = 0;
+        char k = 0;
+        char tail = 0;
+
+        if( name == "taxa" ) {
+            key = tree_key( taxon_table, 1, 0 );
+            return true;
+        } else if( sscanf( name.c_str(), "%c.%u%c", &k, &t, &tail ) == 2 && (k == 'w' || k == 'z' || k == 'r' || k == 'd' || k == 'm') ) {
+            key = tree_key( kind_type(k), t, 0 );
+            return true;
+        } else if( sscanf( name.c_str(), "%c.%u.%u%c", &k, &t, &s, &tail ) == 3 && (k == 'x' || k == 'y') ) {
+            key = tree_key( kind_type(k), t, s );
+            return true;
+        } else if( sscanf( name.c_str(), "%u.%u.%u%c", &t, &s, &i, &tail ) == 3 ) {
+            key = tree_key( spr_tree, t, s, i );
+            return true;
+        }
+        return false;
+    }
+
+    bool operator<( const tree_key &other ) const {
+        if( tree != other.tree ) {
+            return tree < other.tree;
+        } else if( subtree != other.subtree ) {
+            return subtree < other.subtree;
+        } else if( insertion != other.insertion ) {
+            return insertion < other.insertion;
+        } else {
+            return kind < other.kind;
+        }
+    }
+};
+
+// destination of the trees written during the trace walk
+class tree_sink {
+public:
+    virtual ~tree_sink() {}
+
+    virtual void write( const tree_key &key, const char *data, size_t size ) = 0;
+
+    void write( const tree_key &key, const std::string &data ) {
+        write( key, data.data(), data.size() );
+    }
+
+    // push the written trees to the files (e.g., in --follow mode, for readers of the live output)
+    virtual void flush() {}
+};
+
+// the traditional layout: one file per tree in a directory. Different keys go to different files,
+// so this can be used from multiple threads at once.
+class file_tree_sink : public tree_sink {
+public:
+    file_tree_sink( const std::string &dir ) : dir_(dir) {}
+
+    virtual void write( const tree_key &key, const char *data, size_t size ) {
+        const std::string filename = dir_ + "/" + key.name();
+        std::ofstream os( filename.c_str(), std::ios::binary );
+
+        if( !os.good() ) {
+            throw std::runtime_error( "cannot open output file: " + filename );
+        }
+        os.write( data, size );
+        os.close();
+
+        if( !os ) {
+            throw std::runtime_error( "error while writing output file: " + filename );
+        }
+    }
+
+private:
+    const std::string dir_;
+};
+
+// keeps the trees in memory until they are flushed to another sink. The pipeline uses this to
+// write the trees of a tree block in trace order.
+class buffered_tree_sink : public tree_sink {
+public:
+    virtual void write( const tree_key &key, const char *data, size_t size ) {
+        entry e;
+        e.key = key;
+        e.offset = buf_.size();
+        e.size = size;
+
+        buf_.insert( buf_.end(), data, data + size );
+        entries_.push_back( e );
+    }
+
+    void flush_to( tree_sink &target ) {
+        for( std::vector<entry>::iterator it = entries_.begin(); it != entries_.end(); ++it ) {
+            target.write( it->key, buf_.empty() ? 0 : &buf_[it->offset], it->size );
+        }
+        clear();
+    }
+
+    void clear() {
+        buf_.clear();
+        entries_.clear();
+    }
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    // bytes of tree data in the buffer
+    size_t bytes() const {
+        return buf_.size();
+    }
+
+private:
+    struct entry {
+        tree_key key;
+        size_t offset;
+        size_t size;
+    };
+
+    std::vector<char> buf_;
+    std::vector<entry> entries_;
+};
+
+#endif